@@ -0,0 +1,61 @@
+/*
+ * Copyright 2003 by Adam Luter
+ * This file is part of Squash, a C/Ncurses-based unix music player.
+ *
+ * Squash is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Squash is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Squash; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+/*
+ * analyze.h
+ */
+#ifndef SQUASH_ANALYZE_H
+#define SQUASH_ANALYZE_H
+
+/* Loudness songs are leveled to, in LUFS (the ReplayGain 2 reference) */
+#define ANALYZE_REFERENCE_LOUDNESS -18.0
+
+/* Most channels the loudness meter will take */
+#define LOUDNESS_MAX_CHANNELS 8
+
+/*
+ * Structures
+ */
+/* EBU R128 integrated loudness meter, see loudness_*() */
+typedef struct loudness_s {
+    int channels;
+    double b[2][3];             /* the two K-weighting biquads */
+    double a[2][3];
+    double z[ LOUDNESS_MAX_CHANNELS ][4];
+    double sum;                 /* K-weighted energy of the current 100ms block */
+    long frames;                /* frames in the current 100ms block */
+    long block_frames;
+    double *blocks;             /* mean square of each finished 100ms block */
+    long block_count;
+    long block_count_allocated;
+    int peak;
+} loudness_t;
+
+/*
+ * Prototypes
+ */
+void analyze_init( void );
+void *song_analyzer( void *input_data );
+void *song_scanner( void *input_data );
+bool analyze_song( char *filename, enum song_type_e type, long *trim_start, long *trim_end, double *loudness, double *peak );
+bool loudness_init( loudness_t *meter, int channels, int rate );
+void loudness_add( loudness_t *meter, const short *samples, long frames );
+double loudness_result( loudness_t *meter );
+void loudness_free( loudness_t *meter );
+
+#endif
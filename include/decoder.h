@@ -0,0 +1,37 @@
+/*
+ * Copyright 2003 by Adam Luter
+ * This file is part of Squash, a C/Ncurses-based unix music player.
+ *
+ * Squash is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Squash is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Squash; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+/*
+ * decoder.h
+ */
+#ifndef SQUASH_DECODER_H
+#define SQUASH_DECODER_H
+
+/*
+ * Global Data
+ */
+extern song_functions_t song_functions[];
+extern song_functions_t flac_parallel_functions;
+
+/*
+ * Prototypes
+ */
+song_functions_t *decoder_functions( enum song_type_e type, bool offline );
+bool decoder_scan( enum song_type_e type, char *filename, long *length, int *errors, bool (*between)(void) );
+
+#endif
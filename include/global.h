@@ -65,32 +65,57 @@
 #include <sys/mman.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
+#include <sys/time.h>
 
 /*
  * Definitions
  */
 #ifdef DEBUG
 #ifdef EMPEG_DSP
-    #define CONFIG_KEY_COUNT 15
+    #define CONFIG_KEY_COUNT 34
 #else
-    #define CONFIG_KEY_COUNT 13
+    #define CONFIG_KEY_COUNT 41
 #endif
 #else
 #ifdef EMPEG_DSP
-    #define CONFIG_KEY_COUNT 14
+    #define CONFIG_KEY_COUNT 33
 #else
-    #define CONFIG_KEY_COUNT 12
+    #define CONFIG_KEY_COUNT 40
 #endif
 #endif
 
+/* Number of decoded frames waiting for each sound device (double buffered) */
+#define OUTPUT_QUEUE_SIZE 2
+
+/* Most sound devices that can play at once, see [Sound] Driver */
+#define OUTPUT_MAX_SINKS 4
+
+/* Number of player commands that may be waiting, must be a power of two */
+#define PLAYER_COMMAND_RING_SIZE 16
+
+/* Most song analyzer threads, see [Analyzer] Threads */
+#define ANALYZE_MAX_THREADS 8
+
+/* Most channels a decoder can mix down to stereo, see pcm_mix() */
+#define PCM_MIX_MAX_CHANNELS 8
+
+/* stat.loudness of a song that has not been analyzed */
+#define STAT_LOUDNESS_UNKNOWN 100.0
+
+/* Kinds of background job, see scheduler.c */
+#define JOB_TYPE_COUNT 4
+
 /*
  * Enumerations
  */
 enum basename_type_e { BASENAME_SONG, BASENAME_META, BASENAME_STAT };
-enum song_type_e { TYPE_UNKNOWN, TYPE_OGG, TYPE_MP3, TYPE_FLAC };
+enum song_type_e { TYPE_UNKNOWN, TYPE_OGG, TYPE_MP3, TYPE_FLAC, TYPE_WAV };
+enum pcm_layout_e { PCM_LAYOUT_VORBIS, PCM_LAYOUT_WAVE };
+enum pcm_sample_e { PCM_SAMPLE_U8, PCM_SAMPLE_S16, PCM_SAMPLE_S24, PCM_SAMPLE_S32, PCM_SAMPLE_FLOAT };
 enum system_state_e { SYSTEM_LOADING, SYSTEM_RUNNING };
 enum data_type_e { TYPE_STRING, TYPE_INT, TYPE_DOUBLE };
 enum meta_type_e { TYPE_META, TYPE_STAT }; /* these match with db_extensions array */
+enum job_type_e { JOB_LOAD, JOB_ANALYZE, JOB_CACHE, JOB_SCAN };
 
 #ifdef EMPEG
 #ifdef ADVENTURE
@@ -194,6 +219,42 @@ typedef struct config_s {
     int playlist_manager_playlist_size;
     int playlist_manager_pastlist_size;
 
+    double player_silence_threshold; /* dBFS */
+    int player_silence_duration; /* milliseconds */
+    int player_buffer_low; /* milliseconds */
+    int player_buffer_high; /* milliseconds */
+    int player_buffer_memory; /* kilobytes */
+    char *player_replay_gain; /* track, album or off */
+    double player_replay_gain_preamp; /* dB */
+    int player_crossfade; /* milliseconds, 0 for none */
+
+    int analyzer_threads;
+    int analyzer_decode_threads;
+    int analyzer_rest; /* milliseconds */
+
+    int scanner_threads; /* 0 for one per processor */
+    int scanner_io_rate; /* kilobytes per second, 0 for no limit */
+    int scanner_rest; /* milliseconds, -1 for no scanning while playing */
+
+    char *cache_path; /* NULL for no cache */
+    int cache_size; /* megabytes */
+    int cache_rest; /* milliseconds */
+
+    int scheduler_load_rest; /* milliseconds */
+    int scheduler_pause_buffer; /* milliseconds, 0 never to pause */
+
+#ifndef EMPEG_DSP
+    char *sound_driver;
+    int sound_rate; /* Hz, 0 to follow each song */
+    int sound_channels; /* 0 to follow each song */
+    char *sound_alsa_device;
+    int sound_alsa_period_time; /* milliseconds */
+    int sound_alsa_buffer_time; /* milliseconds */
+    char *sound_pipe_file;
+    int sound_null_paced;
+    char *sound_wav_file;
+#endif
+
 #ifdef EMPEG_DSP
     int min_save_volume;
     int max_save_volume;
@@ -216,6 +277,18 @@ typedef struct stat_info_s {
     int skip_count;
     int repeat_counter;
     int manual_rating;
+    long trim_start; /* milliseconds of leading silence, -1 if not analyzed */
+    long trim_end;   /* milliseconds where trailing silence starts, -1 if none */
+    double loudness; /* integrated loudness in LUFS, or STAT_LOUDNESS_UNKNOWN */
+    double peak;     /* loudest sample, as a fraction of full scale */
+    off_t quarantine_size; /* file size when it failed to decode, -1 if not quarantined */
+    long quarantine_mtime; /* file mtime when it failed to decode */
+    off_t scan_size;   /* file size when scan_library last decoded it, -1 if never */
+    long scan_mtime;   /* file mtime when scan_library last decoded it */
+    long scan_length;  /* milliseconds that decoded */
+    int scan_errors;   /* recoverable decoding errors (a pcm_size of -1) */
+    bool scan_failed;  /* decoding ended on an unrecoverable error (-2 or less) */
+    double scan_speed; /* times faster than real time it decoded */
     bool changed;
 } stat_info_t;
 
@@ -255,6 +328,9 @@ typedef struct database_info_s {
     song_info_t *songs;
     int song_count;
     int song_count_allocated;
+    int *quarantine; /* indices of songs that failed to decode */
+    int quarantine_count;
+    int quarantine_allocated;
     bool stats_loaded;
     pthread_cond_t stats_finished;
     double sum;
@@ -275,17 +351,20 @@ typedef struct sound_device_s {
     int volume[2];
 } sound_device_t;
 typedef struct sound_format_s {
-/* While these are present, the empeg dsp code will not work
- * unless rate is 44100, channels is 2, byte_format is little,
- * and bits is 16.  This will be fixed later. */
+/* The empeg dsp code only plays 44100Hz, 2 channel, 16 bit little
+ * endian sound; resample_output_format() converts everything to that */
     int rate;
     int channels;
     int byte_format;
     int bits;
 } sound_format_t;
 #else
-typedef ao_device sound_device_t;
 typedef ao_sample_format sound_format_t;
+typedef struct sound_device_s {
+    struct sound_driver_s *driver;
+    void *data;                 /* belongs to the driver */
+    sound_format_t format;
+} sound_device_t;
 #endif
 
 /* Playback Structures */
@@ -295,12 +374,45 @@ typedef struct frame_data_s {
     long position; /* milliseconds */
 } frame_data_t;
 
+typedef struct silence_info_s {
+    long duration;   /* sample frames of silence leading up to the next frame */
+    long skip_start; /* silent range of the last frame that should */
+    long skip_end;   /* not be played (in sample frames) */
+} silence_info_t;
+
+#ifndef EMPEG_DSP
+/* Sound drivers, see sound_drivers[] in sound.c */
+typedef struct sound_driver_s {
+    char *name;
+    void *(*open)( sound_format_t format );
+    void (*play)( void *data, frame_data_t frame_data );
+    void (*flush)( void *data );    /* drop anything not yet heard, may be NULL */
+    long (*delay)( void *data );    /* milliseconds not yet heard, may be NULL */
+    void (*close)( void *data );
+} sound_driver_t;
+#endif
+
+/* A song's volume adjustment, see pcm_gain() */
+typedef struct pcm_gain_s {
+    float scale;
+    int scale_q12;              /* the same in 4.12 fixed point */
+} pcm_gain_t;
+
+typedef struct pcm_mix_s {
+    int channels;
+    float left[ PCM_MIX_MAX_CHANNELS ];
+    float right[ PCM_MIX_MAX_CHANNELS ];
+    int left_q12[ PCM_MIX_MAX_CHANNELS ];  /* the same in 4.12 fixed point */
+    int right_q12[ PCM_MIX_MAX_CHANNELS ];
+} pcm_mix_t;
+
 typedef struct song_functions_s {
     void *(*open)( char *filename, sound_format_t *format );
     frame_data_t(*decode_frame)( void * );
     long(*calc_duration)( void * );
     void(*seek)( void *, long, long );
     void(*close)( void * );
+    void(*set_gain)( void *, pcm_gain_t );
 } song_functions_t;
 
 /* Playlist Structures */
@@ -340,18 +452,35 @@ typedef struct song_queue_s {
     int selected;
 } song_queue_t;
 
+/* Play and skip statistics waiting to be applied by stats_saver() */
+typedef struct feedback_entry_s {
+    struct feedback_entry_s *next;
+    song_info_t *song;
+    short direction;
+} feedback_entry_t;
+
+typedef struct feedback_queue_s {
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    feedback_entry_t *head;
+    feedback_entry_t *tail;
+    int size;
+} feedback_queue_t;
+
 /* Status Information */
 typedef struct player_command_entry_s {
-    struct player_command_entry_s *next;
+    volatile unsigned long sequence; /* which lap of the ring this slot is ready for */
     enum player_command_e command;
+    struct timeval queued;
 } player_command_entry_t;
 
 typedef struct player_command_s {
-    pthread_mutex_t lock;
+    pthread_mutex_t lock;           /* only needed to wait on or signal changed */
     pthread_cond_t changed;
-    player_command_entry_t *head;
-    player_command_entry_t *tail;
-    int size;
+    player_command_entry_t entries[ PLAYER_COMMAND_RING_SIZE ];
+    volatile unsigned long head;    /* next entry to read, only the player changes this */
+    volatile unsigned long tail;    /* next entry to fill */
+    volatile bool waiting;          /* the player is (about to be) waiting on changed */
 } player_command_t;
 
 typedef struct player_info_s {
@@ -361,27 +490,151 @@ typedef struct player_info_s {
     long current_position;
     enum player_state_e state;
     sound_device_t *device;
+    long command_count;
+    long command_latency_sum; /* microseconds from queueing to done */
+    long command_latency_max;
 } player_info_t;
 
+/* A song for the frame decoder to work on */
+typedef struct decoder_slot_s {
+    song_info_t *song;
+    void *data;
+    frame_data_t(* decode)( void * );
+    void(*seek)( void *, long, long );
+    void(*close)( void * );
+    long end_position;          /* end the song here (milliseconds), -1 to play it all */
+    long fade_position;         /* crossfade into the next song from here, -1 not to */
+} decoder_slot_t;
+
 typedef struct frame_buffer_s {
     pthread_mutex_t lock;
     pthread_cond_t restart;
     pthread_cond_t new_data;
-    frame_data_t *frames;
+    frame_data_t *frames;       /* a ring, the oldest frame is frames[start] */
+    int start;
     int size;
+    int allocated;
     int pcm_size;
+    int bytes_per_second;       /* of the song being decoded */
+    int low_water;              /* start decoding again below this many bytes */
+    int high_water;             /* stop decoding at this many bytes */
+    bool filling;               /* decoding until high_water is reached */
     bool song_eof;
     bool new_file;
-    void *decoder_data;
-    frame_data_t(* decoder_function)( void * );
-    void(*close_function)( void * );
+    decoder_slot_t current;     /* the song being decoded */
+    bool fade_wanted;           /* the frame decoder has reached current.fade_position */
+    bool next_file;             /* next is ready to be faded in */
+    bool drop_next;             /* close next again, current was seeked back */
+    decoder_slot_t next;
+    long fade_length;           /* sample frames */
 } frame_buffer_t;
 
+/* How often the CPU and disk are woken up.  The frame decoder decodes in
+ * bursts, from the low watermark to the high one, and jobs that don't
+ * mind when they run wait for the next burst (squash_coalesced_sleep()) */
+typedef struct wakeup_info_s {
+    pthread_mutex_t lock;
+    pthread_cond_t burst;       /* broadcast as the frame decoder starts a burst */
+    struct timeval start;       /* when counting started */
+    long decoder_wakeups;       /* times the frame decoder was woken */
+    long bursts;                /* of those, how many started filling the frame buffer */
+    double busy_seconds;        /* spent decoding between waits */
+    long disk_reads;            /* read ahead bursts asked of the kernel */
+    long timer_wakeups;         /* coalesced sleeps that woke on their own */
+    long timer_coalesced;       /* and those that woke with a burst */
+} wakeup_info_t;
+
+/* The song the player will play next, gotten early to crossfade into */
+typedef struct next_song_s {
+    song_info_t *song;          /* NULL until it's taken off the song queue */
+    long start_position;
+    long first_position;        /* past any leading silence */
+    long end_position;          /* where any trailing silence starts, or -1 */
+    sound_format_t sound_format;
+    song_functions_t *functions; /* the decoder, or play_wav for a song in the cache */
+    void *decoder_data;         /* NULL until it's opened */
+    bool fading;                /* handed to the frame decoder */
+} next_song_t;
+
+/* A decoded frame shared by every sink playing it */
+typedef struct output_frame_s {
+    frame_data_t frame;
+    int references;             /* the pcm_data is freed with the last one */
+} output_frame_t;
+
+/* One sound device being fed by its own sound_output() thread */
+typedef struct output_sink_s {
+    output_frame_t *frames[ OUTPUT_QUEUE_SIZE ]; /* a ring */
+    int start;
+    int size;
+    char *driver;               /* see sound_drivers[], unused with EMPEG_DSP */
+    bool drop;                  /* drop frames when full rather than hold up the player */
+    sound_device_t *device;     /* NULL between songs, or if it would not open */
+    bool writing;               /* sound_output() is inside sound_play() */
+    long dropped;
+    long write_count;
+    double write_usec_sum;      /* time spent inside sound_play() */
+    long write_usec_max;
+} output_sink_t;
+
+typedef struct output_queue_s {
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    pthread_cond_t idle;
+    output_sink_t sinks[ OUTPUT_MAX_SINKS ];
+    int sink_count;
+    int writing;                /* sinks inside sound_play() */
+    bool paused;
+    bool interrupted;           /* a player command came in, see sound_queue_wait() */
+    bool silence_pending;       /* a pause or flush is waiting for the current writes */
+    bool drop_pending;          /* ... and it was a flush */
+    struct timeval silence_requested;
+    long silence_count;
+    long silence_latency_sum;   /* microseconds from the command being queued to the last write */
+    long silence_latency_max;
+} output_queue_t;
+
+/* Song analyzer threads */
+typedef struct analyze_info_s {
+    pthread_mutex_t lock;
+    int cursor;                         /* next database entry to look at */
+    int busy[ ANALYZE_MAX_THREADS ];    /* song each thread is on, -1 if none */
+} analyze_info_t;
+
+/* Decoded songs kept on disk, see [Cache] */
+typedef struct pcm_cache_info_s {
+    pthread_mutex_t lock;
+    off_t *sizes;               /* by song index, the size of its cache file, 0 if not cached,
+                                   PCM_CACHE_UNCACHEABLE if it can't be */
+    int sizes_allocated;
+    long long used;             /* bytes in the cache */
+    int count;                  /* songs in the cache */
+    long hits;                  /* songs played from the cache */
+} pcm_cache_info_t;
+
+/* Background jobs, see scheduler.c */
+typedef struct scheduler_info_s {
+    pthread_mutex_t lock;
+    long done[ JOB_TYPE_COUNT ];        /* units of work finished, by job type */
+    long pauses;                        /* times a job waited for the frame buffer */
+    double paused_seconds;
+} scheduler_info_t;
+
+/* Offline rendering, see the -r option */
+typedef struct render_info_s {
+    bool active;
+    double limit;               /* seconds of sound to render */
+    double rendered;            /* seconds of sound rendered so far */
+    long song_count;
+} render_info_t;
+
 typedef struct status_info_s {
     pthread_mutex_t lock;
     pthread_cond_t exit;
     char *status_message;
     int exit_status;
+    bool quitting;              /* threads should stop at their next safe point */
 } status_info_t;
 
 #ifndef NO_NCURSES
@@ -482,8 +735,15 @@ display_info_t display_info;
 song_queue_t song_queue;
 song_queue_t past_queue;
 player_command_t player_command;
+feedback_queue_t feedback_queue;
 player_info_t player_info;
 frame_buffer_t frame_buffer;
+wakeup_info_t wakeup_info;
+output_queue_t output_queue;
+analyze_info_t analyze_info;
+pcm_cache_info_t pcm_cache_info;
+scheduler_info_t scheduler_info;
+render_info_t render_info;
 status_info_t status_info;
 spectrum_ring_t spectrum_ring;
 spectrum_info_t spectrum_info;
@@ -538,6 +798,19 @@ log_info_t log_info;
 #define squash_signal( cond ) LOCK_LOG("signal", cond) if( pthread_cond_signal(&(cond)) ) squash_error( "Unable to signal " #cond " condition" )
 #define squash_broadcast( cond ) LOCK_LOG("broadcast", cond) if( pthread_cond_broadcast(&(cond)) ) squash_error( "Unable to broadcast " #cond " condition" )
 
+/*
+ * Memory barrier and compare-and-swap for the few structures that are shared
+ * without a lock.  Compilers without the __sync builtins (such as the empeg's)
+ * fall back to a mutex; the empeg only has the one cpu anyway.
+ */
+#if defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 1))
+    #define squash_barrier() __sync_synchronize()
+    #define squash_cas( ptr, old_value, new_value ) __sync_bool_compare_and_swap( ptr, old_value, new_value )
+#else
+    #define squash_barrier() __asm__ __volatile__( "" : : : "memory" )
+    #define squash_cas( ptr, old_value, new_value ) _squash_cas( ptr, old_value, new_value )
+#endif
+
 #define squash_ensure_alloc( ensure, current, ptr, ptr_size, initial, increment ) \
     { \
         if( ensure >= current ) { \
@@ -565,5 +838,9 @@ void init_config( void );
 char *copy_string( const char *start, const char *end );
 char *build_fullfilename( song_info_t *song, enum basename_type_e type );
 void create_path( char *dir );
+bool _squash_cas( volatile unsigned long *ptr, unsigned long old_value, unsigned long new_value );
+long squash_elapsed_usec( struct timeval *start );
+void squash_coalesced_sleep( long msecs, long slack );
+bool squash_quitting( void );
 
 #endif
@@ -90,6 +90,7 @@ void do_resize( void );
 #endif
 void do_quit( void );
 
+void do_adjust_buffer( int amount );
 void do_set_player_command( enum player_command_e );
 void do_toggle_player_command( void );
 
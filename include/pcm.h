@@ -0,0 +1,48 @@
+/*
+ * Copyright 2003 by Adam Luter
+ * This file is part of Squash, a C/Ncurses-based unix music player.
+ *
+ * Squash is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Squash is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Squash; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+/*
+ * pcm.h
+ */
+#ifndef SQUASH_PCM_H
+#define SQUASH_PCM_H
+
+/* Most a song will be turned up (+18dB) */
+#define PCM_GAIN_MAX 7.99
+
+/* Steps in the crossfade curve */
+#define PCM_FADE_STEPS 1024
+
+/*
+ * Prototypes
+ */
+short pcm_db_to_amplitude( double db );
+long pcm_silent_prefix( const short *samples, long count, short threshold );
+long pcm_silent_suffix( const short *samples, long count, short threshold );
+pcm_gain_t pcm_gain( double db, double peak );
+bool pcm_mix( pcm_mix_t *mix, int channels, enum pcm_layout_e layout );
+void pcm_interleave_int32( char *out, const int *const *planes, const pcm_mix_t *mix, long frames, int bits, pcm_gain_t gain );
+#ifndef TREMOR
+void pcm_interleave_float( char *out, const float *const *planes, const pcm_mix_t *mix, long frames, pcm_gain_t gain );
+#endif
+void pcm_mix_in_place( short *samples, const pcm_mix_t *mix, long frames, pcm_gain_t gain );
+int pcm_sample_bytes( enum pcm_sample_e format );
+void pcm_interleave_packed( char *out, const unsigned char *in, enum pcm_sample_e format, const pcm_mix_t *mix, long frames, pcm_gain_t gain );
+void pcm_crossfade( short *out, const short *from, const short *to, long frames, long done, long length );
+
+#endif
@@ -0,0 +1,61 @@
+/*
+ * Copyright 2003 by Adam Luter
+ * This file is part of Squash, a C/Ncurses-based unix music player.
+ *
+ * Squash is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Squash is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Squash; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+/*
+ * pcm_cache.h
+ */
+#ifndef SQUASH_PCM_CACHE_H
+#define SQUASH_PCM_CACHE_H
+
+/* Size of the WAV header at the start of each cache file */
+#define PCM_CACHE_HEADER_SIZE 44
+
+/* Bytes a millisecond of a song is guessed to take before it is decoded
+ * (44.1kHz, 16 bit stereo), and the length guessed for a song whose
+ * length isn't known yet */
+#define PCM_CACHE_BYTES_PER_MS 176.4
+#define PCM_CACHE_GUESSED_LENGTH 240000
+
+/* Added to the pick probability of songs already in the cache, so that
+ * songs on the edge of fitting don't go in and out of it */
+#define PCM_CACHE_KEEP_BIAS 0.05
+
+/* In pcm_cache_info.sizes, a song that can't be cached (too big for a
+ * WAV file, say) and isn't tried again */
+#define PCM_CACHE_UNCACHEABLE -1
+
+/*
+ * Structures
+ */
+/* A song that could go in the cache, see pcm_cache_filler() */
+typedef struct pcm_cache_rank_s {
+    int index;
+    double probability;         /* of being picked, see pick_probability() */
+    long long size;             /* of its cache file, or a guess at it */
+    bool cached;
+} pcm_cache_rank_t;
+
+/*
+ * Prototypes
+ */
+bool pcm_cache_enabled( void );
+char *pcm_cache_filename( song_info_t *song );
+bool pcm_cache_has( song_info_t *song );
+void *pcm_cache_filler( void *input_data );
+
+#endif
@@ -23,37 +23,105 @@
 #define SQUASH_PLAY_FLAC_H
 
 #include <FLAC/all.h>
+#include "reader.h"
 
 /*
  * Definitions
  */
+/* About how many samples flac_parallel_*() decode as one piece */
+#define FLAC_CHUNK_SAMPLES 262144
+
+/* Most threads one song is decoded with, see [Analyzer] Decode_Threads */
+#define FLAC_MAX_THREADS 8
+
+/* Pieces decoded ahead of the one being read, for each thread */
+#define FLAC_CHUNKS_AHEAD 2
 
 /*
  * Structures
  */
+typedef struct flac_info_s {
+    int sample_rate;
+    int channels;
+    int bits_per_sample;
+    int min_blocksize;
+    int max_blocksize;
+    FLAC__uint64 total_samples;     /* 0 if unknown */
+    off_t audio_offset;             /* where the first frame starts */
+    FLAC__StreamMetadata_SeekPoint *seek_points;    /* without placeholders */
+    int seek_point_count;
+} flac_info_t;
+
 typedef struct flac_data_s {
-    FLAC__FileDecoder *decoder;
-    char *buffer;
+    FLAC__StreamDecoder *decoder;   /* NULL until the first decode or seek */
+    reader_t *reader;
+    flac_info_t info;
+    char *buffer;                   /* kept for the whole song */
     int buffer_size;
-    int channels;
-    int sample_rate;
+    int pcm_size;                   /* what the last block decoded to */
+    FLAC__uint64 sample;            /* where the last block starts */
+    FLAC__uint64 skip_to;           /* drop samples before this, after a seek */
+    off_t end;                      /* don't read past this, 0 for the whole file */
     long position;
-    long duration;
+    pcm_gain_t gain;
+    pcm_mix_t mix;
 } flac_data_t;
 
+/* A run of whole frames decoded on its own by flac_parallel_*() */
+typedef struct flac_chunk_s {
+    off_t start;                    /* the first frame */
+    off_t end;                      /* the frame after the last one */
+    FLAC__uint64 first_sample;
+    char *pcm_data;                 /* NULL until it's decoded */
+    long pcm_size;                  /* -2 if it couldn't be */
+    bool done;
+} flac_chunk_t;
+
+/* A song being decoded on several threads at once, in chunks */
+typedef struct flac_parallel_s {
+    char *filename;
+    flac_info_t info;
+    flac_chunk_t *chunks;
+    int chunk_count;
+    int next_chunk;                 /* the next one for a thread to take */
+    int next_out;                   /* the next one to hand back */
+    int window;                     /* most decoded ahead of next_out */
+    int generation;                 /* changed by each seek */
+    char *out_data;                 /* the chunk being handed back */
+    long out_size;
+    long out_used;                  /* bytes of it handed back so far */
+    FLAC__uint64 out_sample;        /* where the rest of it starts */
+    FLAC__uint64 skip_to;
+    long position;
+    pcm_gain_t gain;
+    pcm_mix_t mix;
+    pthread_t threads[ FLAC_MAX_THREADS ];
+    int thread_count;               /* 0 until the first decode */
+    bool quit;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} flac_parallel_t;
+
 /*
  * Prototypes
  */
+bool flac_read_info( reader_t *reader, flac_info_t *info, song_info_t *song );
 void *flac_open( char *filename, sound_format_t *sound_format );
-void flac_error_callback( const FLAC__FileDecoder *decoder, FLAC__StreamDecoderErrorStatus status, void *client_data );
-FLAC__StreamDecoderWriteStatus flac_write_callback_load_meta( const FLAC__FileDecoder *decoder, const FLAC__Frame *frame, const FLAC__int32 * const buffer[], void *client_data );
-void flac_metadata_callback_load_meta( const FLAC__FileDecoder *decoder, const FLAC__StreamMetadata *metadata, void *client_data );
-FLAC__StreamDecoderWriteStatus flac_write_callback_decode_frame( const FLAC__FileDecoder *decoder, const FLAC__Frame *frame, const FLAC__int32 * const buffer[], void *client_data );
-void flac_metadata_callback_decode_frame( const FLAC__FileDecoder *decoder, const FLAC__StreamMetadata *metadata, void *client_data );
+void flac_error_callback( const FLAC__StreamDecoder *decoder, FLAC__StreamDecoderErrorStatus status, void *client_data );
+void flac_metadata_callback( const FLAC__StreamDecoder *decoder, const FLAC__StreamMetadata *metadata, void *client_data );
+FLAC__StreamDecoderReadStatus flac_read_callback( const FLAC__StreamDecoder *decoder, FLAC__byte buffer[], unsigned *bytes, void *client_data );
+FLAC__StreamDecoderWriteStatus flac_write_callback( const FLAC__StreamDecoder *decoder, const FLAC__Frame *frame, const FLAC__int32 * const buffer[], void *client_data );
 void flac_load_meta( void *data, char *filename );
 frame_data_t flac_decode_frame( void *data );
 long flac_calc_duration( void *data );
 void flac_seek( void *data, long seek_time, long duration );
 void flac_close( void *data );
+void flac_set_gain( void *data, pcm_gain_t gain );
+void *flac_parallel_open( char *filename, sound_format_t *sound_format );
+frame_data_t flac_parallel_decode_frame( void *data );
+long flac_parallel_calc_duration( void *data );
+void flac_parallel_seek( void *data, long seek_time, long duration );
+void flac_parallel_close( void *data );
+void flac_parallel_set_gain( void *data, pcm_gain_t gain );
 
 #endif
@@ -30,19 +30,27 @@
     #endif
     #include <id3.h>    /* id3lib to read tags */
 #endif
+#include "reader.h"
+
+/*
+ * Definitions
+ */
+/* Least of the song libmad is given at once, more than any frame */
+#define PLAY_MP3_MIN_BUFFER (64 * 1024)
 
 /*
  * Structures
  */
 typedef struct mp3_data_s {
-    int file_size;
-    char *buffer;
-    FILE *file;
+    reader_t *reader;
+    off_t offset;               /* of the stream's buffer in the song */
     struct mad_stream stream;
     struct mad_frame frame;
     struct mad_synth synth;
     mad_timer_t timer;
     char *pcm_data;
+    pcm_gain_t gain;
+    pcm_mix_t mix;
 } mp3_data_t;
 
 /*
@@ -54,6 +62,6 @@ frame_data_t mp3_decode_frame( void *data );
 long mp3_calc_duration( void *data );
 void mp3_seek( void *data, long seek_time, long duration );
 void mp3_close( void *data );
-unsigned int mad_to_16bit( mad_fixed_t f );
+void mp3_set_gain( void *data, pcm_gain_t gain );
 
 #endif
@@ -28,6 +28,7 @@
     #include <vorbis/codec.h>        /* Vorbis Decoder */
     #include <vorbis/vorbisfile.h>    /* Vorbis Decoder */
 #endif
+#include "reader.h"
 
 /*
  * Definitions
@@ -41,6 +42,9 @@ typedef struct ogg_data_s {
     OggVorbis_File file;
     char pcm_data[ PLAY_OGG_PCM_BUFFER_SIZE ];
     long duration;
+    int channels;
+    pcm_gain_t gain;
+    pcm_mix_t mix;
 } ogg_data_t;
 
 /*
@@ -52,5 +56,6 @@ frame_data_t ogg_decode_frame( void *data );
 long ogg_calc_duration( void *data );
 void ogg_seek( void *data, long seek_time, long duration );
 void ogg_close( void *data );
+void ogg_set_gain( void *data, pcm_gain_t gain );
 
 #endif
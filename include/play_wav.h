@@ -0,0 +1,61 @@
+/*
+ * Copyright 2003 by Adam Luter
+ * This file is part of Squash, a C/Ncurses-based unix music player.
+ *
+ * Squash is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Squash is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Squash; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+/*
+ * play_wav.h
+ */
+#ifndef SQUASH_PLAY_WAV_H
+#define SQUASH_PLAY_WAV_H
+
+#include "reader.h"
+
+/*
+ * Definitions
+ */
+/* Sample frames handed out by each wav_decode_frame() */
+#define PLAY_WAV_FRAME_SAMPLES 4096
+
+/*
+ * Structures
+ */
+typedef struct wav_data_s {
+    reader_t *reader;
+    enum pcm_sample_e format;
+    int channels;
+    int sample_rate;
+    int block_align;            /* bytes in one sample frame */
+    off_t data_offset;          /* where the samples start in the file */
+    off_t data_size;            /* whole sample frames only */
+    off_t position;             /* bytes into the samples */
+    char *buffer;               /* for anything that can't be handed out as it is */
+    pcm_gain_t gain;
+    pcm_mix_t mix;
+} wav_data_t;
+
+/*
+ * Prototypes
+ */
+void *wav_open( char *filename, sound_format_t *sound_format );
+void wav_load_meta( void *data, char *filename );
+frame_data_t wav_decode_frame( void *data );
+long wav_calc_duration( void *data );
+void wav_seek( void *data, long seek_time, long duration );
+void wav_close( void *data );
+void wav_set_gain( void *data, pcm_gain_t gain );
+
+#endif
@@ -22,13 +22,10 @@
 #ifndef SQUASH_PLAYER_H
 #define SQUASH_PLAYER_H
 
-#define PLAYER_MAX_BUFFER_SIZE 2048
-#define PLAYER_MAX_BUFFER_PCM_SIZE (1024*1024)
-
-/*
- * Global Data
- */
-extern song_functions_t song_functions[];
+/* The frame buffer is sized by time and memory (see the Buffer_* config
+ * keys); these only bound the array of frames */
+#define PLAYER_INITIAL_BUFFER_FRAMES 256
+#define PLAYER_MAX_BUFFER_FRAMES 8192
 
 /*
  * Prototypes
@@ -37,8 +34,18 @@ void *frame_decoder( void *input_data );
 void *player( void *input_data );
 void get_next_song_info( song_info_t **song, long *start_position );
 void done_with_song_info( song_info_t *song );
-int detect_silence( frame_data_t frame_data, unsigned int *silence_duration );
+int detect_silence( frame_data_t frame_data, sound_format_t sound_format, silence_info_t *silence );
 void set_now_playing_info( song_info_t *song, long start_position );
+pcm_gain_t get_replay_gain( song_info_t *song );
 double *get_spectrum(char *pcm_data, int pcm_length);
-void player_queue_command( enum player_command_e command );
+void frame_buffer_push( frame_data_t frame );
+bool frame_buffer_pop( frame_data_t *frame );
+void frame_buffer_clear( void );
+void frame_buffer_drop_song( void );
+void frame_buffer_set_format( sound_format_t sound_format );
+void frame_buffer_set_watermarks( void );
+long frame_buffer_duration( void );
+bool player_queue_command( enum player_command_e command );
+bool player_command_pending( void );
+bool player_next_command( player_command_entry_t *command_entry );
 #endif
@@ -25,8 +25,10 @@
 /*
  * Prototypes
  */
-void ensure_song_fully_loaded( song_info_t *song_info );
+bool ensure_song_fully_loaded( song_info_t *song_info );
+void preload_song( int song_index, bool keep_meta );
+void *song_loader( void *input_data );
 void *playlist_manager( void *input_data );
-void playlist_queue_song( song_info_t *song, long start_position );
+bool playlist_queue_song( song_info_t *song, long start_position );
 
 #endif
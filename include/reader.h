@@ -0,0 +1,69 @@
+/*
+ * Copyright 2003 by Adam Luter
+ * This file is part of Squash, a C/Ncurses-based unix music player.
+ *
+ * Squash is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Squash is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Squash; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+/*
+ * reader.h
+ */
+#ifndef SQUASH_READER_H
+#define SQUASH_READER_H
+
+/* How much of a song is mapped at once, so that even a huge file only
+ * takes this much address space.  A multiple of the page size. */
+#ifdef EMPEG
+    #define READER_WINDOW (256 * 1024)
+#else
+    #define READER_WINDOW (4 * 1024 * 1024)
+#endif
+
+/* How far past the window the kernel is asked to read ahead */
+#define READER_AHEAD READER_WINDOW
+
+/* Read ahead is asked for this much at a time, so the disk is busy in a
+ * few long bursts and can spin down in between.  A multiple of
+ * READER_WINDOW. */
+#ifdef EMPEG
+    #define READER_BURST (2 * 1024 * 1024)
+#else
+    #define READER_BURST (16 * 1024 * 1024)
+#endif
+
+/*
+ * Structures
+ */
+typedef struct reader_s {
+    int fd;
+    off_t size;
+    off_t position;             /* where reader_read() carries on from */
+    char *window;               /* NULL until something is mapped */
+    off_t window_start;
+    long window_size;
+    off_t advised;              /* the kernel was told WILLNEED up to here */
+    off_t dropped;              /* and DONTNEED up to here */
+} reader_t;
+
+/*
+ * Prototypes
+ */
+reader_t *reader_open( const char *filename );
+const char *reader_map( reader_t *reader, off_t offset, long want, long *length );
+long reader_read( reader_t *reader, void *buffer, long length );
+int reader_seek( reader_t *reader, off_t offset, int whence );
+off_t reader_tell( reader_t *reader );
+void reader_close( reader_t *reader );
+
+#endif
@@ -0,0 +1,61 @@
+/*
+ * Copyright 2003 by Adam Luter
+ * This file is part of Squash, a C/Ncurses-based unix music player.
+ *
+ * Squash is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Squash is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Squash; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+/*
+ * resample.h
+ */
+#ifndef SQUASH_RESAMPLE_H
+#define SQUASH_RESAMPLE_H
+
+/* Length of the polyphase filter, a multiple of 8 */
+#define RESAMPLE_TAPS 16
+
+/* Most sets of filter coefficients; rates needing more share the nearest */
+#define RESAMPLE_MAX_PHASES 512
+
+/* Most channels that can be resampled */
+#define RESAMPLE_MAX_CHANNELS 8
+
+/*
+ * Structures
+ */
+typedef struct resample_s {
+    sound_format_t in;
+    sound_format_t out;
+    bool convert;               /* FALSE if frames pass straight through */
+    long phases;                /* output rate / input rate is phases / step */
+    long step;
+    long phase;                 /* phase of the next output frame */
+    int table_phases;
+    short *coefficients;        /* table_phases * RESAMPLE_TAPS, 1.15 fixed point */
+    short *history[ RESAMPLE_MAX_CHANNELS ]; /* input frames waiting, by channel */
+    long history_count;
+    long history_allocated;
+} resample_t;
+
+/*
+ * Prototypes
+ */
+sound_format_t resample_output_format( sound_format_t in );
+void resample_init( resample_t *resample );
+void resample_set_format( resample_t *resample, sound_format_t in, sound_format_t out );
+void resample_reset( resample_t *resample );
+frame_data_t resample_frame( resample_t *resample, frame_data_t frame );
+void resample_free( resample_t *resample );
+
+#endif
@@ -0,0 +1,50 @@
+/*
+ * Copyright 2003 by Adam Luter
+ * This file is part of Squash, a C/Ncurses-based unix music player.
+ *
+ * Squash is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Squash is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Squash; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+/*
+ * scheduler.h
+ */
+#ifndef SQUASH_SCHEDULER_H
+#define SQUASH_SCHEDULER_H
+
+/* How much longer than its rest, in milliseconds, a job will wait for the
+ * player's next burst to start its next unit of work with.  On the empeg
+ * this leaves the disk alone in between. */
+#ifdef EMPEG
+    #define SCHEDULER_REST_SLACK 30000
+#else
+    #define SCHEDULER_REST_SLACK 0
+#endif
+
+/* How long, in milliseconds, a job with nothing to do waits before it
+ * looks again, and how much longer it will wait for a burst */
+#define SCHEDULER_IDLE_TIME 600000
+#define SCHEDULER_IDLE_SLACK 60000
+
+/* How often, in milliseconds, a paused job looks at the frame buffer */
+#define SCHEDULER_PAUSE_CHECK 250
+
+/*
+ * Prototypes
+ */
+void scheduler_idle_priority( void );
+void scheduler_pause( void );
+void scheduler_next( enum job_type_e type );
+void scheduler_idle( void );
+
+#endif
@@ -22,15 +22,71 @@
 #ifndef SQUASH_SOUND_H
 #define SQUASH_SOUND_H
 
+#ifndef EMPEG_DSP
+/* How far ahead (milliseconds) a paced null driver lets the player get */
+#define NULL_BUFFER_TIME 100
+
+#define WAV_HEADER_SIZE 44
+
+/* The most sound one WAV file holds before the wav driver starts another.
+ * The header has 32 bits for it, and many programs read them signed. */
+#define WAV_MAX_DATA_SIZE (0x7fffffffUL - WAV_HEADER_SIZE)
+
+typedef struct null_output_s {
+    int bytes_per_second;
+    struct timeval clock_start;
+    double clock_seconds;       /* sound "played" since clock_start */
+} null_output_t;
+
+typedef struct wav_output_s {
+    int fd;                     /* -1 until the first song */
+    int file_count;             /* files finished so far */
+    sound_format_t format;
+    unsigned long data_size;
+} wav_output_t;
+#endif
+
 /*
  * Prototypes
  */
 void sound_init( void );
-sound_device_t *sound_open( sound_format_t sound_format );
+bool sound_format_equal( sound_format_t a, sound_format_t b );
+sound_device_t *sound_open( char *driver_name, sound_format_t sound_format );
 void sound_set_volume( sound_device_t *sound, int value );
 void sound_adjust_volume( sound_device_t *sound, int adjustment );
 void sound_play( frame_data_t frame_data, sound_device_t *sound_device );
+void sound_flush( sound_device_t *device );
+long sound_delay( sound_device_t *device );
 void sound_close( sound_device_t *device );
+void sound_queue_init( void );
+void sound_queue_release( output_frame_t *output_frame );
+void *sound_output( void *input_data );
+bool sound_queue_wait( void );
+void sound_queue_interrupt( void );
+void sound_queue_frame( frame_data_t frame_data );
+void sound_queue_flush( struct timeval *requested );
+void sound_queue_pause( bool paused, struct timeval *requested );
+void sound_queue_drain( void );
+sound_device_t *sound_queue_open( sound_format_t format );
+void sound_queue_close( void );
+void sound_queue_silenced( void );
 void sound_shutdown( void );
+#ifndef EMPEG_DSP
+sound_driver_t *sound_find_driver( char *name );
+void *sound_ao_open( sound_format_t format );
+void sound_ao_play( void *data, frame_data_t frame_data );
+void sound_ao_close( void *data );
+void *sound_null_open( sound_format_t format );
+void sound_null_play( void *data, frame_data_t frame_data );
+void sound_null_flush( void *data );
+long sound_null_delay( void *data );
+void sound_null_close( void *data );
+bool sound_wav_start( wav_output_t *output );
+void *sound_wav_open( sound_format_t format );
+void sound_wav_play( void *data, frame_data_t frame_data );
+void sound_wav_close( void *data );
+void sound_wav_write( wav_output_t *output, char *buffer, int size );
+void sound_put_le( unsigned char *buffer, unsigned long value, int bytes );
+#endif
 
 #endif
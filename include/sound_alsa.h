@@ -0,0 +1,47 @@
+/*
+ * Copyright 2003 by Adam Luter
+ * This file is part of Squash, a C/Ncurses-based unix music player.
+ *
+ * Squash is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Squash is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Squash; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+/*
+ * sound_alsa.h
+ */
+#ifndef SQUASH_SOUND_ALSA_H
+#define SQUASH_SOUND_ALSA_H
+
+#include <alsa/asoundlib.h>
+
+typedef struct alsa_data_s {
+    snd_pcm_t *pcm;
+    snd_pcm_uframes_t period_size;
+    snd_pcm_uframes_t buffer_size;
+    int frame_bytes;
+    int rate;
+    bool mmap;          /* FALSE if the device only supports snd_pcm_writei() */
+    long xrun_count;
+} alsa_data_t;
+
+/*
+ * Prototypes
+ */
+void *alsa_open( sound_format_t format );
+void alsa_play( void *data, frame_data_t frame_data );
+void alsa_flush( void *data );
+long alsa_delay( void *data );
+void alsa_close( void *data );
+bool alsa_recover( alsa_data_t *alsa, int err );
+
+#endif
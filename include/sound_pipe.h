@@ -0,0 +1,66 @@
+/*
+ * Copyright 2003 by Adam Luter
+ * This file is part of Squash, a C/Ncurses-based unix music player.
+ *
+ * Squash is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Squash is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Squash; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+/*
+ * sound_pipe.h
+ */
+#ifndef SQUASH_SOUND_PIPE_H
+#define SQUASH_SOUND_PIPE_H
+
+/*
+ * The stream written by the pipe driver is a series of chunks, each an
+ * eight byte header (a four character tag and a little endian 32 bit
+ * length) followed by that many bytes:
+ *
+ *   "FMT "  sent before the first sound and whenever the format changes:
+ *           32 bit rate, 16 bit channels, 16 bit bits per sample and
+ *           32 bit byte order (0 little endian, 1 big endian), all
+ *           little endian.
+ *   "DATA"  interleaved samples in the last announced format.
+ */
+#define PIPE_CHUNK_HEADER_SIZE  8
+#define PIPE_FORMAT_SIZE        12
+
+/* Ring slots are this many pages each */
+#define PIPE_SLOT_PAGES         4
+
+/* Pipe buffers to assume if the kernel won't say */
+#define PIPE_DEFAULT_BUFFERS    16
+
+typedef struct pipe_output_s {
+    int fd;                     /* -1 until first opened */
+    bool splice;                /* FALSE once vmsplice() has failed */
+    char *ring;                 /* page aligned slots handed to vmsplice() */
+    int slot_size;
+    int slot_count;
+    int slot_next;
+    bool format_sent;
+    sound_format_t format;      /* the last format announced */
+    int bytes_per_second;
+} pipe_output_t;
+
+/*
+ * Prototypes
+ */
+void *pipe_open( sound_format_t format );
+void pipe_play( void *data, frame_data_t frame_data );
+long pipe_delay( void *data );
+void pipe_close( void *data );
+void pipe_write( pipe_output_t *output, char *buffer, int size );
+
+#endif
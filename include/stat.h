@@ -29,6 +29,13 @@ double get_rating( stat_info_t stat );
 void start_song_picker();
 unsigned int pick_song();
 void feedback( song_info_t *song, short direction );
+bool quarantine_expired( song_info_t *song );
+void quarantine_song( song_info_t *song );
+void queue_feedback( song_info_t *song, short direction );
+void apply_feedback( feedback_entry_t *batch );
+void flush_feedback( void );
+void *stats_saver( void *input_data );
+double pick_probability( double x, double a, double s );
 bool normal_test( double x, double a, double v );
 
 #endif
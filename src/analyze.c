@@ -0,0 +1,596 @@
+/*
+ * Copyright 2003 by Adam Luter
+ * This file is part of Squash, a C/Ncurses-based unix music player.
+ *
+ * Squash is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Squash is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Squash; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+/*
+ * analyze.c
+ */
+#include "global.h"
+#include "database.h"   /* for save_song() */
+#include "decoder.h"    /* for decoder_functions(), decoder_scan() */
+#include "pcm.h"        /* for pcm_silent_*() */
+#include "stat.h"       /* for quarantine_song() */
+#include "scheduler.h"  /* for scheduler_*() */
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "analyze.h"
+
+/*
+ * Returns TRUE if there is something about a song not found out yet.
+ */
+static bool needs_analysis( song_info_t *song ) {
+    return song->stat.trim_start == -1 || song->stat.loudness == STAT_LOUDNESS_UNKNOWN;
+}
+
+/*
+ * Returns TRUE if an analyzer thread is already working on a song.
+ * Expects analyze_info.lock.
+ */
+static bool analysis_busy( int song_index ) {
+    int i;
+
+    for( i = 0; i < ANALYZE_MAX_THREADS; i++ ) {
+        if( analyze_info.busy[i] == song_index ) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+/*
+ * Sets up analyze_info, call before starting any song_analyzer().
+ */
+void analyze_init( void ) {
+    int i;
+
+    analyze_info.cursor = 0;
+    for( i = 0; i < ANALYZE_MAX_THREADS; i++ ) {
+        analyze_info.busy[i] = -1;
+    }
+}
+
+/*
+ * Background threads that decode each song once to find its leading and
+ * trailing silence, so the player can skip it without ever decoding it,
+ * and its loudness, so it can be leveled without ReplayGain tags.  There
+ * are [Analyzer] Threads of these, input_data being each one's number.
+ * Songs on the playlist are looked at first, then the rest of the
+ * database in order.  The results are kept in the ".stat" files, so the
+ * work picks up where it left off the next time squash is run.
+ */
+void *song_analyzer( void *input_data ) {
+    int slot = (int)(long)input_data;
+    struct timespec wait_time = { 5, 000000000 };
+    song_queue_entry_t *entry;
+    song_info_t *song;
+    enum song_type_e type;
+    char *full_filename;
+    long trim_start, trim_end;
+    double loudness, peak;
+    bool decoded;
+    int song_index;
+
+    /* Only use spare cycles */
+    scheduler_idle_priority();
+
+    while( !squash_quitting() ) {
+        squash_rlock( database_info.lock );
+
+        /* Nothing can be saved until the statistics are loaded */
+        if( !database_info.stats_loaded ) {
+            squash_runlock( database_info.lock );
+            nanosleep( &wait_time, NULL );
+            continue;
+        }
+
+        /* Songs about to be played come first */
+        song_index = -1;
+        squash_lock( song_queue.lock );
+        squash_lock( analyze_info.lock );
+        for( entry = song_queue.head; entry != NULL; entry = entry->next ) {
+            if( needs_analysis(entry->song_info) && !analysis_busy(entry->song_info - database_info.songs) ) {
+                song_index = entry->song_info - database_info.songs;
+                break;
+            }
+        }
+        squash_unlock( song_queue.lock );
+
+        /* Then the rest of the database */
+        while( song_index == -1 && analyze_info.cursor < database_info.song_count ) {
+            if( needs_analysis(&database_info.songs[ analyze_info.cursor ]) && !analysis_busy(analyze_info.cursor) ) {
+                song_index = analyze_info.cursor;
+            }
+            analyze_info.cursor++;
+        }
+
+        if( song_index == -1 ) {
+            /* Everything has been looked at, check again later */
+            analyze_info.cursor = 0;
+            squash_unlock( analyze_info.lock );
+            squash_runlock( database_info.lock );
+            scheduler_idle();
+            continue;
+        }
+        analyze_info.busy[ slot ] = song_index;
+        squash_unlock( analyze_info.lock );
+
+        song = &database_info.songs[ song_index ];
+        type = song->song_type;
+        if( type == -1 ) {
+            type = get_song_type( song->basename[ BASENAME_SONG ], song->filename );
+        }
+        full_filename = build_fullfilename( song, BASENAME_SONG );
+        squash_runlock( database_info.lock );
+
+        squash_log( "Analyzing: %s", full_filename );
+        decoded = analyze_song( full_filename, type, &trim_start, &trim_end, &loudness, &peak );
+        if( squash_quitting() ) {
+            /* It will be analyzed again next time */
+            squash_free( full_filename );
+            squash_lock( analyze_info.lock );
+            analyze_info.busy[ slot ] = -1;
+            squash_unlock( analyze_info.lock );
+            break;
+        }
+        if( !decoded ) {
+            /* Don't try this one again, and play it as it is */
+            trim_start = 0;
+            trim_end = -1;
+            loudness = ANALYZE_REFERENCE_LOUDNESS;
+            peak = 0.0;
+        }
+        squash_free( full_filename );
+
+        squash_wlock( database_info.lock );
+        if( song_index < database_info.song_count ) {
+            song = &database_info.songs[ song_index ];
+            song->stat.trim_start = trim_start;
+            song->stat.trim_end = trim_end;
+            song->stat.loudness = loudness;
+            song->stat.peak = peak;
+            song->stat.changed = TRUE;
+            if( !decoded ) {
+                quarantine_song( song );
+            }
+            save_song( song );
+        }
+        squash_lock( analyze_info.lock );
+        analyze_info.busy[ slot ] = -1;
+        squash_unlock( analyze_info.lock );
+        squash_wunlock( database_info.lock );
+
+        /* Wait a little between songs so the player is not crowded out */
+        scheduler_next( JOB_ANALYZE );
+    }
+
+    return (void *)NULL;
+}
+
+/*
+ * Called by decoder_scan() before each frame.  Holds the scan back while
+ * the player needs the time, and stops it when squash is quitting.
+ */
+static bool song_scanner_continue( void ) {
+    scheduler_pause();
+
+    return !squash_quitting();
+}
+
+/*
+ * Thread start function.  Does scan_library's job a song at a time while
+ * squash plays: decodes each song whose file changed since it was last
+ * scanned, saves what was found in its ".stat" file, and quarantines it
+ * if it can't be decoded.
+ */
+void *song_scanner( void *input_data ) {
+    struct timespec wait_time = { 5, 000000000 };
+    struct stat song_stat;
+    struct timeval start;
+    song_info_t *song;
+    enum song_type_e type;
+    char *filename;
+    off_t scan_size;
+    long scan_mtime, length, usec;
+    int song_index, errors;
+    bool failed;
+
+    /* Only use spare cycles */
+    scheduler_idle_priority();
+
+    song_index = 0;
+    while( !squash_quitting() ) {
+        squash_rlock( database_info.lock );
+
+        /* Nothing can be saved until the statistics are loaded */
+        if( !database_info.stats_loaded ) {
+            squash_runlock( database_info.lock );
+            nanosleep( &wait_time, NULL );
+            continue;
+        }
+
+        if( song_index >= database_info.song_count ) {
+            /* Everything has been looked at, check again later */
+            squash_runlock( database_info.lock );
+            song_index = 0;
+            scheduler_idle();
+            continue;
+        }
+
+        song = &database_info.songs[ song_index ];
+        type = song->song_type;
+        if( type == -1 ) {
+            type = get_song_type( song->basename[ BASENAME_SONG ], song->filename );
+        }
+        if( type == TYPE_UNKNOWN || song->stat.quarantine_size != -1 ) {
+            squash_runlock( database_info.lock );
+            song_index++;
+            continue;
+        }
+        filename = build_fullfilename( song, BASENAME_SONG );
+        scan_size = song->stat.scan_size;
+        scan_mtime = song->stat.scan_mtime;
+        squash_runlock( database_info.lock );
+
+        /* Skip it if this file was already scanned */
+        if( stat(filename, &song_stat) != 0
+                || (scan_size == song_stat.st_size && scan_mtime == (long)song_stat.st_mtime) ) {
+            squash_free( filename );
+            song_index++;
+            continue;
+        }
+
+        squash_log( "Scanning: %s", filename );
+        gettimeofday( &start, NULL );
+        failed = !decoder_scan( type, filename, &length, &errors, song_scanner_continue );
+        usec = squash_elapsed_usec( &start );
+        squash_free( filename );
+        if( squash_quitting() ) {
+            /* It will be scanned again next time */
+            break;
+        }
+
+        squash_wlock( database_info.lock );
+        if( song_index < database_info.song_count ) {
+            song = &database_info.songs[ song_index ];
+            song->stat.scan_size = song_stat.st_size;
+            song->stat.scan_mtime = (long)song_stat.st_mtime;
+            song->stat.scan_length = length;
+            song->stat.scan_errors = errors;
+            song->stat.scan_failed = failed;
+            song->stat.scan_speed = usec > 0 ? (double)length * 1000.0 / usec : 0.0;
+            song->stat.changed = TRUE;
+            if( failed ) {
+                quarantine_song( song );
+            }
+            save_song( song );
+        }
+        squash_wunlock( database_info.lock );
+        song_index++;
+
+        /* Wait a little between songs so the player is not crowded out */
+        scheduler_next( JOB_SCAN );
+    }
+
+    return (void *)NULL;
+}
+
+/*
+ * Decodes a whole song and finds where the first and last sample above
+ * Silence_Threshold are, and how loud the song is.  trim_start is the
+ * millisecond of the first loud sample, trim_end is the millisecond just
+ * after the last one, or -1 if the song is silent throughout.  loudness
+ * is in LUFS, and peak is the loudest sample as a fraction of full scale.
+ * Returns FALSE if the song could not be decoded, or squash is quitting.
+ */
+bool analyze_song( char *filename, enum song_type_e type, long *trim_start, long *trim_end, double *loudness, double *peak ) {
+    song_functions_t *functions;
+    sound_format_t sound_format;
+    frame_data_t frame;
+    loudness_t meter;
+    void *decoder_data;
+    long samples, first, last;
+    long sample_count, silent;
+    short threshold;
+
+    if( type <= TYPE_UNKNOWN || type > TYPE_WAV ) {
+        return FALSE;
+    }
+
+    functions = decoder_functions( type, TRUE );
+    decoder_data = functions->open( filename, &sound_format );
+    if( decoder_data == NULL ) {
+        return FALSE;
+    }
+
+    if( sound_format.bits != 16 || !loudness_init(&meter, sound_format.channels, sound_format.rate) ) {
+        functions->close( decoder_data );
+        return FALSE;
+    }
+
+    threshold = pcm_db_to_amplitude( config.player_silence_threshold );
+    samples = 0;
+    first = -1;
+    last = -1;
+
+    while( 1 ) {
+        scheduler_pause();
+        if( squash_quitting() ) {
+            frame.pcm_size = -2;
+            break;
+        }
+        frame = functions->decode_frame( decoder_data );
+        if( frame.pcm_size == 0 || frame.pcm_size <= -2 ) {
+            break;
+        } else if( frame.pcm_size == -1 ) {
+            continue;
+        }
+
+        sample_count = frame.pcm_size / 2;
+
+        if( first == -1 ) {
+            silent = pcm_silent_prefix( (short *)frame.pcm_data, sample_count, threshold );
+            if( silent < sample_count ) {
+                first = samples + silent / sound_format.channels;
+            }
+        }
+
+        silent = pcm_silent_suffix( (short *)frame.pcm_data, sample_count, threshold );
+        if( silent < sample_count ) {
+            last = samples + (sample_count - silent + sound_format.channels - 1) / sound_format.channels;
+        }
+
+        loudness_add( &meter, (short *)frame.pcm_data, sample_count / sound_format.channels );
+
+        samples += sample_count / sound_format.channels;
+    }
+
+    functions->close( decoder_data );
+
+    if( frame.pcm_size <= -2 ) {
+        loudness_free( &meter );
+        return FALSE;
+    }
+
+    if( first == -1 ) {
+        *trim_start = 0;
+        *trim_end = -1;
+    } else {
+        *trim_start = (long)((double)first * 1000.0 / sound_format.rate);
+        *trim_end = (long)ceil( (double)last * 1000.0 / sound_format.rate );
+    }
+
+    *loudness = loudness_result( &meter );
+    *peak = meter.peak / 32768.0;
+    loudness_free( &meter );
+
+    return TRUE;
+}
+
+/*
+ * The loudness meter follows ITU-R BS.1770 (as used by EBU R128 and
+ * ReplayGain 2): each channel is K-weighted by two biquads, the energy is
+ * summed over 400ms blocks, and the blocks are gated before averaging.
+ * All channels are given the same weight.
+ *
+ * Sets up a meter for the given format.  Returns FALSE if the format
+ * can't be measured.
+ */
+bool loudness_init( loudness_t *meter, int channels, int rate ) {
+    double f0, gain, q, k, vh, vb, a0;
+    int c;
+
+    if( channels <= 0 || channels > LOUDNESS_MAX_CHANNELS || rate <= 0 ) {
+        return FALSE;
+    }
+
+    /* Stage one is a high shelf, modelling the head */
+    f0 = 1681.974450955533;
+    gain = 3.999843853973347;
+    q = 0.7071752369554196;
+    k = tan( M_PI * f0 / rate );
+    vh = pow( 10.0, gain / 20.0 );
+    vb = pow( vh, 0.4996667741545416 );
+    a0 = 1.0 + k / q + k * k;
+    meter->b[0][0] = (vh + vb * k / q + k * k) / a0;
+    meter->b[0][1] = 2.0 * (k * k - vh) / a0;
+    meter->b[0][2] = (vh - vb * k / q + k * k) / a0;
+    meter->a[0][0] = 1.0;
+    meter->a[0][1] = 2.0 * (k * k - 1.0) / a0;
+    meter->a[0][2] = (1.0 - k / q + k * k) / a0;
+
+    /* Stage two is the RLB high pass */
+    f0 = 38.13547087602444;
+    q = 0.5003270373238773;
+    k = tan( M_PI * f0 / rate );
+    a0 = 1.0 + k / q + k * k;
+    meter->b[1][0] = 1.0;
+    meter->b[1][1] = -2.0;
+    meter->b[1][2] = 1.0;
+    meter->a[1][0] = 1.0;
+    meter->a[1][1] = 2.0 * (k * k - 1.0) / a0;
+    meter->a[1][2] = (1.0 - k / q + k * k) / a0;
+
+    for( c = 0; c < LOUDNESS_MAX_CHANNELS; c++ ) {
+        meter->z[c][0] = meter->z[c][1] = meter->z[c][2] = meter->z[c][3] = 0.0;
+    }
+    meter->channels = channels;
+    meter->sum = 0.0;
+    meter->frames = 0;
+    meter->block_frames = rate / 10 > 0 ? rate / 10 : 1;
+    meter->blocks = NULL;
+    meter->block_count = 0;
+    meter->block_count_allocated = 0;
+    meter->peak = 0;
+
+    return TRUE;
+}
+
+/*
+ * K-weights some frames, adding their energy to the current block.  The
+ * filters can't be run across time in parallel, so the SSE2 version runs
+ * the two channels of a stereo song side by side.
+ */
+static void loudness_filter( loudness_t *meter, const short *samples, long frames ) {
+    long i;
+    int c, sample;
+    double x, y, *z;
+    double sum = 0.0;
+#ifdef __SSE2__
+    __m128d b00, b01, b02, a01, a02, b10, b11, b12, a11, a12;
+    __m128d z0, z1, z2, z3, vx, vy, scale, vsum;
+    double pair[2];
+
+    if( meter->channels == 2 ) {
+        b00 = _mm_set1_pd( meter->b[0][0] );
+        b01 = _mm_set1_pd( meter->b[0][1] );
+        b02 = _mm_set1_pd( meter->b[0][2] );
+        a01 = _mm_set1_pd( meter->a[0][1] );
+        a02 = _mm_set1_pd( meter->a[0][2] );
+        b10 = _mm_set1_pd( meter->b[1][0] );
+        b11 = _mm_set1_pd( meter->b[1][1] );
+        b12 = _mm_set1_pd( meter->b[1][2] );
+        a11 = _mm_set1_pd( meter->a[1][1] );
+        a12 = _mm_set1_pd( meter->a[1][2] );
+        z0 = _mm_set_pd( meter->z[1][0], meter->z[0][0] );
+        z1 = _mm_set_pd( meter->z[1][1], meter->z[0][1] );
+        z2 = _mm_set_pd( meter->z[1][2], meter->z[0][2] );
+        z3 = _mm_set_pd( meter->z[1][3], meter->z[0][3] );
+        scale = _mm_set1_pd( 1.0 / 32768.0 );
+        vsum = _mm_setzero_pd();
+
+        for( i = 0; i < frames; i++ ) {
+            vx = _mm_mul_pd( _mm_set_pd( samples[2 * i + 1], samples[2 * i] ), scale );
+            vy = _mm_add_pd( _mm_mul_pd( b00, vx ), z0 );
+            z0 = _mm_sub_pd( _mm_add_pd( _mm_mul_pd( b01, vx ), z1 ), _mm_mul_pd( a01, vy ) );
+            z1 = _mm_sub_pd( _mm_mul_pd( b02, vx ), _mm_mul_pd( a02, vy ) );
+            vx = vy;
+            vy = _mm_add_pd( _mm_mul_pd( b10, vx ), z2 );
+            z2 = _mm_sub_pd( _mm_add_pd( _mm_mul_pd( b11, vx ), z3 ), _mm_mul_pd( a11, vy ) );
+            z3 = _mm_sub_pd( _mm_mul_pd( b12, vx ), _mm_mul_pd( a12, vy ) );
+            vsum = _mm_add_pd( vsum, _mm_mul_pd( vy, vy ) );
+        }
+
+        _mm_storel_pd( &meter->z[0][0], z0 );
+        _mm_storeh_pd( &meter->z[1][0], z0 );
+        _mm_storel_pd( &meter->z[0][1], z1 );
+        _mm_storeh_pd( &meter->z[1][1], z1 );
+        _mm_storel_pd( &meter->z[0][2], z2 );
+        _mm_storeh_pd( &meter->z[1][2], z2 );
+        _mm_storel_pd( &meter->z[0][3], z3 );
+        _mm_storeh_pd( &meter->z[1][3], z3 );
+        _mm_storeu_pd( pair, vsum );
+        sum = pair[0] + pair[1];
+    } else
+#endif
+    for( c = 0; c < meter->channels; c++ ) {
+        z = meter->z[c];
+        for( i = 0; i < frames; i++ ) {
+            x = samples[ i * meter->channels + c ] / 32768.0;
+            y = meter->b[0][0] * x + z[0];
+            z[0] = meter->b[0][1] * x - meter->a[0][1] * y + z[1];
+            z[1] = meter->b[0][2] * x - meter->a[0][2] * y;
+            x = y;
+            y = meter->b[1][0] * x + z[2];
+            z[2] = meter->b[1][1] * x - meter->a[1][1] * y + z[3];
+            z[3] = meter->b[1][2] * x - meter->a[1][2] * y;
+            sum += y * y;
+        }
+    }
+    meter->sum += sum;
+
+    for( i = 0; i < frames * meter->channels; i++ ) {
+        sample = abs( samples[i] );
+        if( sample > meter->peak ) {
+            meter->peak = sample;
+        }
+    }
+}
+
+/*
+ * Adds interleaved 16 bit samples to the meter.
+ */
+void loudness_add( loudness_t *meter, const short *samples, long frames ) {
+    long count;
+
+    while( frames > 0 ) {
+        /* Don't let a block straddle two calls to loudness_filter() */
+        count = meter->block_frames - meter->frames;
+        if( count > frames ) {
+            count = frames;
+        }
+        loudness_filter( meter, samples, count );
+        samples += count * meter->channels;
+        frames -= count;
+        meter->frames += count;
+
+        if( meter->frames == meter->block_frames ) {
+            squash_ensure_alloc( meter->block_count, meter->block_count_allocated,
+                    meter->blocks, sizeof(double), 64, *=2 );
+            meter->blocks[ meter->block_count++ ] = meter->sum / meter->block_frames;
+            meter->sum = 0.0;
+            meter->frames = 0;
+        }
+    }
+}
+
+/*
+ * Returns the gated loudness of everything added to the meter, in LUFS.
+ * Anything too short or too quiet to measure is taken to be at
+ * ANALYZE_REFERENCE_LOUDNESS, so it is played as it is.
+ */
+double loudness_result( loudness_t *meter ) {
+    double absolute_gate, relative_gate, energy, sum;
+    long i, count;
+    int pass;
+
+    /* Blocks quieter than -70 LUFS are ignored altogether */
+    absolute_gate = pow( 10.0, (-70.0 + 0.691) / 10.0 );
+    relative_gate = absolute_gate;
+
+    /* Then blocks 10 LU below the loudness of what is left */
+    for( pass = 0; pass < 2; pass++ ) {
+        sum = 0.0;
+        count = 0;
+
+        /* Each gating block is four 100ms blocks, stepping 100ms at a time */
+        for( i = 0; i + 3 < meter->block_count; i++ ) {
+            energy = (meter->blocks[i] + meter->blocks[i + 1] + meter->blocks[i + 2] + meter->blocks[i + 3]) / 4.0;
+            if( energy > absolute_gate && energy > relative_gate ) {
+                sum += energy;
+                count++;
+            }
+        }
+
+        if( count == 0 ) {
+            return ANALYZE_REFERENCE_LOUDNESS;
+        }
+        relative_gate = sum / count / 10.0;
+    }
+
+    return -0.691 + 10.0 * log10( sum / count );
+}
+
+/*
+ * Frees what the meter allocated.
+ */
+void loudness_free( loudness_t *meter ) {
+    squash_free( meter->blocks );
+    meter->block_count = 0;
+    meter->block_count_allocated = 0;
+}
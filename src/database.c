@@ -25,6 +25,7 @@
 #include "play_ogg.h"   /* for ogg_load_meta() */
 #include "play_mp3.h"   /* for mp3_load_meta() */
 #include "play_flac.h"  /* for flac_load_meta() */
+#include "play_wav.h"   /* for wav_load_meta() */
 #ifdef EMPEG
 #include "vfdlib.h"     /* for vfdlib_*() */
 #include "version.h"    /* for SQUASH_VERSION */
@@ -45,6 +46,9 @@ void load_db_filenames( void ) {
         database_info.song_count = 0;
         database_info.song_count_allocated = 0;
         database_info.songs = NULL;
+        squash_free( database_info.quarantine );
+        database_info.quarantine_count = 0;
+        database_info.quarantine_allocated = 0;
         database_info.stats_loaded = 0;
     }
 
@@ -268,11 +272,9 @@ void clear_song_meta( song_info_t *song ) {
         /* Free the meta key */
         squash_free( song->meta_keys[j].key );
     }
-    song->meta_keys = NULL;
+    squash_free( song->meta_keys );
     song->meta_key_count = 0;
     song->stat.changed = FALSE;
-
-    squash_free( song->meta_keys );
 }
 
 /*
@@ -292,10 +294,13 @@ void clear_db() {
 
     /* Free the array of songs */
     squash_free( database_info.songs );
+    squash_free( database_info.quarantine );
 
     /* Reset the sizes */
     database_info.song_count = 0;
     database_info.song_count_allocated = 0;
+    database_info.quarantine_count = 0;
+    database_info.quarantine_allocated = 0;
 }
 
 /*
@@ -377,6 +382,26 @@ void save_stat_data( song_info_t *song, FILE *file ) {
     fprintf( file, "skip_count=%d\n", song->stat.skip_count );
     fprintf( file, "repeat_counter=%d\n", song->stat.repeat_counter );
     fprintf( file, "manual_rating=%d\n", song->stat.manual_rating );
+    if( song->stat.trim_start != -1 ) {
+        fprintf( file, "trim_start=%ld\n", song->stat.trim_start );
+        fprintf( file, "trim_end=%ld\n", song->stat.trim_end );
+    }
+    if( song->stat.loudness != STAT_LOUDNESS_UNKNOWN ) {
+        fprintf( file, "loudness=%.2f\n", song->stat.loudness );
+        fprintf( file, "peak=%.5f\n", song->stat.peak );
+    }
+    if( song->stat.quarantine_size != -1 ) {
+        fprintf( file, "quarantine_size=%lld\n", (long long)song->stat.quarantine_size );
+        fprintf( file, "quarantine_mtime=%ld\n", song->stat.quarantine_mtime );
+    }
+    if( song->stat.scan_size != -1 ) {
+        fprintf( file, "scan_size=%lld\n", (long long)song->stat.scan_size );
+        fprintf( file, "scan_mtime=%ld\n", song->stat.scan_mtime );
+        fprintf( file, "scan_length=%ld\n", song->stat.scan_length );
+        fprintf( file, "scan_errors=%d\n", song->stat.scan_errors );
+        fprintf( file, "scan_failed=%d\n", song->stat.scan_failed ? 1 : 0 );
+        fprintf( file, "scan_speed=%.1f\n", song->stat.scan_speed );
+    }
     fprintf( file, "\n" );
 
     /* Reset the changed flag */
@@ -470,6 +495,9 @@ void load_meta_data( song_info_t *song, enum meta_type_e which ) {
                 case TYPE_FLAC:
                     flac_load_meta( (void *)song, filename );
                     break;
+                case TYPE_WAV:
+                    wav_load_meta( (void *)song, filename );
+                    break;
                 case TYPE_UNKNOWN:
                     /* can't get here */
                     break;
@@ -640,6 +668,30 @@ void set_stat_data( void *data, char *header, char *key, char *value ) {
         if( song->stat.manual_rating == -1 ) {
             song->stat.manual_rating = int_value;
         }
+    } else if( strncasecmp("trim_start", key, 11) == 0 ) {
+        song->stat.trim_start = atol( value );
+    } else if( strncasecmp("trim_end", key, 9) == 0 ) {
+        song->stat.trim_end = atol( value );
+    } else if( strncasecmp("loudness", key, 9) == 0 ) {
+        song->stat.loudness = atof( value );
+    } else if( strncasecmp("peak", key, 5) == 0 ) {
+        song->stat.peak = atof( value );
+    } else if( strncasecmp("quarantine_size", key, 16) == 0 ) {
+        song->stat.quarantine_size = (off_t)atoll( value );
+    } else if( strncasecmp("quarantine_mtime", key, 17) == 0 ) {
+        song->stat.quarantine_mtime = atol( value );
+    } else if( strncasecmp("scan_size", key, 10) == 0 ) {
+        song->stat.scan_size = (off_t)atoll( value );
+    } else if( strncasecmp("scan_mtime", key, 11) == 0 ) {
+        song->stat.scan_mtime = atol( value );
+    } else if( strncasecmp("scan_length", key, 12) == 0 ) {
+        song->stat.scan_length = atol( value );
+    } else if( strncasecmp("scan_errors", key, 12) == 0 ) {
+        song->stat.scan_errors = int_value;
+    } else if( strncasecmp("scan_failed", key, 12) == 0 ) {
+        song->stat.scan_failed = int_value != 0;
+    } else if( strncasecmp("scan_speed", key, 11) == 0 ) {
+        song->stat.scan_speed = atof( value );
     }
 
     squash_free( key );
@@ -681,6 +733,18 @@ void _load_file( char *filename, bool trust ) {
         song->stat.skip_count = 0;
         song->stat.repeat_counter = 0;
         song->stat.manual_rating = -1;
+        song->stat.trim_start = -1;
+        song->stat.trim_end = -1;
+        song->stat.loudness = STAT_LOUDNESS_UNKNOWN;
+        song->stat.peak = 0.0;
+        song->stat.quarantine_size = -1;
+        song->stat.quarantine_mtime = 0;
+        song->stat.scan_size = -1;
+        song->stat.scan_mtime = 0;
+        song->stat.scan_length = -1;
+        song->stat.scan_errors = 0;
+        song->stat.scan_failed = FALSE;
+        song->stat.scan_speed = 0.0;
         song->stat.changed = FALSE;
         song->play_length = -1;
         song->song_type = -1;
@@ -705,7 +769,7 @@ void _load_file( char *filename, bool trust ) {
 #endif
 #ifndef NO_NCURSES
         /* Display progress every 500 songs */
-        if( database_info.song_count % 500 == 0) {
+        if( database_info.song_count % 500 == 0 && !render_info.active ) {
             draw_info();
         }
 #endif
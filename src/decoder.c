@@ -0,0 +1,103 @@
+/*
+ * Copyright 2003 by Adam Luter
+ * This file is part of Squash, a C/Ncurses-based unix music player.
+ *
+ * Squash is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Squash is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Squash; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+/*
+ * decoder.c
+ * The decoders for each song type, kept apart from the player so that
+ * the stand-alone tools can decode songs too.
+ */
+
+#include "global.h"
+#include "play_flac.h"  /* for flac_*() */
+#include "play_wav.h"   /* for wav_*() */
+#include "play_mp3.h"   /* for mp3_*() */
+#include "play_ogg.h"   /* for ogg_*() */
+#include "decoder.h"
+
+/*
+ * Define the song functions
+ */
+song_functions_t song_functions[] = {
+    { NULL, NULL, NULL, NULL, NULL, NULL },
+    { ogg_open, ogg_decode_frame, ogg_calc_duration, ogg_seek, ogg_close, ogg_set_gain },
+    { mp3_open, mp3_decode_frame, mp3_calc_duration, mp3_seek, mp3_close, mp3_set_gain },
+    { flac_open, flac_decode_frame, flac_calc_duration, flac_seek, flac_close, flac_set_gain },
+    { wav_open, wav_decode_frame, wav_calc_duration, wav_seek, wav_close, wav_set_gain }
+};
+
+/* FLAC decoded on several threads at once, for analyzing and rendering */
+song_functions_t flac_parallel_functions = {
+    flac_parallel_open, flac_parallel_decode_frame, flac_parallel_calc_duration,
+    flac_parallel_seek, flac_parallel_close, flac_parallel_set_gain
+};
+
+/*
+ * The functions to decode a song with.  A render doesn't need to keep
+ * time, so long FLAC songs are spread over [Analyzer] Decode_Threads.
+ */
+song_functions_t *decoder_functions( enum song_type_e type, bool offline ) {
+    if( offline && type == TYPE_FLAC && config.analyzer_decode_threads > 1 ) {
+        return &flac_parallel_functions;
+    }
+    return &song_functions[ type ];
+}
+
+/*
+ * Decodes a whole song into nowhere, to check that it can be.  length is
+ * set to how many milliseconds of it decoded, and errors to how many
+ * recoverable decoding errors there were.  between, unless it's NULL, is
+ * called before each frame, and the scan stops if it returns FALSE.
+ * Returns FALSE if the song couldn't be opened or stopped decoding before
+ * its end.
+ */
+bool decoder_scan( enum song_type_e type, char *filename, long *length, int *errors, bool (*between)(void) ) {
+    sound_format_t sound_format;
+    frame_data_t frame;
+    void *decoder_data;
+    long long samples;
+    bool finished;
+
+    *length = 0;
+    *errors = 0;
+    if( (decoder_data = song_functions[ type ].open(filename, &sound_format)) == NULL ) {
+        return FALSE;
+    }
+
+    samples = 0;
+    finished = FALSE;
+    while( 1 ) {
+        if( between != NULL && !between() ) {
+            break;
+        }
+        frame = song_functions[ type ].decode_frame( decoder_data );
+        if( frame.pcm_size == 0 ) {
+            finished = TRUE;
+            break;
+        } else if( frame.pcm_size == -1 ) {
+            (*errors)++;
+        } else if( frame.pcm_size <= -2 ) {
+            break;
+        } else {
+            samples += frame.pcm_size / (sound_format.channels * sound_format.bits / 8);
+        }
+    }
+    song_functions[ type ].close( decoder_data );
+    *length = (long)(samples * 1000 / sound_format.rate);
+
+    return finished;
+}
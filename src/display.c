@@ -24,6 +24,8 @@
 #include "spectrum.h"   /* for spectrum_resize() */
 #include "database.h"   /* for get_meta_data() */
 #include "stat.h"       /* for get_rating() */
+#include "player.h"     /* for frame_buffer_duration() */
+#include "pcm_cache.h"  /* for pcm_cache_enabled() */
 #include "version.h"    /* for SQUASH_VERSION */
 #ifdef EMPEG
     #include "vfdlib.h" /* for vfdlib_*() */
@@ -104,7 +106,7 @@ void window_init( void ) {
 
     display_info.window[ WIN_INFO ].is_fixed = 1;
     display_info.window[ WIN_INFO ].is_persistent = 0;
-    display_info.window[ WIN_INFO ].size.fixed.height = 9;
+    display_info.window[ WIN_INFO ].size.fixed.height = 13;
     display_info.window[ WIN_INFO ].state = WIN_STATE_NORMAL;
     display_info.window[ WIN_INFO ].window = NULL;
 
@@ -559,8 +561,13 @@ void draw_empeg_display( void ) {
             }
             {
                 char *buffer_string;
-                asprintf( &buffer_string, "Buf:%5.2fs", (float)frame_buffer.pcm_size / 44100 / 2 / 2 );
+                long buffer_duration;
+                squash_lock( frame_buffer.lock );
+                buffer_duration = frame_buffer_duration();
+                squash_unlock( frame_buffer.lock );
+                asprintf( &buffer_string, "Buf:%5.2fs", (float)buffer_duration / 1000 );
                 draw_string_monospaced_empeg( display_info.screen, buffer_string, 0, 0, 4 );
+                free( buffer_string );
             }
             draw_song_empeg( player_info.song, TRUE );
             break;
@@ -845,8 +852,21 @@ void draw_empeg_display( void ) {
                 {
                     char *line_buffer;
                     float avg, std_dev;
+                    struct timeval now;
+                    float minutes;
                     int x;
 
+                    /* How often the decoder and disk were woken, per minute */
+                    squash_lock( wakeup_info.lock );
+                    gettimeofday( &now, NULL );
+                    minutes = (now.tv_sec - wakeup_info.start.tv_sec) / 60.0;
+                    if( minutes >= 1.0 ) {
+                        asprintf( &line_buffer, "Wakes %.1f/m Disk %.1f/m", wakeup_info.decoder_wakeups / minutes, wakeup_info.disk_reads / minutes );
+                        draw_string_empeg( display_info.screen, line_buffer, 0, 0, WIDTH );
+                        free( line_buffer );
+                    }
+                    squash_unlock( wakeup_info.lock );
+
                     draw_string_empeg( display_info.screen, "Stats:", 6, 0, WIDTH );
                     draw_string_empeg( display_info.screen, "(avg", 6, 11*4, WIDTH-11*4 );
                     draw_string_empeg( display_info.screen, "/", 6, 19*4, WIDTH-19*4 );
@@ -1498,6 +1518,10 @@ void draw_info( void ) {
     int i;
     double rating;
     int play_count, skip_count;
+    long dropped, write_count, write_max;
+    double write_sum;
+    struct timeval now;
+    double minutes;
     song_queue_t *queue = NULL;
     song_queue_entry_t *queue_entry;
     song_info_t *song;
@@ -1572,7 +1596,7 @@ void draw_info( void ) {
     /* Display filename and songs loaded */
     mvwprintw( win, 1, 1, "Current Selected Song filename:" );
     mvwprintw( win, 2, 1, "%s", filename );
-    mvwprintw( win, 3, 1, "Songs loaded: %d", database_info.song_count );
+    mvwprintw( win, 3, 1, "Songs loaded: %d  Quarantined: %d", database_info.song_count, database_info.quarantine_count );
 
     /* Free filename */
     squash_free( filename );
@@ -1592,6 +1616,84 @@ void draw_info( void ) {
         mvwprintw( win, 7, 1, "Skip Count:  % 8d"" / % 8.5f / % 8.5f", skip_count, avg, std_dev );
     }
 
+    /* How long the player takes to act on commands */
+    if( player_info.command_count > 0 ) {
+        mvwprintw( win, 8, 1, "Commands:    % 8ld, average % 7.2f ms, max % 7.2f ms",
+                player_info.command_count,
+                (double)player_info.command_latency_sum / player_info.command_count / 1000.0,
+                (double)player_info.command_latency_max / 1000.0 );
+    }
+
+    /* How long from a pause, skip or stop until the last sound was written */
+    squash_lock( output_queue.lock );
+    if( output_queue.silence_count > 0 ) {
+        mvwprintw( win, 9, 1, "Silence:     % 8ld, average % 7.2f ms, max % 7.2f ms",
+                output_queue.silence_count,
+                (double)output_queue.silence_latency_sum / output_queue.silence_count / 1000.0,
+                (double)output_queue.silence_latency_max / 1000.0 );
+    }
+
+    /* Frames missed by sound devices that couldn't keep up */
+    dropped = 0;
+    for( i = 0; i < output_queue.sink_count; i++ ) {
+        dropped += output_queue.sinks[i].dropped;
+    }
+    if( dropped > 0 ) {
+        mvwprintw( win, 10, 1, "Dropped:     % 8ld frames", dropped );
+    }
+
+    /* How long the sound devices take to accept each frame */
+    write_count = 0;
+    write_sum = 0;
+    write_max = 0;
+    for( i = 0; i < output_queue.sink_count; i++ ) {
+        write_count += output_queue.sinks[i].write_count;
+        write_sum += output_queue.sinks[i].write_usec_sum;
+        if( output_queue.sinks[i].write_usec_max > write_max ) {
+            write_max = output_queue.sinks[i].write_usec_max;
+        }
+    }
+    if( write_count > 0 ) {
+        mvwprintw( win, 11, 1, "Writes:      % 8ld, average % 7.2f ms, max % 7.2f ms",
+                write_count, write_sum / write_count / 1000.0, (double)write_max / 1000.0 );
+    }
+    squash_unlock( output_queue.lock );
+
+    /* How often the decoder and disk were woken, per minute */
+    squash_lock( wakeup_info.lock );
+    gettimeofday( &now, NULL );
+    minutes = (now.tv_sec - wakeup_info.start.tv_sec) / 60.0;
+    if( minutes >= 1.0 ) {
+        mvwprintw( win, 12, 1, "Wakeups:     % 8.1f/min, %ld bursts, busy %4.1f%%, disk % 5.1f/min, timers %ld/%ld",
+                wakeup_info.decoder_wakeups / minutes, wakeup_info.bursts,
+                wakeup_info.busy_seconds / (minutes * 60.0) * 100.0, wakeup_info.disk_reads / minutes,
+                wakeup_info.timer_coalesced, wakeup_info.timer_coalesced + wakeup_info.timer_wakeups );
+    }
+    squash_unlock( wakeup_info.lock );
+
+    /* Songs kept decoded on disk */
+    if( pcm_cache_enabled() ) {
+        squash_lock( pcm_cache_info.lock );
+        mvwprintw( win, 13, 1, "Cache:       % 8d songs, %lld of %d MB, %ld played",
+                pcm_cache_info.count, pcm_cache_info.used / (1024 * 1024), config.cache_size, pcm_cache_info.hits );
+        squash_unlock( pcm_cache_info.lock );
+    }
+
+    /* Library upkeep done in the background */
+    squash_lock( scheduler_info.lock );
+    mvwprintw( win, 14, 1, "Jobs:        % 8ld loaded, %ld analyzed, %ld cached, %ld scanned, paused %ld times (%.1f s)",
+            scheduler_info.done[ JOB_LOAD ], scheduler_info.done[ JOB_ANALYZE ], scheduler_info.done[ JOB_CACHE ],
+            scheduler_info.done[ JOB_SCAN ], scheduler_info.pauses, scheduler_info.paused_seconds );
+    squash_unlock( scheduler_info.lock );
+
+    /* Songs that failed to decode, as many as fit */
+    if( database_info.quarantine_count > 0 && win_height > 17 ) {
+        mvwprintw( win, 15, 1, "Quarantined songs:" );
+        for( i = 0; i < database_info.quarantine_count && 16 + i < win_height - 1; i++ ) {
+            mvwaddnstr( win, 16 + i, 3, database_info.songs[ database_info.quarantine[i] ].filename, win_width - 4 );
+        }
+    }
+
     /* Refresh Changes */
     wrefresh( win );
 }
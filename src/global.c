@@ -55,7 +55,37 @@ config_keys_t config_keys[ CONFIG_KEY_COUNT ] = {
     { "Empeg", "save_volume_maximum", (void *)&config.max_save_volume, TYPE_INT },
 #endif
     { "Playlist", "Size", (void *)&config.playlist_manager_playlist_size, TYPE_INT },
-    { "Pastlist", "Size", (void *)&config.playlist_manager_pastlist_size, TYPE_INT }
+    { "Pastlist", "Size", (void *)&config.playlist_manager_pastlist_size, TYPE_INT },
+    { "Player", "Silence_Threshold", (void *)&config.player_silence_threshold, TYPE_DOUBLE },
+    { "Player", "Silence_Duration", (void *)&config.player_silence_duration, TYPE_INT },
+    { "Player", "Buffer_Low", (void *)&config.player_buffer_low, TYPE_INT },
+    { "Player", "Buffer_High", (void *)&config.player_buffer_high, TYPE_INT },
+    { "Player", "Buffer_Memory", (void *)&config.player_buffer_memory, TYPE_INT },
+    { "Player", "Replay_Gain", (void *)&config.player_replay_gain, TYPE_STRING },
+    { "Player", "Replay_Gain_Preamp", (void *)&config.player_replay_gain_preamp, TYPE_DOUBLE },
+    { "Player", "Crossfade", (void *)&config.player_crossfade, TYPE_INT },
+    { "Analyzer", "Threads", (void *)&config.analyzer_threads, TYPE_INT },
+    { "Analyzer", "Rest", (void *)&config.analyzer_rest, TYPE_INT },
+    { "Analyzer", "Decode_Threads", (void *)&config.analyzer_decode_threads, TYPE_INT },
+    { "Scanner", "Threads", (void *)&config.scanner_threads, TYPE_INT },
+    { "Scanner", "IO_Rate", (void *)&config.scanner_io_rate, TYPE_INT },
+    { "Scanner", "Rest", (void *)&config.scanner_rest, TYPE_INT },
+    { "Cache", "Path", (void *)&config.cache_path, TYPE_STRING },
+    { "Cache", "Size", (void *)&config.cache_size, TYPE_INT },
+    { "Cache", "Rest", (void *)&config.cache_rest, TYPE_INT },
+    { "Scheduler", "Load_Rest", (void *)&config.scheduler_load_rest, TYPE_INT },
+    { "Scheduler", "Pause_Buffer", (void *)&config.scheduler_pause_buffer, TYPE_INT },
+#ifndef EMPEG_DSP
+    { "Sound", "Driver", (void *)&config.sound_driver, TYPE_STRING },
+    { "Sound", "Rate", (void *)&config.sound_rate, TYPE_INT },
+    { "Sound", "Channels", (void *)&config.sound_channels, TYPE_INT },
+    { "Sound", "ALSA_Device", (void *)&config.sound_alsa_device, TYPE_STRING },
+    { "Sound", "ALSA_Period_Time", (void *)&config.sound_alsa_period_time, TYPE_INT },
+    { "Sound", "ALSA_Buffer_Time", (void *)&config.sound_alsa_buffer_time, TYPE_INT },
+    { "Sound", "Pipe_File", (void *)&config.sound_pipe_file, TYPE_STRING },
+    { "Sound", "Null_Paced", (void *)&config.sound_null_paced, TYPE_INT },
+    { "Sound", "WAV_File", (void *)&config.sound_wav_file, TYPE_STRING }
+#endif
 };
 
 #ifdef EMPEG
@@ -245,6 +275,8 @@ enum song_type_e get_song_type( const char *base_name, const char *file_name ) {
         type = TYPE_OGG;
     } else if( !strncasecmp(file_name + file_name_length - 5, ".flac", 5) ) {
         type = TYPE_FLAC;
+    } else if( !strncasecmp(file_name + file_name_length - 4, ".wav", 4) ) {
+        type = TYPE_WAV;
     }
 
 #ifdef USE_MAGIC
@@ -271,6 +303,9 @@ enum song_type_e get_song_type( const char *base_name, const char *file_name ) {
         } else if ( buf[0] == 'f' && buf[1] == 'L' && buf[2] == 'a' && buf[3] == 'C' ) {
             squash_log("Magically flac-delicious");
             type = TYPE_FLAC;
+        } else if ( buf[0] == 'R' && buf[1] == 'I' && buf[2] == 'F' && buf[3] == 'F' ) {
+            squash_log("Magically wav-delicious");
+            type = TYPE_WAV;
         } else {
             squash_log("Just ain't enough magic in the world");
         }
@@ -683,6 +718,65 @@ void init_config( void ) {
     config.playlist_manager_playlist_size = 32;
     config.playlist_manager_pastlist_size = 32;
 
+    /* Player Options */
+    config.player_silence_threshold = -60.0;
+    config.player_silence_duration = 1000;
+    config.player_buffer_low = 2000;
+    config.player_buffer_high = 6000;
+#ifdef EMPEG
+    config.player_buffer_memory = 768;
+#else
+    config.player_buffer_memory = 2048;
+#endif
+    config.player_replay_gain = strdup("track");
+    config.player_replay_gain_preamp = 0.0;
+    config.player_crossfade = 0;
+
+    /* Analyzer Options */
+#ifdef EMPEG
+    config.analyzer_threads = 1;
+#else
+    config.analyzer_threads = 2;
+#endif
+    config.analyzer_rest = 1000;
+#ifdef EMPEG
+    config.analyzer_decode_threads = 1;
+#else
+    config.analyzer_decode_threads = 4;
+#endif
+
+    /* Scanner Options */
+    config.scanner_threads = 0;
+    config.scanner_io_rate = 0;
+    config.scanner_rest = -1;
+
+    /* Cache Options */
+    config.cache_path = NULL;
+    config.cache_size = 512;
+    config.cache_rest = 1000;
+
+    /* Scheduler Options */
+    config.scheduler_load_rest = 100;
+    config.scheduler_pause_buffer = 1000;
+
+#ifndef EMPEG_DSP
+    /* Sound Options */
+    config.sound_driver = strdup("ao");
+#ifdef EMPEG
+    config.sound_rate = 44100;
+#else
+    /* Resampling costs some of the top octave, so only when asked */
+    config.sound_rate = 0;
+#endif
+    config.sound_channels = 2;
+    config.sound_alsa_device = strdup("default");
+    config.sound_alsa_period_time = 25;
+    config.sound_alsa_buffer_time = 100;
+    config.sound_pipe_file = strdup("-");
+    config.sound_null_paced = 1;
+    config.sound_wav_file = strdup("~/squash.wav");
+#endif
+
     /* Debug Options */
 #ifdef DEBUG
     config.squash_log_path = strdup("~/.squash_log");
@@ -716,6 +810,11 @@ void init_config( void ) {
     expand_path( &config.db_paths[ BASENAME_META ] );
     expand_path( &config.db_paths[ BASENAME_STAT ] );
     expand_path( &config.db_masterlist_path );
+    expand_path( &config.cache_path );
+#ifndef EMPEG_DSP
+    expand_path( &config.sound_pipe_file );
+    expand_path( &config.sound_wav_file );
+#endif
 #ifdef DEBUG
     expand_path( &config.squash_log_path );
 #endif
@@ -829,3 +928,93 @@ void create_path( char *dir ) {
 }
 
 
+
+/*
+ * Compare-and-swap for compilers without the __sync builtins.  Use the
+ * squash_cas() macro instead.
+ */
+bool _squash_cas( volatile unsigned long *ptr, unsigned long old_value, unsigned long new_value ) {
+    static pthread_mutex_t cas_lock = PTHREAD_MUTEX_INITIALIZER;
+    bool swapped = FALSE;
+
+    squash_lock( cas_lock );
+    if( *ptr == old_value ) {
+        *ptr = new_value;
+        swapped = TRUE;
+    }
+    squash_unlock( cas_lock );
+
+    return swapped;
+}
+
+/*
+ * Microseconds since start
+ */
+long squash_elapsed_usec( struct timeval *start ) {
+    struct timeval now;
+
+    gettimeofday( &now, NULL );
+
+    return (now.tv_sec - start->tv_sec) * 1000000 + (now.tv_usec - start->tv_usec);
+}
+
+/*
+ * Sleeps for msecs, for jobs that don't mind exactly when they run.
+ * Rather than waking up on its own it carries on with the frame
+ * decoder's next burst once the time is up, waiting at most slack
+ * milliseconds more for one, so the CPU (and disk) wake once for both.
+ */
+void squash_coalesced_sleep( long msecs, long slack ) {
+    struct timeval now, due;
+    struct timespec deadline;
+    long bursts;
+    bool coalesced = FALSE;
+
+    gettimeofday( &now, NULL );
+    due.tv_sec = now.tv_sec + msecs / 1000;
+    due.tv_usec = now.tv_usec + (msecs % 1000) * 1000;
+    if( due.tv_usec >= 1000000 ) {
+        due.tv_sec++;
+        due.tv_usec -= 1000000;
+    }
+    deadline.tv_sec = due.tv_sec + slack / 1000;
+    deadline.tv_nsec = due.tv_usec * 1000 + (slack % 1000) * 1000000;
+    if( deadline.tv_nsec >= 1000000000 ) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    squash_lock( wakeup_info.lock );
+    while( !squash_quitting() ) {
+        bursts = wakeup_info.bursts;
+        if( pthread_cond_timedwait(&wakeup_info.burst, &wakeup_info.lock, &deadline) == ETIMEDOUT ) {
+            break;
+        }
+        gettimeofday( &now, NULL );
+        if( wakeup_info.bursts != bursts && !timercmp(&now, &due, <) ) {
+            coalesced = TRUE;
+            break;
+        }
+    }
+    if( coalesced ) {
+        wakeup_info.timer_coalesced++;
+    } else {
+        wakeup_info.timer_wakeups++;
+    }
+    squash_unlock( wakeup_info.lock );
+}
+
+/*
+ * TRUE once main() has asked the threads to stop.  Threads check it
+ * where they hold no half finished work, and before waiting on a
+ * condition (with the condition's lock held, main() broadcasts them all).
+ */
+bool squash_quitting( void ) {
+    bool quitting;
+
+    squash_lock( status_info.lock );
+    quitting = status_info.quitting;
+    squash_unlock( status_info.lock );
+
+    return quitting;
+}
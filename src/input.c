@@ -22,9 +22,9 @@
 
 #include "global.h"
 #include "display.h"    /* for draw_screen() and set_display_info_brightness() */
-#include "player.h"     /* for player_queue_command() */
+#include "player.h"     /* for player_queue_command(), frame_buffer_set_watermarks() */
 #include "database.h"   /* for clear_song_meta() and load_meta_data() */
-#include "stat.h"       /* for feedback() */
+#include "stat.h"       /* for queue_feedback() */
 #include "sound.h"      /* for sound_adjust_volume */
 #include "input.h"
 
@@ -54,7 +54,7 @@ void do_remove_playlist_entry() {
         if( queue_entry == song_queue.tail ) {
             song_queue.tail = queue_last_entry;
         }
-        feedback( queue_entry->song_info , -1);
+        queue_feedback( queue_entry->song_info, -1 );
         squash_free( queue_entry );
         song_queue.size--;
     }
@@ -388,7 +388,7 @@ void process_ir_event( long button, bool held ) {
                             if( queue_entry == song_queue.tail ) {
                                 song_queue.tail = queue_last_entry;
                             }
-                            feedback( queue_entry->song_info , -1);
+                            queue_feedback( queue_entry->song_info, -1 );
                             squash_free( queue_entry );
                             song_queue.size--;
                         }
@@ -1030,6 +1030,10 @@ void *fifo_monitor( void *input_data ) {
                 do_set_player_command( CMD_SKIP );
             } else if ( strncasecmp( buffer, "stop\n", 5 ) == 0 ) {
                 do_set_player_command( CMD_STOP );
+            } else if ( strncasecmp( buffer, "buffer_increase\n", 16 ) == 0 ) {
+                do_adjust_buffer( 1000 );
+            } else if ( strncasecmp( buffer, "buffer_decrease\n", 16 ) == 0 ) {
+                do_adjust_buffer( -1000 );
             }
         }
         fclose( fifo_info.fifo_file );
@@ -1080,20 +1084,38 @@ void do_quit( void ) {
 }
 
 /*
- * Set the play status
+ * Grow or shrink the frame buffer's high watermark by amount milliseconds.
+ * The low watermark stays put unless it would end up above the high one.
  */
-void do_set_player_command( enum player_command_e command ) {
-    /* Acquire Now Playing lock */
-    squash_lock( player_command.lock );
+void do_adjust_buffer( int amount ) {
+    squash_lock( frame_buffer.lock );
 
-    /* Set Command */
-    player_queue_command( command );
+    config.player_buffer_high += amount;
+    if( config.player_buffer_high < 500 ) {
+        config.player_buffer_high = 500;
+    }
+    if( config.player_buffer_low > config.player_buffer_high ) {
+        config.player_buffer_low = config.player_buffer_high;
+    }
+    frame_buffer_set_watermarks();
 
-    /* Release Now Playing Lock */
-    squash_unlock( player_command.lock );
+    /* Let the frame decoder fill up to the new size */
+    if( frame_buffer.pcm_size < frame_buffer.high_water ) {
+        frame_buffer.filling = TRUE;
+        squash_broadcast( frame_buffer.restart );
+    }
+
+    squash_unlock( frame_buffer.lock );
 
-    /* Broadcast a new command is avaiable */
-    squash_broadcast( player_command.changed );
+    squash_broadcast( display_info.changed );
+}
+
+/*
+ * Set the play status
+ */
+void do_set_player_command( enum player_command_e command ) {
+    /* Set Command (this wakes the player too) */
+    player_queue_command( command );
 }
 
 /*
@@ -1102,7 +1124,6 @@ void do_set_player_command( enum player_command_e command ) {
 void do_toggle_player_command( void ) {
     /* Acquire Now Playing lock */
     squash_lock( player_info.lock );
-    squash_lock( player_command.lock );
 
     /* Determine which command to set */
     switch( player_info.state ) {
@@ -1119,11 +1140,7 @@ void do_toggle_player_command( void ) {
     }
 
     /* Release Now Playing Lock */
-    squash_unlock( player_command.lock );
     squash_unlock( player_info.lock );
-
-    /* Broadcast a new command is avaiable */
-    squash_broadcast( player_command.changed );
 }
 
 #ifndef NO_NCURSES
@@ -1355,7 +1372,7 @@ void do_delete( void ) {
         if( queue_entry == *tail ) {
             *tail = queue_last_entry;
         }
-        feedback( queue_entry->song_info , -1);
+        queue_feedback( queue_entry->song_info, -1 );
         squash_free( queue_entry );
         *size = *size - 1;
     }
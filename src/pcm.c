@@ -0,0 +1,642 @@
+/*
+ * Copyright 2003 by Adam Luter
+ * This file is part of Squash, a C/Ncurses-based unix music player.
+ *
+ * Squash is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Squash is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Squash; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+/*
+ * pcm.c
+ * Sample-domain routines that work directly on 16 bit PCM data.
+ * These are run on every frame, so where the compiler offers SSE2 the
+ * inner loops are vectorized.  Everything else (like the empeg) uses the
+ * plain C loops, which are also used to finish off any partial vectors.
+ */
+
+#include "global.h"
+#include "pcm.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+ * Converts a level in dBFS into the largest 16 bit sample magnitude
+ * that is still considered to be at or below that level.
+ */
+short pcm_db_to_amplitude( double db ) {
+    double amplitude = 32767.0 * pow( 10.0, db / 20.0 );
+
+    if( amplitude > 32767.0 ) {
+        return 32767;
+    }
+    if( amplitude < 0.0 ) {
+        return 0;
+    }
+    return (short)amplitude;
+}
+
+/*
+ * Returns how many samples at the start of samples[] have a magnitude
+ * no larger than threshold.
+ */
+long pcm_silent_prefix( const short *samples, long count, short threshold ) {
+    long i = 0;
+#ifdef __SSE2__
+    __m128i limit = _mm_set1_epi16( threshold );
+    __m128i zero = _mm_setzero_si128();
+    __m128i x;
+
+    for( ; i + 8 <= count; i += 8 ) {
+        x = _mm_loadu_si128( (const __m128i *)&samples[i] );
+        /* saturating negate, so that -32768 becomes 32767 and not itself */
+        x = _mm_max_epi16( x, _mm_subs_epi16(zero, x) );
+        if( _mm_movemask_epi8( _mm_cmpgt_epi16(x, limit) ) ) {
+            /* something in here is loud, let the loop below find it */
+            break;
+        }
+    }
+#endif
+
+    for( ; i < count; i++ ) {
+        if( abs(samples[i]) > threshold ) {
+            break;
+        }
+    }
+
+    return i;
+}
+
+/*
+ * Returns how many samples at the end of samples[] have a magnitude
+ * no larger than threshold.
+ */
+long pcm_silent_suffix( const short *samples, long count, short threshold ) {
+    long i = count;
+#ifdef __SSE2__
+    __m128i limit = _mm_set1_epi16( threshold );
+    __m128i zero = _mm_setzero_si128();
+    __m128i x;
+
+    for( ; i >= 8; i -= 8 ) {
+        x = _mm_loadu_si128( (const __m128i *)&samples[i - 8] );
+        x = _mm_max_epi16( x, _mm_subs_epi16(zero, x) );
+        if( _mm_movemask_epi8( _mm_cmpgt_epi16(x, limit) ) ) {
+            break;
+        }
+    }
+#endif
+
+    for( ; i > 0; i-- ) {
+        if( abs(samples[i - 1]) > threshold ) {
+            break;
+        }
+    }
+
+    return count - i;
+}
+
+/*
+ * Works out the gain for a song from its ReplayGain (in dB) and peak (as
+ * a fraction of full scale, 0 if unknown).  The gain is held down so the
+ * peak will not clip, which is all the limiting that ReplayGain needs;
+ * anything left over is saturated by the conversion routines below.
+ */
+pcm_gain_t pcm_gain( double db, double peak ) {
+    pcm_gain_t gain;
+    double scale = pow( 10.0, db / 20.0 );
+
+    if( peak > 0.0 && scale * peak > 1.0 ) {
+        scale = 1.0 / peak;
+    }
+    if( scale > PCM_GAIN_MAX ) {
+        scale = PCM_GAIN_MAX;
+    }
+
+    gain.scale = (float)scale;
+    gain.scale_q12 = (int)(scale * 4096.0 + 0.5);
+
+    return gain;
+}
+
+/*
+ * Scale a sample already shifted down to 16 bits (give or take some
+ * overflow) by a 4.12 fixed point gain, rounding and clipping.
+ */
+static short pcm_scale_q12( int sample, int scale_q12 ) {
+    /* Keep the product inside 32 bits */
+    if( sample > 65535 ) {
+        sample = 65535;
+    } else if( sample < -65536 ) {
+        sample = -65536;
+    }
+    sample = (sample * scale_q12 + 2048) >> 12;
+    if( sample > 32767 ) {
+        return 32767;
+    } else if( sample < -32768 ) {
+        return -32768;
+    }
+    return sample;
+}
+
+/*
+ * Speaker positions, in the order each layout puts a file's channels.
+ * Vorbis has its own order; FLAC (and WAV) use the WAVE one.
+ */
+enum pcm_speaker_e { SPEAKER_FL, SPEAKER_FR, SPEAKER_FC, SPEAKER_LFE, SPEAKER_BL, SPEAKER_BR, SPEAKER_SL, SPEAKER_SR, SPEAKER_BC };
+
+static const char pcm_layouts[2][ PCM_MIX_MAX_CHANNELS + 1 ][ PCM_MIX_MAX_CHANNELS ] = {
+    {   /* PCM_LAYOUT_VORBIS */
+        { 0 }, { SPEAKER_FC }, { SPEAKER_FL, SPEAKER_FR }, { SPEAKER_FL, SPEAKER_FC, SPEAKER_FR }, { SPEAKER_FL, SPEAKER_FR, SPEAKER_BL, SPEAKER_BR },
+        { SPEAKER_FL, SPEAKER_FC, SPEAKER_FR, SPEAKER_BL, SPEAKER_BR }, { SPEAKER_FL, SPEAKER_FC, SPEAKER_FR, SPEAKER_BL, SPEAKER_BR, SPEAKER_LFE },
+        { SPEAKER_FL, SPEAKER_FC, SPEAKER_FR, SPEAKER_SL, SPEAKER_SR, SPEAKER_BC, SPEAKER_LFE }, { SPEAKER_FL, SPEAKER_FC, SPEAKER_FR, SPEAKER_SL, SPEAKER_SR, SPEAKER_BL, SPEAKER_BR, SPEAKER_LFE }
+    },
+    {   /* PCM_LAYOUT_WAVE */
+        { 0 }, { SPEAKER_FC }, { SPEAKER_FL, SPEAKER_FR }, { SPEAKER_FL, SPEAKER_FR, SPEAKER_FC }, { SPEAKER_FL, SPEAKER_FR, SPEAKER_BL, SPEAKER_BR },
+        { SPEAKER_FL, SPEAKER_FR, SPEAKER_FC, SPEAKER_BL, SPEAKER_BR }, { SPEAKER_FL, SPEAKER_FR, SPEAKER_FC, SPEAKER_LFE, SPEAKER_BL, SPEAKER_BR },
+        { SPEAKER_FL, SPEAKER_FR, SPEAKER_FC, SPEAKER_LFE, SPEAKER_BC, SPEAKER_SL, SPEAKER_SR }, { SPEAKER_FL, SPEAKER_FR, SPEAKER_FC, SPEAKER_LFE, SPEAKER_BL, SPEAKER_BR, SPEAKER_SL, SPEAKER_SR }
+    }
+};
+
+/*
+ * Works out how to mix a decoder's channels down to the stereo the rest
+ * of squash plays.  Mono goes to both sides.  Anything over two channels
+ * uses the ITU-R BS.775 downmix (centre and surrounds at -3dB, the SPEAKER_LFE
+ * left out), scaled down so that it can never clip.  Returns FALSE if
+ * there are too many channels.
+ */
+bool pcm_mix( pcm_mix_t *mix, int channels, enum pcm_layout_e layout ) {
+    float left, right, total;
+    int c;
+
+    if( channels <= 0 || channels > PCM_MIX_MAX_CHANNELS ) {
+        return FALSE;
+    }
+
+    mix->channels = channels;
+    total = 0.0f;
+    for( c = 0; c < channels; c++ ) {
+        switch( pcm_layouts[ layout ][ channels ][ c ] ) {
+            case SPEAKER_FL:
+                left = 1.0f;
+                right = 0.0f;
+                break;
+            case SPEAKER_FR:
+                left = 0.0f;
+                right = 1.0f;
+                break;
+            case SPEAKER_FC:
+                left = right = channels == 1 ? 1.0f : (float)M_SQRT1_2;
+                break;
+            case SPEAKER_BL:
+            case SPEAKER_SL:
+                left = (float)M_SQRT1_2;
+                right = 0.0f;
+                break;
+            case SPEAKER_BR:
+            case SPEAKER_SR:
+                left = 0.0f;
+                right = (float)M_SQRT1_2;
+                break;
+            case SPEAKER_BC:
+                left = right = 0.5f;
+                break;
+            default:
+                left = right = 0.0f;
+                break;
+        }
+        mix->left[c] = left;
+        mix->right[c] = right;
+        total += left;
+    }
+
+    for( c = 0; c < channels; c++ ) {
+        if( channels > 2 ) {
+            mix->left[c] /= total;
+            mix->right[c] /= total;
+        }
+        mix->left_q12[c] = (int)(mix->left[c] * 4096.0f + 0.5f);
+        mix->right_q12[c] = (int)(mix->right[c] * 4096.0f + 0.5f);
+    }
+
+    return TRUE;
+}
+
+#ifdef __SSE2__
+/*
+ * Mixes four frames of every channel down to left and right.
+ */
+static void pcm_mix4( const pcm_mix_t *mix, const __m128 *x, __m128 *left, __m128 *right ) {
+    int c;
+
+    if( mix->channels == 1 ) {
+        *left = *right = x[0];
+    } else if( mix->channels == 2 ) {
+        *left = x[0];
+        *right = x[1];
+    } else {
+        *left = _mm_setzero_ps();
+        *right = _mm_setzero_ps();
+        for( c = 0; c < mix->channels; c++ ) {
+            *left = _mm_add_ps( *left, _mm_mul_ps( x[c], _mm_set1_ps( mix->left[c] ) ) );
+            *right = _mm_add_ps( *right, _mm_mul_ps( x[c], _mm_set1_ps( mix->right[c] ) ) );
+        }
+    }
+}
+
+/*
+ * Saturates four frames to 16 bits and stores them interleaved.
+ */
+static void pcm_store4( char *out, __m128 left, __m128 right ) {
+    __m128i packed;
+
+    /* l0-l3 r0-r3, then l0 r0 l1 r1 ... */
+    packed = _mm_packs_epi32( _mm_cvtps_epi32( left ), _mm_cvtps_epi32( right ) );
+    _mm_storeu_si128( (__m128i *)out, _mm_unpacklo_epi16( packed, _mm_srli_si128( packed, 8 ) ) );
+}
+#endif
+
+/*
+ * Mixes one frame of 16 bit samples down to stereo in 4.12 fixed point.
+ */
+static void pcm_mix_q12( const pcm_mix_t *mix, const int *samples, int *left, int *right ) {
+    int c;
+
+    if( mix->channels == 1 ) {
+        *left = *right = samples[0];
+    } else if( mix->channels == 2 ) {
+        *left = samples[0];
+        *right = samples[1];
+    } else {
+        *left = *right = 2048;
+        for( c = 0; c < mix->channels; c++ ) {
+            *left += mix->left_q12[c] * samples[c];
+            *right += mix->right_q12[c] * samples[c];
+        }
+        *left >>= 12;
+        *right >>= 12;
+    }
+}
+
+/*
+ * Decoders call these to turn their planar samples into the interleaved
+ * 16 bit little endian stereo the player uses, mixing the channels down
+ * (see pcm_mix()) and applying the song's gain on the way, so that it
+ * all costs one pass over the data.  out must hold frames * 4 bytes.
+ *
+ * pcm_interleave_int32() takes integer samples of the given number of
+ * bits (including the sign bit, so libmad's fixed point counts as
+ * MAD_F_FRACBITS + 1 bits).
+ */
+void pcm_interleave_int32( char *out, const int *const *planes, const pcm_mix_t *mix, long frames, int bits, pcm_gain_t gain ) {
+    long i = 0;
+    int c, shift, left, right;
+    int samples[ PCM_MIX_MAX_CHANNELS ];
+#ifdef __SSE2__
+    __m128 scale = _mm_set1_ps( gain.scale * (float)pow( 2.0, 16 - bits ) );
+    __m128 x[ PCM_MIX_MAX_CHANNELS ], left4, right4;
+
+    for( ; i + 4 <= frames; i += 4 ) {
+        for( c = 0; c < mix->channels; c++ ) {
+            x[c] = _mm_mul_ps( _mm_cvtepi32_ps( _mm_loadu_si128( (const __m128i *)&planes[c][i] ) ), scale );
+        }
+        pcm_mix4( mix, x, &left4, &right4 );
+        pcm_store4( &out[i * 4], left4, right4 );
+    }
+#endif
+
+    shift = bits - 16;
+    out += i * 4;
+    for( ; i < frames; i++ ) {
+        for( c = 0; c < mix->channels; c++ ) {
+            samples[c] = planes[c][i];
+            if( shift > 0 ) {
+                samples[c] = (samples[c] + (1 << (shift - 1))) >> shift;
+            } else if( shift < 0 ) {
+                samples[c] <<= -shift;
+            }
+        }
+        pcm_mix_q12( mix, samples, &left, &right );
+        left = pcm_scale_q12( left, gain.scale_q12 );
+        right = pcm_scale_q12( right, gain.scale_q12 );
+        *out++ = left & 0xFF;
+        *out++ = (left >> 8) & 0xFF;
+        *out++ = right & 0xFF;
+        *out++ = (right >> 8) & 0xFF;
+    }
+}
+
+#ifndef TREMOR
+/*
+ * Rounds and saturates a floating point sample to 16 bits.
+ */
+static int pcm_round_float( float sample ) {
+    int rounded = (int)floorf( sample + 0.5f );
+
+    if( rounded > 32767 ) {
+        return 32767;
+    } else if( rounded < -32768 ) {
+        return -32768;
+    }
+    return rounded;
+}
+
+/*
+ * The same for floating point samples running from -1.0 to 1.0.
+ */
+void pcm_interleave_float( char *out, const float *const *planes, const pcm_mix_t *mix, long frames, pcm_gain_t gain ) {
+    long i = 0;
+    int c, sample;
+    float scale = gain.scale * 32768.0f;
+    float left, right;
+#ifdef __SSE2__
+    __m128 scale4 = _mm_set1_ps( scale );
+    __m128 x[ PCM_MIX_MAX_CHANNELS ], left4, right4;
+
+    for( ; i + 4 <= frames; i += 4 ) {
+        for( c = 0; c < mix->channels; c++ ) {
+            x[c] = _mm_mul_ps( _mm_loadu_ps( &planes[c][i] ), scale4 );
+        }
+        pcm_mix4( mix, x, &left4, &right4 );
+        pcm_store4( &out[i * 4], left4, right4 );
+    }
+#endif
+
+    out += i * 4;
+    for( ; i < frames; i++ ) {
+        if( mix->channels == 1 ) {
+            left = right = planes[0][i];
+        } else {
+            left = right = 0.0f;
+            for( c = 0; c < mix->channels; c++ ) {
+                left += mix->left[c] * planes[c][i];
+                right += mix->right[c] * planes[c][i];
+            }
+        }
+        sample = pcm_round_float( left * scale );
+        *out++ = sample & 0xFF;
+        *out++ = (sample >> 8) & 0xFF;
+        sample = pcm_round_float( right * scale );
+        *out++ = sample & 0xFF;
+        *out++ = (sample >> 8) & 0xFF;
+    }
+}
+#endif
+
+/*
+ * Mixes interleaved 16 bit samples down to stereo and applies a gain, in
+ * place, for decoders (Tremor) that only hand out finished 16 bit data.
+ * Mono doubles in size, so samples must have room for frames * 2.
+ */
+void pcm_mix_in_place( short *samples, const pcm_mix_t *mix, long frames, pcm_gain_t gain ) {
+    long i;
+    int c, left, right;
+    int frame[ PCM_MIX_MAX_CHANNELS ];
+
+    if( mix->channels == 1 ) {
+        /* Work backwards so nothing is overwritten before it is read */
+        for( i = frames - 1; i >= 0; i-- ) {
+            samples[ i * 2 ] = samples[ i * 2 + 1 ] = pcm_scale_q12( samples[i], gain.scale_q12 );
+        }
+    } else if( mix->channels == 2 ) {
+        if( gain.scale_q12 == 4096 ) {
+            return;
+        }
+        for( i = 0; i < frames * 2; i++ ) {
+            samples[i] = pcm_scale_q12( samples[i], gain.scale_q12 );
+        }
+    } else {
+        for( i = 0; i < frames; i++ ) {
+            for( c = 0; c < mix->channels; c++ ) {
+                frame[c] = samples[ i * mix->channels + c ];
+            }
+            pcm_mix_q12( mix, frame, &left, &right );
+            samples[ i * 2 ] = pcm_scale_q12( left, gain.scale_q12 );
+            samples[ i * 2 + 1 ] = pcm_scale_q12( right, gain.scale_q12 );
+        }
+    }
+}
+
+/*
+ * Bytes in one sample of each packed format.
+ */
+int pcm_sample_bytes( enum pcm_sample_e format ) {
+    static const int bytes[] = { 1, 2, 3, 4, 4 };
+
+    return bytes[ format ];
+}
+
+/*
+ * Reads one packed little endian integer sample, scaled up to fill 32
+ * bits.
+ */
+static int pcm_packed_int( const unsigned char *in, enum pcm_sample_e format ) {
+    switch( format ) {
+        case PCM_SAMPLE_U8:
+            return (int)((unsigned int)(in[0] ^ 0x80) << 24);
+        case PCM_SAMPLE_S16:
+            return (int)((unsigned int)in[0] << 16 | (unsigned int)in[1] << 24);
+        case PCM_SAMPLE_S24:
+            return (int)((unsigned int)in[0] << 8 | (unsigned int)in[1] << 16 | (unsigned int)in[2] << 24);
+        default:
+            return (int)((unsigned int)in[0] | (unsigned int)in[1] << 8 | (unsigned int)in[2] << 16 | (unsigned int)in[3] << 24);
+    }
+}
+
+/*
+ * Reads one packed little endian 32 bit float sample.
+ */
+static float pcm_packed_float( const unsigned char *in ) {
+    union { unsigned int i; float f; } sample;
+
+    sample.i = (unsigned int)in[0] | (unsigned int)in[1] << 8 | (unsigned int)in[2] << 16 | (unsigned int)in[3] << 24;
+    return sample.f;
+}
+
+/*
+ * The same as pcm_interleave_int32(), for interleaved samples packed
+ * the way they are in a WAV file (integers little endian, 8 bit ones
+ * unsigned, floats running from -1.0 to 1.0).
+ */
+void pcm_interleave_packed( char *out, const unsigned char *in, enum pcm_sample_e format, const pcm_mix_t *mix, long frames, pcm_gain_t gain ) {
+    int bytes = pcm_sample_bytes( format );
+    int stride = bytes * mix->channels;
+    long i = 0;
+    int c, left, right;
+    int samples[ PCM_MIX_MAX_CHANNELS ];
+    float fleft, fright, sample;
+#ifdef __SSE2__
+    __m128 x[ PCM_MIX_MAX_CHANNELS ], left4, right4, scale;
+    const unsigned char *frame;
+
+    if( format == PCM_SAMPLE_FLOAT ) {
+        scale = _mm_set1_ps( gain.scale * 32768.0f );
+    } else {
+        scale = _mm_set1_ps( gain.scale / 65536.0f );
+    }
+
+    for( ; i + 4 <= frames; i += 4 ) {
+        frame = in + i * stride;
+        if( format == PCM_SAMPLE_FLOAT && mix->channels == 2 ) {
+            /* l0 r0 l1 r1, l2 r2 l3 r3 */
+            left4 = _mm_loadu_ps( (const float *)frame );
+            right4 = _mm_loadu_ps( (const float *)(frame + 16) );
+            x[0] = _mm_mul_ps( _mm_shuffle_ps( left4, right4, _MM_SHUFFLE(2, 0, 2, 0) ), scale );
+            x[1] = _mm_mul_ps( _mm_shuffle_ps( left4, right4, _MM_SHUFFLE(3, 1, 3, 1) ), scale );
+        } else {
+            for( c = 0; c < mix->channels; c++ ) {
+                if( format == PCM_SAMPLE_FLOAT ) {
+                    x[c] = _mm_setr_ps( pcm_packed_float( frame + c * bytes ), pcm_packed_float( frame + stride + c * bytes ),
+                            pcm_packed_float( frame + 2 * stride + c * bytes ), pcm_packed_float( frame + 3 * stride + c * bytes ) );
+                } else {
+                    x[c] = _mm_cvtepi32_ps( _mm_setr_epi32( pcm_packed_int( frame + c * bytes, format ),
+                            pcm_packed_int( frame + stride + c * bytes, format ), pcm_packed_int( frame + 2 * stride + c * bytes, format ),
+                            pcm_packed_int( frame + 3 * stride + c * bytes, format ) ) );
+                }
+                x[c] = _mm_mul_ps( x[c], scale );
+            }
+        }
+        pcm_mix4( mix, x, &left4, &right4 );
+        pcm_store4( &out[i * 4], left4, right4 );
+    }
+#endif
+
+    out += i * 4;
+    in += i * stride;
+    for( ; i < frames; i++, in += stride ) {
+        if( format == PCM_SAMPLE_FLOAT ) {
+            /* No FPU on the empeg, but nobody plays float WAVs on it */
+            if( mix->channels <= 2 ) {
+                fleft = pcm_packed_float( in );
+                fright = pcm_packed_float( in + (mix->channels - 1) * bytes );
+            } else {
+                fleft = fright = 0.0f;
+                for( c = 0; c < mix->channels; c++ ) {
+                    sample = pcm_packed_float( in + c * bytes );
+                    fleft += mix->left[c] * sample;
+                    fright += mix->right[c] * sample;
+                }
+            }
+            /* pcm_scale_q12() clips anything past 2.0 anyway */
+            fleft = fleft > 2.0f ? 2.0f : (fleft < -2.0f ? -2.0f : fleft);
+            fright = fright > 2.0f ? 2.0f : (fright < -2.0f ? -2.0f : fright);
+            left = pcm_scale_q12( (int)floorf( fleft * 32768.0f + 0.5f ), gain.scale_q12 );
+            right = pcm_scale_q12( (int)floorf( fright * 32768.0f + 0.5f ), gain.scale_q12 );
+        } else {
+            for( c = 0; c < mix->channels; c++ ) {
+                /* Round to 16 bits without overflowing */
+                samples[c] = ((pcm_packed_int( in + c * bytes, format ) >> 15) + 1) >> 1;
+            }
+            pcm_mix_q12( mix, samples, &left, &right );
+            left = pcm_scale_q12( left, gain.scale_q12 );
+            right = pcm_scale_q12( right, gain.scale_q12 );
+        }
+        *out++ = left & 0xFF;
+        *out++ = (left >> 8) & 0xFF;
+        *out++ = right & 0xFF;
+        *out++ = (right >> 8) & 0xFF;
+    }
+}
+
+/*
+ * The equal power fade curve, sin() from 0 to pi/2 in 1.15 fixed point.
+ * Fading in goes up the table while fading out comes down it, so the two
+ * always add up to the same power.
+ */
+static short pcm_fade_curve[ PCM_FADE_STEPS ];
+static bool pcm_fade_ready = FALSE;
+
+static void pcm_fade_init( void ) {
+    int i;
+
+    for( i = 0; i < PCM_FADE_STEPS; i++ ) {
+        pcm_fade_curve[i] = (short)floor( 32767.0 * sin( M_PI / 2 * i / (PCM_FADE_STEPS - 1) ) + 0.5 );
+    }
+    pcm_fade_ready = TRUE;
+}
+
+/*
+ * Crossfades interleaved 16 bit stereo, fading from out and in to, which
+ * are both frames long, and leaving the result in out (which may be either
+ * of them).  from may be NULL to just fade in, and to may be NULL to just
+ * fade out.  done is how many frames of the fade came before these, out of
+ * length, and past that to is all that is left.  The gain steps along the curve every length / PCM_FADE_STEPS
+ * frames, which is far too fine to hear.
+ */
+void pcm_crossfade( short *out, const short *from, const short *to, long frames, long done, long length ) {
+    long i, end;
+    int step, sample;
+    int gain_from, gain_to;
+
+    if( !pcm_fade_ready ) {
+        pcm_fade_init();
+    }
+
+    i = 0;
+    while( i < frames ) {
+        /* Find the run of frames on this step of the curve */
+        if( done + i >= length ) {
+            step = PCM_FADE_STEPS - 1;
+            end = frames;
+        } else {
+            step = (int)((double)(done + i) * PCM_FADE_STEPS / length);
+            end = (long)ceil( (double)(step + 1) * length / PCM_FADE_STEPS ) - done;
+            if( end > frames ) {
+                end = frames;
+            }
+        }
+        gain_from = pcm_fade_curve[ PCM_FADE_STEPS - 1 - step ];
+        gain_to = pcm_fade_curve[ step ];
+        if( from == NULL ) {
+            gain_from = 0;
+        }
+        if( to == NULL ) {
+            gain_to = 0;
+        }
+
+#ifdef __SSE2__
+        {
+            /* Pair each from sample with its to sample, so that one
+             * multiply-add does both gains */
+            __m128i gains = _mm_set1_epi32( (gain_to << 16) | gain_from );
+            __m128i round = _mm_set1_epi32( 16384 );
+            __m128i zero = _mm_setzero_si128();
+
+            for( ; i + 4 <= end; i += 4 ) {
+                __m128i a = from ? _mm_loadu_si128( (const __m128i *)(from + i * 2) ) : zero;
+                __m128i b = to ? _mm_loadu_si128( (const __m128i *)(to + i * 2) ) : zero;
+                __m128i lo = _mm_madd_epi16( _mm_unpacklo_epi16( a, b ), gains );
+                __m128i hi = _mm_madd_epi16( _mm_unpackhi_epi16( a, b ), gains );
+
+                lo = _mm_srai_epi32( _mm_add_epi32( lo, round ), 15 );
+                hi = _mm_srai_epi32( _mm_add_epi32( hi, round ), 15 );
+                _mm_storeu_si128( (__m128i *)(out + i * 2), _mm_packs_epi32( lo, hi ) );
+            }
+        }
+#endif
+        for( ; i < end; i++ ) {
+            int c;
+
+            for( c = i * 2; c < i * 2 + 2; c++ ) {
+                sample = ((from ? from[c] * gain_from : 0) + (to ? to[c] * gain_to : 0) + 16384) >> 15;
+                if( sample > 32767 ) {
+                    sample = 32767;
+                } else if( sample < -32768 ) {
+                    sample = -32768;
+                }
+                out[c] = sample;
+            }
+        }
+    }
+}
@@ -0,0 +1,478 @@
+/*
+ * Copyright 2003 by Adam Luter
+ * This file is part of Squash, a C/Ncurses-based unix music player.
+ *
+ * Squash is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Squash is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Squash; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+/*
+ * pcm_cache.c
+ */
+
+/*
+ * Keeps the songs most likely to be picked on disk already decoded, so
+ * they can be played without the CPU decoding them again each time.
+ * This matters on the empeg, where decoding MP3 and Ogg takes much of
+ * the processor.  A filler thread decodes songs into [Cache] Path during
+ * idle time, ranked by pick_probability(), until [Cache] Size is used,
+ * and removes songs that have dropped out of the ranking.  Each song is
+ * stored as a 16 bit WAV file, so play_wav.c plays it straight out of
+ * the file mapping.
+ */
+
+#include "global.h"
+#include "database.h"   /* for save_song() */
+#include "decoder.h"    /* for song_functions[] */
+#include "stat.h"       /* for pick_probability(), quarantine_song() */
+#include "scheduler.h"  /* for scheduler_*() */
+#include "pcm_cache.h"
+
+/*
+ * Returns TRUE if the cache has somewhere to go.
+ */
+bool pcm_cache_enabled( void ) {
+    return config.cache_path != NULL && config.cache_path[0] != '\0' && config.cache_size > 0;
+}
+
+/*
+ * Returns the name of a song's cache file, which the caller frees.  The
+ * song's directories are flattened into the name so the cache is a
+ * single directory: '/' becomes "%2F", and '%' itself "%25" so that no
+ * two songs end up with the same name.  Expects a read lock on
+ * database_info.
+ */
+char *pcm_cache_filename( song_info_t *song ) {
+    char *filename, *out;
+    const char *c;
+
+    squash_malloc( filename, strlen(config.cache_path) + 1 + strlen(song->filename) * 3 + sizeof(".wav") );
+    out = filename + sprintf( filename, "%s/", config.cache_path );
+    for( c = song->filename; *c != '\0'; c++ ) {
+        if( *c == '/' ) {
+            memcpy( out, "%2F", 3 );
+            out += 3;
+        } else if( *c == '%' ) {
+            memcpy( out, "%25", 3 );
+            out += 3;
+        } else {
+            *out++ = *c;
+        }
+    }
+    strcpy( out, ".wav" );
+
+    return filename;
+}
+
+/*
+ * Returns TRUE if a song can be played from the cache.  Expects a read
+ * lock on database_info.
+ */
+bool pcm_cache_has( song_info_t *song ) {
+    int index = song - database_info.songs;
+    bool cached;
+
+    if( !pcm_cache_enabled() ) {
+        return FALSE;
+    }
+
+    squash_lock( pcm_cache_info.lock );
+    cached = index < pcm_cache_info.sizes_allocated && pcm_cache_info.sizes[ index ] > 0;
+    squash_unlock( pcm_cache_info.lock );
+
+    return cached;
+}
+
+/*
+ * Makes room to keep track of song_count songs.  Expects
+ * pcm_cache_info.lock.
+ */
+static void pcm_cache_grow( int song_count ) {
+    if( song_count > pcm_cache_info.sizes_allocated ) {
+        squash_realloc( pcm_cache_info.sizes, song_count * sizeof(off_t) );
+        memset( pcm_cache_info.sizes + pcm_cache_info.sizes_allocated, 0,
+                (song_count - pcm_cache_info.sizes_allocated) * sizeof(off_t) );
+        pcm_cache_info.sizes_allocated = song_count;
+    }
+}
+
+/*
+ * Adds or removes a song from pcm_cache_info.  A size of 0 removes it,
+ * and PCM_CACHE_UNCACHEABLE removes it for good.
+ */
+static void pcm_cache_set( int index, off_t size ) {
+    squash_lock( pcm_cache_info.lock );
+    if( pcm_cache_info.sizes[ index ] > 0 ) {
+        pcm_cache_info.used -= pcm_cache_info.sizes[ index ];
+        pcm_cache_info.count--;
+    }
+    pcm_cache_info.sizes[ index ] = size;
+    if( size > 0 ) {
+        pcm_cache_info.used += size;
+        pcm_cache_info.count++;
+    }
+    squash_unlock( pcm_cache_info.lock );
+}
+
+/* Sorts the songs most likely to be picked first */
+static int pcm_cache_rank_compare( const void *a, const void *b ) {
+    double probability_a = ((const pcm_cache_rank_t *)a)->probability;
+    double probability_b = ((const pcm_cache_rank_t *)b)->probability;
+
+    if( probability_a > probability_b ) {
+        return -1;
+    } else if( probability_a < probability_b ) {
+        return 1;
+    }
+    return 0;
+}
+
+static void pcm_cache_put_le( unsigned char *buffer, unsigned long value, int bytes ) {
+    int i;
+
+    for( i = 0; i < bytes; i++ ) {
+        buffer[i] = value & 0xff;
+        value >>= 8;
+    }
+}
+
+/*
+ * Fills in a WAV header for data_size bytes of sound.
+ */
+static void pcm_cache_header( unsigned char *header, sound_format_t sound_format, unsigned long data_size ) {
+    memcpy( header, "RIFF", 4 );
+    pcm_cache_put_le( header + 4, data_size + 36, 4 );
+    memcpy( header + 8, "WAVEfmt ", 8 );
+    pcm_cache_put_le( header + 16, 16, 4 );
+    pcm_cache_put_le( header + 20, 1, 2 ); /* PCM */
+    pcm_cache_put_le( header + 22, sound_format.channels, 2 );
+    pcm_cache_put_le( header + 24, sound_format.rate, 4 );
+    pcm_cache_put_le( header + 28, sound_format.rate * sound_format.channels * sound_format.bits / 8, 4 );
+    pcm_cache_put_le( header + 32, sound_format.channels * sound_format.bits / 8, 2 );
+    pcm_cache_put_le( header + 34, sound_format.bits, 2 );
+    memcpy( header + 36, "data", 4 );
+    pcm_cache_put_le( header + 40, data_size, 4 );
+}
+
+/*
+ * Decodes a song into its cache file.  The file is written under another
+ * name and renamed when it's finished, so the player never opens half of
+ * one.  Returns the size of the file, 0 if the disk is full (or squash
+ * is quitting), -1 if the
+ * song couldn't be decoded, or -2 if it can't be cached for some other
+ * reason (it's too big for a WAV file, or its name too long).
+ */
+static off_t pcm_cache_fill( enum song_type_e type, char *song_filename, char *cache_filename ) {
+    unsigned char header[ PCM_CACHE_HEADER_SIZE ];
+    sound_format_t sound_format;
+    frame_data_t frame;
+    void *decoder_data;
+    char *temp_filename;
+    FILE *cache_file;
+    long long data_size;
+    bool written, full;
+    int error;
+
+    if( (decoder_data = song_functions[ type ].open(song_filename, &sound_format)) == NULL ) {
+        return -1;
+    }
+    if( sound_format.bits != 16 || sound_format.byte_format != SOUND_LITTLE ) {
+        song_functions[ type ].close( decoder_data );
+        return -2;
+    }
+
+    squash_asprintf( temp_filename, "%s.tmp", cache_filename );
+    if( (cache_file = fopen(temp_filename, "wb")) == NULL ) {
+        full = errno == ENOSPC;
+        squash_log( "Can't write cache file %s: %s", temp_filename, strerror(errno) );
+        song_functions[ type ].close( decoder_data );
+        squash_free( temp_filename );
+        return full ? 0 : -2;
+    }
+
+    /* The sizes are filled in at the end */
+    pcm_cache_header( header, sound_format, 0 );
+    written = fwrite( header, PCM_CACHE_HEADER_SIZE, 1, cache_file ) == 1;
+    error = errno;
+    data_size = 0;
+    frame.pcm_size = 0;
+    while( written ) {
+        scheduler_pause();
+        if( squash_quitting() ) {
+            break;
+        }
+        frame = song_functions[ type ].decode_frame( decoder_data );
+        if( frame.pcm_size == 0 || frame.pcm_size <= -2 ) {
+            break;
+        } else if( frame.pcm_size == -1 ) {
+            continue;
+        }
+        written = fwrite( frame.pcm_data, frame.pcm_size, 1, cache_file ) == 1;
+        error = errno;
+        data_size += frame.pcm_size;
+
+        /* WAV files can't say how long anything bigger is */
+        if( written && data_size > 0x7fffffff - PCM_CACHE_HEADER_SIZE ) {
+            error = EFBIG;
+            written = FALSE;
+        }
+    }
+    song_functions[ type ].close( decoder_data );
+
+    /* It will be filled again next time */
+    if( squash_quitting() ) {
+        fclose( cache_file );
+        unlink( temp_filename );
+        squash_free( temp_filename );
+        return 0;
+    }
+
+    if( written && frame.pcm_size == 0 ) {
+        pcm_cache_header( header, sound_format, (unsigned long)data_size );
+        written = fseek( cache_file, 0, SEEK_SET ) == 0
+               && fwrite( header, PCM_CACHE_HEADER_SIZE, 1, cache_file ) == 1;
+        error = errno;
+    }
+    if( fclose(cache_file) != 0 && written ) {
+        written = FALSE;
+        error = errno;
+    }
+
+    if( frame.pcm_size <= -2 ) {
+        unlink( temp_filename );
+        squash_free( temp_filename );
+        return -1;
+    }
+    if( written && rename(temp_filename, cache_filename) != 0 ) {
+        written = FALSE;
+        error = errno;
+    }
+    if( !written ) {
+        /* Only a full disk is worth waiting out */
+        full = error == ENOSPC;
+        squash_log( "Can't write cache file %s: %s", temp_filename, strerror(error) );
+        unlink( temp_filename );
+        squash_free( temp_filename );
+        return full ? 0 : -2;
+    }
+    squash_free( temp_filename );
+
+    return PCM_CACHE_HEADER_SIZE + data_size;
+}
+
+/*
+ * Finds the songs left in the cache from the last time squash ran.  A
+ * cache file older than its song is from before the song was changed,
+ * and is removed, as are the half written files of a fill that was cut
+ * off.
+ */
+static void pcm_cache_load( void ) {
+    struct stat cache_stat, song_stat;
+    struct dirent *entry;
+    DIR *dir;
+    char *cache_filename, *song_filename;
+    size_t length;
+    int i;
+
+    if( (dir = opendir(config.cache_path)) != NULL ) {
+        while( (entry = readdir(dir)) != NULL ) {
+            length = strlen( entry->d_name );
+            if( length > 8 && strcmp(entry->d_name + length - 8, ".wav.tmp") == 0 ) {
+                squash_asprintf( cache_filename, "%s/%s", config.cache_path, entry->d_name );
+                unlink( cache_filename );
+                squash_free( cache_filename );
+            }
+        }
+        closedir( dir );
+    }
+
+    for( i = 0; !squash_quitting(); i++ ) {
+        squash_rlock( database_info.lock );
+        if( i >= database_info.song_count ) {
+            squash_runlock( database_info.lock );
+            break;
+        }
+        squash_lock( pcm_cache_info.lock );
+        pcm_cache_grow( database_info.song_count );
+        squash_unlock( pcm_cache_info.lock );
+        cache_filename = pcm_cache_filename( &database_info.songs[i] );
+        song_filename = build_fullfilename( &database_info.songs[i], BASENAME_SONG );
+        squash_runlock( database_info.lock );
+
+        if( stat(cache_filename, &cache_stat) == 0 ) {
+            if( stat(song_filename, &song_stat) == 0 && cache_stat.st_mtime >= song_stat.st_mtime
+                    && cache_stat.st_size > PCM_CACHE_HEADER_SIZE ) {
+                pcm_cache_set( i, cache_stat.st_size );
+            } else {
+                unlink( cache_filename );
+            }
+        }
+
+        squash_free( cache_filename );
+        squash_free( song_filename );
+    }
+}
+
+/*
+ * Thread start function.  Keeps the cache filled with the songs the
+ * picker is most likely to choose, one song at a time.
+ */
+void *pcm_cache_filler( void *input_data ) {
+    struct timespec wait_time = { 5, 000000000 };
+    pcm_cache_rank_t *ranks = NULL;
+    int rank_count, rank_count_allocated = 0;
+    bool *wanted = NULL;
+    song_info_t *song;
+    enum song_type_e type;
+    char *cache_filename, *song_filename;
+    long long budget, total;
+    double avg, std_dev;
+    off_t size;
+    int song_count, fill, i;
+
+    /* Only use spare cycles */
+    scheduler_idle_priority();
+
+    /* Ratings mean nothing until the statistics are loaded */
+    while( !squash_quitting() ) {
+        squash_rlock( database_info.lock );
+        if( database_info.stats_loaded ) {
+            squash_runlock( database_info.lock );
+            break;
+        }
+        squash_runlock( database_info.lock );
+        nanosleep( &wait_time, NULL );
+    }
+
+    mkdir( config.cache_path, 0755 );
+    pcm_cache_load();
+
+    budget = (long long)config.cache_size * 1024 * 1024;
+
+    while( !squash_quitting() ) {
+        /* Rank every song that decoding is worth saving for */
+        squash_rlock( database_info.lock );
+        song_count = database_info.song_count;
+        if( song_count == 0 ) {
+            squash_runlock( database_info.lock );
+            scheduler_idle();
+            continue;
+        }
+        avg = database_info.sum / song_count;
+        std_dev = sqrt( fabs(database_info.sqr_sum / song_count - avg*avg) );
+        squash_lock( pcm_cache_info.lock );
+        pcm_cache_grow( song_count );
+        rank_count = 0;
+        for( i = 0; i < song_count; i++ ) {
+            song = &database_info.songs[i];
+            type = song->song_type;
+            if( type == -1 ) {
+                type = get_song_type( song->basename[ BASENAME_SONG ], song->filename );
+            }
+            if( song->stat.quarantine_size != -1 || type == TYPE_UNKNOWN || type == TYPE_WAV
+                    || pcm_cache_info.sizes[i] == PCM_CACHE_UNCACHEABLE ) {
+                continue;
+            }
+
+            squash_ensure_alloc( rank_count, rank_count_allocated, ranks, sizeof(pcm_cache_rank_t), 256, *=2 );
+            ranks[ rank_count ].index = i;
+            ranks[ rank_count ].probability = pick_probability( get_rating(song->stat), avg, std_dev );
+            ranks[ rank_count ].cached = pcm_cache_info.sizes[i] > 0;
+            if( ranks[ rank_count ].cached ) {
+                ranks[ rank_count ].probability += PCM_CACHE_KEEP_BIAS;
+                ranks[ rank_count ].size = pcm_cache_info.sizes[i];
+            } else {
+                ranks[ rank_count ].size = PCM_CACHE_HEADER_SIZE + (long long)( PCM_CACHE_BYTES_PER_MS *
+                        (song->play_length != -1 ? song->play_length : PCM_CACHE_GUESSED_LENGTH) );
+            }
+            rank_count++;
+        }
+        squash_unlock( pcm_cache_info.lock );
+        squash_runlock( database_info.lock );
+
+        qsort( ranks, rank_count, sizeof(pcm_cache_rank_t), pcm_cache_rank_compare );
+
+        /* Want the most likely songs that fit, and fill the first one
+         * that isn't there yet */
+        squash_realloc( wanted, song_count * sizeof(bool) );
+        memset( wanted, 0, song_count * sizeof(bool) );
+        total = 0;
+        fill = -1;
+        for( i = 0; i < rank_count && total + ranks[i].size <= budget; i++ ) {
+            total += ranks[i].size;
+            wanted[ ranks[i].index ] = TRUE;
+            if( fill == -1 && !ranks[i].cached ) {
+                fill = ranks[i].index;
+            }
+        }
+
+        /* Make room by removing the songs no longer wanted.  Only this
+         * thread changes the sizes, so they can be read unlocked. */
+        for( i = 0; i < song_count; i++ ) {
+            if( pcm_cache_info.sizes[i] > 0 && !wanted[i] ) {
+                squash_rlock( database_info.lock );
+                cache_filename = pcm_cache_filename( &database_info.songs[i] );
+                squash_runlock( database_info.lock );
+                unlink( cache_filename );
+                squash_free( cache_filename );
+                pcm_cache_set( i, 0 );
+            }
+        }
+
+        if( fill == -1 ) {
+            /* The cache is as it should be, check again later */
+            scheduler_idle();
+            continue;
+        }
+
+        squash_rlock( database_info.lock );
+        song = &database_info.songs[ fill ];
+        type = song->song_type;
+        if( type == -1 ) {
+            type = get_song_type( song->basename[ BASENAME_SONG ], song->filename );
+        }
+        cache_filename = pcm_cache_filename( song );
+        song_filename = build_fullfilename( song, BASENAME_SONG );
+        squash_runlock( database_info.lock );
+
+        squash_log( "Caching: %s", song_filename );
+        size = pcm_cache_fill( type, song_filename, cache_filename );
+        squash_free( cache_filename );
+        squash_free( song_filename );
+        if( squash_quitting() ) {
+            break;
+        }
+
+        if( size > 0 ) {
+            pcm_cache_set( fill, size );
+        } else if( size == -1 ) {
+            squash_wlock( database_info.lock );
+            song = &database_info.songs[ fill ];
+            quarantine_song( song );
+            save_song( song );
+            squash_wunlock( database_info.lock );
+        } else if( size == -2 ) {
+            /* Leave it out, and go on to the next one */
+            pcm_cache_set( fill, PCM_CACHE_UNCACHEABLE );
+        } else {
+            /* Out of disk space, don't keep trying */
+            scheduler_idle();
+            continue;
+        }
+
+        /* Wait a little between songs so the player is not crowded out */
+        scheduler_next( JOB_CACHE );
+    }
+
+    return (void *)NULL;
+}
@@ -19,200 +19,358 @@
 /*
  * play_flac.h
  */
-
 #include "global.h"
 #include "database.h" /* for insert_meta_data */
+#include "pcm.h" /* for pcm_interleave_int32(), pcm_mix() */
 #include "play_flac.h"
 
-void flac_error_callback(const FLAC__FileDecoder *decoder, FLAC__StreamDecoderErrorStatus status, void *client_data) {
-    /* errors?  we don't need no stinking errors */
-    return;
-}
+/* A seek point that stands in for one not filled in yet */
+#define FLAC_SEEK_POINT_PLACEHOLDER 0xFFFFFFFFFFFFFFFFULL
+
+/* The largest a FLAC block can be */
+#define FLAC_MAX_BLOCKSIZE 65535
 
 /*
- * Open an flac file
- * sound_format will be modified and private state information
- * will be returned.
+ * Big and little endian numbers in the metadata
  */
-void *flac_open( char *filename, sound_format_t *sound_format ) {
-    flac_data_t *flac_data;
-    FLAC__FileDecoderState state;
+static FLAC__uint64 flac_get_be( const unsigned char *data, int bytes ) {
+    FLAC__uint64 value = 0;
+    int i;
 
-    /* Allocate space for data */
-    squash_malloc( flac_data, sizeof(flac_data_t) );
+    for( i = 0; i < bytes; i++ ) {
+        value = (value << 8) | data[i];
+    }
+    return value;
+}
 
-    if( (flac_data->decoder = FLAC__file_decoder_new()) == NULL ) {
-        squash_free( flac_data );
-        return (void *)NULL;
-        // squash_error( "Unable to create flac decoder" );
+static unsigned long flac_get_le32( const unsigned char *data ) {
+    return (unsigned long)data[0] | (unsigned long)data[1] << 8 | (unsigned long)data[2] << 16 | (unsigned long)data[3] << 24;
+}
+
+/*
+ * Adds the comments in a VORBIS_COMMENT block to a song's metadata.
+ */
+static void flac_read_comments( const unsigned char *block, long length, song_info_t *song ) {
+    const unsigned char *end = block + length;
+    unsigned long count, entry_length;
+    char *start, *equals, *key, *value;
+
+    /* Skip the vendor string */
+    if( end - block < 4 || (unsigned long)(end - block - 4) < flac_get_le32(block) ) {
+        return;
     }
+    block += 4 + flac_get_le32( block );
 
-    if( !FLAC__file_decoder_set_filename( flac_data->decoder, filename ) ) {
-        squash_free( flac_data );
-        return (void *)NULL;
-        // squash_error( "Unable to set filename in decoder" );
+    if( end - block < 4 ) {
+        return;
     }
+    count = flac_get_le32( block );
+    block += 4;
+
+    while( count-- > 0 && end - block >= 4 ) {
+        entry_length = flac_get_le32( block );
+        block += 4;
+        if( (unsigned long)(end - block) < entry_length ) {
+            return;
+        }
 
-    FLAC__file_decoder_set_metadata_callback( flac_data->decoder, flac_metadata_callback_decode_frame );
+        squash_malloc( start, entry_length + 1 );
+        memcpy( start, block, entry_length );
+        start[ entry_length ] = '\0';
+        block += entry_length;
 
-    FLAC__file_decoder_set_write_callback( flac_data->decoder, flac_write_callback_decode_frame );
+        equals = strchr( start, '=' );
+        if( equals != NULL ) {
+            key = copy_string( start, equals - 1 );
+            value = strdup( equals + 1 );
+            insert_meta_data( song, NULL, key, value );
+        }
+        squash_free( start );
+    }
+}
 
-    FLAC__file_decoder_set_error_callback( flac_data->decoder, flac_error_callback );
+/*
+ * Reads the metadata at the start of a FLAC file straight from the
+ * reader, rather than starting up a decoder: the STREAMINFO and any
+ * SEEKTABLE go into info, and if song isn't NULL the VORBIS_COMMENT goes
+ * into its metadata.  Returns FALSE if it isn't a FLAC file.  Free
+ * info->seek_points when done.
+ */
+bool flac_read_info( reader_t *reader, flac_info_t *info, song_info_t *song ) {
+    const unsigned char *block;
+    long length, available;
+    off_t offset;
+    int type, i;
+    bool last, have_stream_info;
+
+    info->seek_points = NULL;
+    info->seek_point_count = 0;
+
+    /* Skip any ID3v2 tag in front */
+    offset = 0;
+    block = (const unsigned char *)reader_map( reader, 0, 10, &available );
+    if( block != NULL && available >= 10 && memcmp( block, "ID3", 3 ) == 0 ) {
+        offset = 10 + ((block[6] & 0x7f) << 21 | (block[7] & 0x7f) << 14 | (block[8] & 0x7f) << 7 | (block[9] & 0x7f));
+        if( block[5] & 0x10 ) {
+            offset += 10; /* footer */
+        }
+    }
 
-    FLAC__file_decoder_set_client_data( flac_data->decoder, flac_data );
+    block = (const unsigned char *)reader_map( reader, offset, 4, &available );
+    if( block == NULL || available < 4 || memcmp( block, "fLaC", 4 ) != 0 ) {
+        return FALSE;
+    }
+    offset += 4;
 
-    state = FLAC__file_decoder_init( flac_data->decoder );
-    switch( state ) {
-        case FLAC__FILE_DECODER_OK:
-            /* no problem */
+    have_stream_info = FALSE;
+    do {
+        block = (const unsigned char *)reader_map( reader, offset, 4, &available );
+        if( block == NULL || available < 4 ) {
             break;
-        case FLAC__FILE_DECODER_END_OF_FILE:
-        case FLAC__FILE_DECODER_ERROR_OPENING_FILE:
-        case FLAC__FILE_DECODER_MEMORY_ALLOCATION_ERROR:
-        case FLAC__FILE_DECODER_SEEK_ERROR:
-        case FLAC__FILE_DECODER_SEEKABLE_STREAM_DECODER_ERROR:
-        case FLAC__FILE_DECODER_ALREADY_INITIALIZED:
-        case FLAC__FILE_DECODER_INVALID_CALLBACK:
-        case FLAC__FILE_DECODER_UNINITIALIZED:
-            squash_free( flac_data );
-            return (void *)NULL;
-            // squash_error( "Unable to initialize decoder: %s", FLAC__FileDecoderStateString[ state ] );
-            break;
-    }
+        }
+        last = (block[0] & 0x80) != 0;
+        type = block[0] & 0x7f;
+        length = (long)flac_get_be( block + 1, 3 );
+        offset += 4;
+
+        if( type == FLAC__METADATA_TYPE_STREAMINFO || type == FLAC__METADATA_TYPE_SEEKTABLE
+                || (type == FLAC__METADATA_TYPE_VORBIS_COMMENT && song != NULL) ) {
+            block = (const unsigned char *)reader_map( reader, offset, length, &available );
+            if( block == NULL || available < length ) {
+                /* Too big to look at, it can't be a STREAMINFO */
+                type = -1;
+            }
+        }
 
-    flac_data->buffer = NULL;
-    flac_data->buffer_size = 0;
-    flac_data->channels = -1;
-    flac_data->sample_rate = -1;
-    flac_data->duration = -1;
+        switch( type ) {
+            case FLAC__METADATA_TYPE_STREAMINFO:
+                if( length < 18 ) {
+                    break;
+                }
+                info->min_blocksize = (int)flac_get_be( block, 2 );
+                info->max_blocksize = (int)flac_get_be( block + 2, 2 );
+                info->sample_rate = (int)(flac_get_be( block + 10, 3 ) >> 4);
+                info->channels = ((block[12] >> 1) & 0x07) + 1;
+                info->bits_per_sample = (((block[12] & 0x01) << 4) | (block[13] >> 4)) + 1;
+                info->total_samples = flac_get_be( block + 13, 5 ) & 0xFFFFFFFFFULL;
+                have_stream_info = info->sample_rate > 0;
+                break;
+            case FLAC__METADATA_TYPE_SEEKTABLE:
+                squash_free( info->seek_points );
+                info->seek_point_count = 0;
+                squash_malloc( info->seek_points, (length / 18 + 1) * sizeof(FLAC__StreamMetadata_SeekPoint) );
+                for( i = 0; i < length / 18; i++ ) {
+                    FLAC__StreamMetadata_SeekPoint *point = &info->seek_points[ info->seek_point_count ];
+
+                    point->sample_number = flac_get_be( block + i * 18, 8 );
+                    point->stream_offset = flac_get_be( block + i * 18 + 8, 8 );
+                    point->frame_samples = (unsigned)flac_get_be( block + i * 18 + 16, 2 );
+                    if( point->sample_number != FLAC_SEEK_POINT_PLACEHOLDER ) {
+                        info->seek_point_count++;
+                    }
+                }
+                break;
+            case FLAC__METADATA_TYPE_VORBIS_COMMENT:
+                if( song != NULL ) {
+                    flac_read_comments( block, length, song );
+                }
+                break;
+            default:
+                break;
+        }
 
-    FLAC__file_decoder_process_until_end_of_metadata( flac_data->decoder );
+        offset += length;
+    } while( !last );
 
-    sound_format->rate = flac_data->sample_rate;
-    sound_format->channels = flac_data->channels;
-    sound_format->bits = 16;
-    sound_format->byte_format = SOUND_LITTLE;
+    info->audio_offset = offset;
+    if( info->max_blocksize <= 0 || info->max_blocksize > FLAC_MAX_BLOCKSIZE ) {
+        info->max_blocksize = FLAC_MAX_BLOCKSIZE;
+    }
 
-    /* Return data */
-    return (void *)flac_data;
+    if( !have_stream_info ) {
+        squash_free( info->seek_points );
+        return FALSE;
+    }
+    return TRUE;
 }
 
-FLAC__StreamDecoderWriteStatus flac_write_callback_load_meta( const FLAC__FileDecoder *decoder, const FLAC__Frame *frame, const FLAC__int32 * const buffer[], void *client_data ) {
-    /* do nothing ignore any decoded frames (when just loading meta data)*/
-    return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+void flac_error_callback( const FLAC__StreamDecoder *decoder, FLAC__StreamDecoderErrorStatus status, void *client_data ) {
+    /* errors?  we don't need no stinking errors */
+    return;
 }
 
-void flac_metadata_callback_load_meta( const FLAC__FileDecoder *decoder, const FLAC__StreamMetadata *metadata, void *client_data ) {
-    FLAC__StreamMetadata_VorbisComment comment = metadata->data.vorbis_comment;
-    int i;
-    char *start, *end, *key, *value;
+void flac_metadata_callback( const FLAC__StreamDecoder *decoder, const FLAC__StreamMetadata *metadata, void *client_data ) {
+    /* flac_read_info() has already been through it */
+    return;
+}
 
-    if( metadata->type != FLAC__METADATA_TYPE_VORBIS_COMMENT ) {
-        return;
+/*
+ * libFLAC reads the song through this, see reader.c
+ */
+FLAC__StreamDecoderReadStatus flac_read_callback( const FLAC__StreamDecoder *decoder, FLAC__byte buffer[], unsigned *bytes, void *client_data ) {
+    flac_data_t *flac_data = (flac_data_t *)client_data;
+    long length, want;
+
+    want = *bytes;
+    if( flac_data->end > 0 && want > flac_data->end - reader_tell( flac_data->reader ) ) {
+        want = flac_data->end - reader_tell( flac_data->reader );
     }
 
-    for(i = 0; i < comment.num_comments; i++ ) {
-        /* TODO: Make this faster, don't malloc start. */
-        int length = comment.comments[i].length;
-        squash_malloc( start, length+1 );
-        memcpy( start, comment.comments[i].entry, length );
-        start[ length ] = '\0';
-        end = strchr( start, '=' );
-        if( end == NULL ) {
-            continue;
-        }
-        key = copy_string( start, end - 1 );
-        value = strdup( end+1 );
-        insert_meta_data( client_data, NULL, key, value );
-        squash_free(start);
+    if( (length = reader_read( flac_data->reader, buffer, want )) < 0 ) {
+        *bytes = 0;
+        return FLAC__STREAM_DECODER_READ_STATUS_ABORT;
     }
+    *bytes = length;
+
+    return length == 0 ? FLAC__STREAM_DECODER_READ_STATUS_END_OF_STREAM : FLAC__STREAM_DECODER_READ_STATUS_CONTINUE;
 }
 
-FLAC__StreamDecoderWriteStatus flac_write_callback_decode_frame( const FLAC__FileDecoder *decoder, const FLAC__Frame *frame, const FLAC__int32 * const buffer[], void *client_data ) {
+FLAC__StreamDecoderWriteStatus flac_write_callback( const FLAC__StreamDecoder *decoder, const FLAC__Frame *frame, const FLAC__int32 * const buffer[], void *client_data ) {
     flac_data_t *flac_data = (flac_data_t *)client_data;
-    int i, j, k;
+    const FLAC__int32 *planes[ PCM_MIX_MAX_CHANNELS ];
+    FLAC__uint64 first;
+    unsigned skip;
+    int c;
 
     switch( frame->header.number_type ) {
         case FLAC__FRAME_NUMBER_TYPE_FRAME_NUMBER:
-            squash_error("I don't know how to count in frames");
+            /* Only fixed size blocks are counted this way */
+            first = (FLAC__uint64)frame->header.number.frame_number * frame->header.blocksize;
             break;
         case FLAC__FRAME_NUMBER_TYPE_SAMPLE_NUMBER:
-            flac_data->position = frame->header.number.sample_number * 1000 / flac_data->sample_rate;
+        default:
+            first = frame->header.number.sample_number;
             break;
     }
 
-    if( flac_data->buffer == NULL || frame->header.blocksize * flac_data->channels * 2 != flac_data->buffer_size ) {
-        flac_data->buffer_size = frame->header.blocksize * flac_data->channels * 2;
+    /* After a seek, leave out whatever comes before where it was to */
+    if( first + frame->header.blocksize <= flac_data->skip_to ) {
+        flac_data->pcm_size = 0;
+        return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+    }
+    skip = 0;
+    if( flac_data->skip_to > first ) {
+        skip = (unsigned)(flac_data->skip_to - first);
+    }
+    flac_data->skip_to = 0;
+
+    flac_data->sample = first + skip;
+    flac_data->position = (long)(flac_data->sample * 1000 / flac_data->info.sample_rate);
+
+    /* The buffer is kept from frame to frame, it only grows if the
+     * STREAMINFO got the block size wrong */
+    flac_data->pcm_size = (frame->header.blocksize - skip) * 4;
+    if( flac_data->pcm_size > flac_data->buffer_size ) {
+        flac_data->buffer_size = flac_data->pcm_size;
         squash_realloc( flac_data->buffer, flac_data->buffer_size );
     }
 
-    k = 0;
-    for( j = 0; j < frame->header.blocksize; j++ ) {
-        for( i = 0; i < flac_data->channels; i++ ) {
-            int sample;
-            sample = buffer[i][j];
-            flac_data->buffer[k++] = sample && 0xFF;
-            flac_data->buffer[k++] = sample >> 8;
-        }
+    /* Bring any sample size down to 16 bits, mix to stereo, apply the gain and interleave */
+    for( c = 0; c < flac_data->mix.channels; c++ ) {
+        planes[c] = buffer[c] + skip;
     }
+    pcm_interleave_int32( flac_data->buffer, (const int *const *)planes, &flac_data->mix,
+            frame->header.blocksize - skip, frame->header.bits_per_sample, flac_data->gain );
+
     return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
 }
 
-void flac_metadata_callback_decode_frame( const FLAC__FileDecoder *decoder, const FLAC__StreamMetadata *metadata, void *client_data ) {
-    flac_data_t *flac_data = (flac_data_t *)client_data;
+/*
+ * Starts up the stream decoder, which is left until the song is actually
+ * decoded (flac_open() is also used just to find a song's length).
+ * Returns FALSE if it can't be.
+ */
+static bool flac_start_decoder( flac_data_t *flac_data ) {
+    FLAC__StreamDecoder *decoder;
 
-    if( metadata->type != FLAC__METADATA_TYPE_STREAMINFO ) {
-        return;
+    if( (decoder = FLAC__stream_decoder_new()) == NULL ) {
+        return FALSE;
+    }
+
+    FLAC__stream_decoder_set_read_callback( decoder, flac_read_callback );
+    FLAC__stream_decoder_set_write_callback( decoder, flac_write_callback );
+    FLAC__stream_decoder_set_metadata_callback( decoder, flac_metadata_callback );
+    FLAC__stream_decoder_set_error_callback( decoder, flac_error_callback );
+    FLAC__stream_decoder_set_client_data( decoder, flac_data );
+
+    if( FLAC__stream_decoder_init( decoder ) != FLAC__STREAM_DECODER_SEARCH_FOR_METADATA ) {
+        FLAC__stream_decoder_delete( decoder );
+        return FALSE;
     }
 
-    /* need to only get channels, sample rate and duration */
-    flac_data->channels = metadata->data.stream_info.channels;
-    flac_data->sample_rate = metadata->data.stream_info.sample_rate;
-    flac_data->duration = metadata->data.stream_info.total_samples * 1000 / flac_data->sample_rate;
+    /* libFLAC wants the STREAMINFO too, for blocks that refer to it */
+    reader_seek( flac_data->reader, 0, SEEK_SET );
+    if( !FLAC__stream_decoder_process_until_end_of_metadata( decoder ) ) {
+        FLAC__stream_decoder_finish( decoder );
+        FLAC__stream_decoder_delete( decoder );
+        return FALSE;
+    }
+
+    flac_data->decoder = decoder;
+    return TRUE;
 }
 
-void flac_load_meta( void *data, char *filename ) {
-    FLAC__FileDecoder *decoder;
-    FLAC__FileDecoderState state;
+/*
+ * Open an flac file
+ * sound_format will be modified and private state information
+ * will be returned.
+ */
+void *flac_open( char *filename, sound_format_t *sound_format ) {
+    flac_data_t *flac_data;
+
+    /* Allocate space for data */
+    squash_malloc( flac_data, sizeof(flac_data_t) );
 
-    if( (decoder = FLAC__file_decoder_new()) == NULL ) {
-        squash_error( "Unable to create flac decoder" );
+    if( (flac_data->reader = reader_open(filename)) == NULL ) {
+        squash_free( flac_data );
+        return (void *)NULL;
+        // squash_error( "Unable to open file" );
     }
 
-    if( !FLAC__file_decoder_set_filename( decoder, filename ) ) {
-        squash_error( "Unable to set filename in decoder" );
+    if( !flac_read_info( flac_data->reader, &flac_data->info, NULL ) ) {
+        reader_close( flac_data->reader );
+        squash_free( flac_data );
+        return (void *)NULL;
     }
 
-    FLAC__file_decoder_set_metadata_callback( decoder, flac_metadata_callback_load_meta );
-    FLAC__file_decoder_set_metadata_respond_all( decoder );
+    flac_data->decoder = NULL;
+    flac_data->buffer_size = flac_data->info.max_blocksize * 4;
+    squash_malloc( flac_data->buffer, flac_data->buffer_size );
+    flac_data->pcm_size = 0;
+    flac_data->sample = 0;
+    flac_data->skip_to = 0;
+    flac_data->end = 0;
+    flac_data->position = 0;
+    flac_data->gain = pcm_gain( 0.0, 0.0 );
+
+    if( !pcm_mix( &flac_data->mix, flac_data->info.channels, PCM_LAYOUT_WAVE ) ) {
+        flac_close( flac_data );
+        return (void *)NULL;
+    }
 
-    FLAC__file_decoder_set_write_callback( decoder, flac_write_callback_load_meta );
+    sound_format->rate = flac_data->info.sample_rate;
+    sound_format->channels = 2; /* everything is mixed to stereo */
+    sound_format->bits = 16;
+    sound_format->byte_format = SOUND_LITTLE;
 
-    FLAC__file_decoder_set_error_callback( decoder, flac_error_callback );
+    /* Return data */
+    return (void *)flac_data;
+}
 
-    FLAC__file_decoder_set_client_data( decoder, data );
+void flac_load_meta( void *data, char *filename ) {
+    reader_t *reader;
+    flac_info_t info;
 
-    state = FLAC__file_decoder_init( decoder );
-    switch( state ) {
-        case FLAC__FILE_DECODER_OK:
-            /* no problem */
-            break;
-        case FLAC__FILE_DECODER_END_OF_FILE:
-        case FLAC__FILE_DECODER_ERROR_OPENING_FILE:
-        case FLAC__FILE_DECODER_MEMORY_ALLOCATION_ERROR:
-        case FLAC__FILE_DECODER_SEEK_ERROR:
-        case FLAC__FILE_DECODER_SEEKABLE_STREAM_DECODER_ERROR:
-        case FLAC__FILE_DECODER_ALREADY_INITIALIZED:
-        case FLAC__FILE_DECODER_INVALID_CALLBACK:
-        case FLAC__FILE_DECODER_UNINITIALIZED:
-            squash_error( "Unable to initialize decoder: %s", FLAC__FileDecoderStateString[ state ] );
-            break;
+    if( (reader = reader_open(filename)) == NULL ) {
+        squash_log( "Unable to open file %s", filename );
+        return;
     }
 
-    FLAC__file_decoder_process_until_end_of_metadata( decoder );
+    if( flac_read_info( reader, &info, (song_info_t *)data ) ) {
+        squash_free( info.seek_points );
+    }
 
-    FLAC__file_decoder_finish( decoder );
-    FLAC__file_decoder_delete( decoder );
+    reader_close( reader );
 
     return;
 }
@@ -223,32 +381,41 @@ void flac_load_meta( void *data, char *filename ) {
 frame_data_t flac_decode_frame( void *data ) {
     flac_data_t *flac_data = (flac_data_t *)data;
     frame_data_t frame_data;
-    FLAC__FileDecoderState state;
+    FLAC__StreamDecoderState state;
 
-    FLAC__file_decoder_process_single( flac_data->decoder );
+    frame_data.pcm_data = NULL;
     frame_data.position = flac_data->position;
 
-    state = FLAC__file_decoder_get_state( flac_data->decoder );
-    switch( state ) {
-        case FLAC__FILE_DECODER_OK:
-            frame_data.pcm_data = flac_data->buffer;
-            frame_data.pcm_size = flac_data->buffer_size;
-            break;
-        case FLAC__FILE_DECODER_END_OF_FILE:
-            frame_data.pcm_data = NULL;
+    if( flac_data->decoder == NULL && !flac_start_decoder( flac_data ) ) {
+        frame_data.pcm_size = -2;
+        return frame_data;
+    }
+
+    /* Keep going until a block comes out (metadata and blocks skipped
+     * after a seek don't count) */
+    flac_data->pcm_size = 0;
+    while( flac_data->pcm_size == 0 ) {
+        if( !FLAC__stream_decoder_process_single( flac_data->decoder ) ) {
+            frame_data.pcm_size = -2;
+            return frame_data;
+        }
+
+        state = FLAC__stream_decoder_get_state( flac_data->decoder );
+        if( state == FLAC__STREAM_DECODER_END_OF_STREAM ) {
             frame_data.pcm_size = 0;
-            break;
-        case FLAC__FILE_DECODER_ERROR_OPENING_FILE:
-        case FLAC__FILE_DECODER_MEMORY_ALLOCATION_ERROR:
-        case FLAC__FILE_DECODER_SEEK_ERROR:
-        case FLAC__FILE_DECODER_SEEKABLE_STREAM_DECODER_ERROR:
-        case FLAC__FILE_DECODER_ALREADY_INITIALIZED:
-        case FLAC__FILE_DECODER_INVALID_CALLBACK:
-        case FLAC__FILE_DECODER_UNINITIALIZED:
-            squash_error("Error while decoding: %s", FLAC__FileDecoderStateString[ state ] );
-            break;
+            return frame_data;
+        } else if( state != FLAC__STREAM_DECODER_SEARCH_FOR_METADATA && state != FLAC__STREAM_DECODER_READ_METADATA
+                && state != FLAC__STREAM_DECODER_SEARCH_FOR_FRAME_SYNC && state != FLAC__STREAM_DECODER_READ_FRAME ) {
+            squash_log( "Error while decoding: %s", FLAC__StreamDecoderStateString[ state ] );
+            frame_data.pcm_size = -2;
+            return frame_data;
+        }
     }
 
+    frame_data.pcm_data = flac_data->buffer;
+    frame_data.pcm_size = flac_data->pcm_size;
+    frame_data.position = flac_data->position;
+
     return frame_data;
 }
 
@@ -257,17 +424,52 @@ frame_data_t flac_decode_frame( void *data ) {
  */
 long flac_calc_duration( void *data ) {
     flac_data_t *flac_data = (flac_data_t *)data;
-    return flac_data->duration;
+
+    if( flac_data->info.total_samples == 0 ) {
+        return -1;
+    }
+    return (long)(flac_data->info.total_samples * 1000 / flac_data->info.sample_rate);
 }
 
 /*
  * Seek to the seek_time position (in milliseconds) in
- * the opened song
+ * the opened song.  Decoding starts again from the last seek point before
+ * it, or where it ought to be if there is no SEEKTABLE, and the write
+ * callback drops anything before seek_time.
  */
 void flac_seek( void *data, long seek_time, long duration ) {
     flac_data_t *flac_data = (flac_data_t *)data;
+    flac_info_t *info = &flac_data->info;
+    FLAC__uint64 target;
+    off_t offset;
+    double bytes_per_sample;
+    int i;
+
+    if( flac_data->decoder == NULL && !flac_start_decoder( flac_data ) ) {
+        return;
+    }
+
+    target = (FLAC__uint64)seek_time * info->sample_rate / 1000;
+    offset = info->audio_offset;
+
+    if( target > 0 && info->seek_point_count > 0 ) {
+        for( i = 0; i < info->seek_point_count && info->seek_points[i].sample_number <= target; i++ ) {
+            offset = info->audio_offset + info->seek_points[i].stream_offset;
+        }
+    } else if( target > 0 && info->total_samples > 0 ) {
+        /* Guess, erring a couple of blocks early */
+        bytes_per_sample = (double)(flac_data->reader->size - info->audio_offset) / info->total_samples;
+        offset += (off_t)(bytes_per_sample * target) - (off_t)(bytes_per_sample * info->max_blocksize * 2);
+        if( offset < info->audio_offset ) {
+            offset = info->audio_offset;
+        }
+    }
+
+    FLAC__stream_decoder_flush( flac_data->decoder );
+    reader_seek( flac_data->reader, offset, SEEK_SET );
+    flac_data->skip_to = target;
+    flac_data->position = seek_time;
 
-    FLAC__file_decoder_seek_absolute( flac_data->decoder, seek_time * (flac_data->sample_rate / 1000) );
     return;
 }
 
@@ -277,14 +479,539 @@ void flac_seek( void *data, long seek_time, long duration ) {
 void flac_close( void *data ) {
     flac_data_t *flac_data = (flac_data_t *)data;
 
-    FLAC__file_decoder_finish( flac_data->decoder );
-
-    FLAC__file_decoder_delete( flac_data->decoder );
+    if( flac_data->decoder != NULL ) {
+        FLAC__stream_decoder_finish( flac_data->decoder );
+        FLAC__stream_decoder_delete( flac_data->decoder );
+    }
+    reader_close( flac_data->reader );
 
     /* Free allocated storage */
+    squash_free( flac_data->info.seek_points );
     squash_free( flac_data->buffer );
     flac_data->buffer_size = 0;
     squash_free( flac_data );
 
     return;
 }
+
+/*
+ * Set the gain applied to the decoded sound
+ */
+void flac_set_gain( void *data, pcm_gain_t gain ) {
+    flac_data_t *flac_data = (flac_data_t *)data;
+
+    flac_data->gain = gain;
+}
+
+/*
+ * Decoding one song on several threads.  FLAC frames don't depend on
+ * each other, so the song is cut into chunks of whole frames, at its
+ * seek points if it has a SEEKTABLE or else wherever a frame header turns
+ * up near evenly spaced places.  Each thread has its own decoder, and
+ * takes the next chunk nobody has started on; the chunks are handed back
+ * in order.  This is for the analyzer and offline renders, which can use
+ * the whole machine on one long song; playing in real time doesn't need
+ * it.
+ */
+
+/* How far past a guessed place to look for a frame header */
+#define FLAC_SCAN_BYTES 65536
+
+/*
+ * Checks for a frame header at data, setting first_sample to where the
+ * frame starts.  Returns the length of the header, or 0 if there isn't
+ * one (the CRC-8 has to match).
+ */
+static int flac_frame_header( const unsigned char *data, long length, const flac_info_t *info, FLAC__uint64 *first_sample ) {
+    FLAC__uint64 number;
+    int extra, header_length, i, bit;
+    unsigned char crc;
+
+    if( length < 16 || data[0] != 0xff || (data[1] & 0xfe) != 0xf8 ) {
+        return 0;
+    }
+    if( (data[2] >> 4) == 0 || (data[2] & 0x0f) == 0x0f || (data[3] >> 4) > 10
+            || ((data[3] >> 1) & 0x07) == 3 || ((data[3] >> 1) & 0x07) == 7 || (data[3] & 0x01) ) {
+        return 0;
+    }
+
+    /* The frame or sample number, UTF-8 style */
+    if( !(data[4] & 0x80) ) {
+        number = data[4];
+        extra = 0;
+    } else if( (data[4] & 0xe0) == 0xc0 ) {
+        number = data[4] & 0x1f;
+        extra = 1;
+    } else if( (data[4] & 0xf0) == 0xe0 ) {
+        number = data[4] & 0x0f;
+        extra = 2;
+    } else if( (data[4] & 0xf8) == 0xf0 ) {
+        number = data[4] & 0x07;
+        extra = 3;
+    } else if( (data[4] & 0xfc) == 0xf8 ) {
+        number = data[4] & 0x03;
+        extra = 4;
+    } else if( (data[4] & 0xfe) == 0xfc ) {
+        number = data[4] & 0x01;
+        extra = 5;
+    } else if( data[4] == 0xfe ) {
+        number = 0;
+        extra = 6;
+    } else {
+        return 0;
+    }
+    for( i = 0; i < extra; i++ ) {
+        if( (data[5 + i] & 0xc0) != 0x80 ) {
+            return 0;
+        }
+        number = (number << 6) | (data[5 + i] & 0x3f);
+    }
+
+    header_length = 5 + extra;
+    if( (data[2] >> 4) == 6 ) {
+        header_length += 1;
+    } else if( (data[2] >> 4) == 7 ) {
+        header_length += 2;
+    }
+    if( (data[2] & 0x0f) == 12 ) {
+        header_length += 1;
+    } else if( (data[2] & 0x0f) == 13 || (data[2] & 0x0f) == 14 ) {
+        header_length += 2;
+    }
+
+    crc = 0;
+    for( i = 0; i < header_length; i++ ) {
+        crc ^= data[i];
+        for( bit = 0; bit < 8; bit++ ) {
+            crc = (crc & 0x80) ? (unsigned char)((crc << 1) ^ 0x07) : (unsigned char)(crc << 1);
+        }
+    }
+    if( crc != data[ header_length ] ) {
+        return 0;
+    }
+
+    /* Fixed size blocks are counted in frames */
+    *first_sample = (data[1] & 0x01) ? number : number * info->min_blocksize;
+
+    return header_length + 1;
+}
+
+/*
+ * Cuts the song into chunks of about FLAC_CHUNK_SAMPLES.
+ */
+static void flac_split( flac_parallel_t *parallel, reader_t *reader ) {
+    flac_info_t *info = &parallel->info;
+    const unsigned char *data;
+    FLAC__uint64 sample;
+    flac_chunk_t *last;
+    off_t offset;
+    long available, i;
+    int count, k;
+
+    count = 1;
+    if( info->total_samples > 0 ) {
+        count = (int)((info->total_samples + FLAC_CHUNK_SAMPLES - 1) / FLAC_CHUNK_SAMPLES);
+    }
+    if( count < info->seek_point_count + 1 ) {
+        squash_malloc( parallel->chunks, (info->seek_point_count + 1) * sizeof(flac_chunk_t) );
+    } else {
+        squash_malloc( parallel->chunks, count * sizeof(flac_chunk_t) );
+    }
+
+    last = &parallel->chunks[0];
+    last->start = info->audio_offset;
+    last->first_sample = 0;
+    parallel->chunk_count = 1;
+
+    if( info->seek_point_count > 0 ) {
+        for( k = 0; k < info->seek_point_count; k++ ) {
+            offset = info->audio_offset + info->seek_points[k].stream_offset;
+            sample = info->seek_points[k].sample_number;
+            if( sample >= last->first_sample + FLAC_CHUNK_SAMPLES && offset > last->start && offset < reader->size ) {
+                last = &parallel->chunks[ parallel->chunk_count++ ];
+                last->start = offset;
+                last->first_sample = sample;
+            }
+        }
+    } else {
+        for( k = 1; k < count; k++ ) {
+            offset = info->audio_offset + (reader->size - info->audio_offset) / count * k;
+            if( offset <= last->start ) {
+                continue;
+            }
+            data = (const unsigned char *)reader_map( reader, offset, FLAC_SCAN_BYTES, &available );
+            for( i = 0; data != NULL && i < available; i++ ) {
+                if( data[i] == 0xff && flac_frame_header( data + i, available - i, info, &sample ) > 0 ) {
+                    if( sample > last->first_sample && (info->total_samples == 0 || sample < info->total_samples) ) {
+                        last = &parallel->chunks[ parallel->chunk_count++ ];
+                        last->start = offset + i;
+                        last->first_sample = sample;
+                    }
+                    break;
+                }
+            }
+        }
+    }
+
+    for( k = 0; k < parallel->chunk_count; k++ ) {
+        parallel->chunks[k].end = k + 1 < parallel->chunk_count ? parallel->chunks[k + 1].start : reader->size;
+        parallel->chunks[k].pcm_data = NULL;
+        parallel->chunks[k].pcm_size = 0;
+        parallel->chunks[k].done = FALSE;
+    }
+}
+
+/*
+ * Decodes the frames from start up to end into a new pcm_data.  Returns
+ * its size, or -2 if it couldn't be decoded.
+ */
+static long flac_decode_chunk( flac_data_t *worker, off_t start, off_t end, char **pcm_data, FLAC__uint64 *first_sample ) {
+    FLAC__StreamDecoderState state;
+    long size, allocated;
+    bool have_first;
+
+    FLAC__stream_decoder_flush( worker->decoder );
+    reader_seek( worker->reader, start, SEEK_SET );
+    worker->end = end;
+
+    allocated = FLAC_CHUNK_SAMPLES * 4 + worker->buffer_size;
+    squash_malloc( *pcm_data, allocated );
+    size = 0;
+    have_first = FALSE;
+
+    while( 1 ) {
+        worker->pcm_size = 0;
+        if( !FLAC__stream_decoder_process_single( worker->decoder ) ) {
+            break;
+        }
+
+        if( worker->pcm_size > 0 ) {
+            if( !have_first ) {
+                *first_sample = worker->sample;
+                have_first = TRUE;
+            }
+            if( size + worker->pcm_size > allocated ) {
+                allocated = 2 * (size + worker->pcm_size);
+                squash_realloc( *pcm_data, allocated );
+            }
+            memcpy( *pcm_data + size, worker->buffer, worker->pcm_size );
+            size += worker->pcm_size;
+        }
+
+        state = FLAC__stream_decoder_get_state( worker->decoder );
+        if( state == FLAC__STREAM_DECODER_END_OF_STREAM ) {
+            return size;
+        } else if( state != FLAC__STREAM_DECODER_SEARCH_FOR_METADATA && state != FLAC__STREAM_DECODER_READ_METADATA
+                && state != FLAC__STREAM_DECODER_SEARCH_FOR_FRAME_SYNC && state != FLAC__STREAM_DECODER_READ_FRAME ) {
+            break;
+        }
+    }
+
+    squash_free( *pcm_data );
+    return -2;
+}
+
+/*
+ * One of the threads decoding a song, input_data is its flac_parallel_t.
+ */
+static void *flac_parallel_worker( void *input_data ) {
+    flac_parallel_t *parallel = (flac_parallel_t *)input_data;
+    flac_data_t worker;
+    flac_chunk_t *chunk;
+    FLAC__uint64 first_sample;
+    char *pcm_data;
+    long pcm_size;
+    int generation;
+    bool started;
+
+    worker.decoder = NULL;
+    worker.reader = reader_open( parallel->filename );
+    worker.info = parallel->info;
+    worker.buffer_size = worker.info.max_blocksize * 4;
+    squash_malloc( worker.buffer, worker.buffer_size );
+    worker.pcm_size = 0;
+    worker.sample = 0;
+    worker.skip_to = 0;
+    worker.end = 0;
+    worker.position = 0;
+    worker.mix = parallel->mix;
+    started = worker.reader != NULL && flac_start_decoder( &worker );
+
+    squash_lock( parallel->lock );
+    while( !parallel->quit ) {
+        if( parallel->next_chunk >= parallel->chunk_count
+                || parallel->next_chunk >= parallel->next_out + parallel->window ) {
+            squash_wait( parallel->changed, parallel->lock );
+            continue;
+        }
+        chunk = &parallel->chunks[ parallel->next_chunk++ ];
+        generation = parallel->generation;
+        worker.gain = parallel->gain;
+        first_sample = chunk->first_sample;
+        squash_unlock( parallel->lock );
+
+        pcm_data = NULL;
+        pcm_size = -2;
+        if( started ) {
+            pcm_size = flac_decode_chunk( &worker, chunk->start, chunk->end, &pcm_data, &first_sample );
+        }
+
+        squash_lock( parallel->lock );
+        if( generation != parallel->generation ) {
+            /* There's been a seek since */
+            squash_free( pcm_data );
+            continue;
+        }
+        chunk->pcm_data = pcm_data;
+        chunk->pcm_size = pcm_size;
+        chunk->first_sample = first_sample;
+        chunk->done = TRUE;
+        squash_broadcast( parallel->changed );
+    }
+    squash_unlock( parallel->lock );
+
+    if( worker.decoder != NULL ) {
+        FLAC__stream_decoder_finish( worker.decoder );
+        FLAC__stream_decoder_delete( worker.decoder );
+    }
+    if( worker.reader != NULL ) {
+        reader_close( worker.reader );
+    }
+    squash_free( worker.buffer );
+
+    return (void *)NULL;
+}
+
+/*
+ * Open an flac file to be decoded on [Analyzer] Decode_Threads threads.
+ * Nothing is decoded until the first flac_parallel_decode_frame().
+ */
+void *flac_parallel_open( char *filename, sound_format_t *sound_format ) {
+    flac_parallel_t *parallel;
+    reader_t *reader;
+
+    if( (reader = reader_open(filename)) == NULL ) {
+        return (void *)NULL;
+    }
+
+    squash_malloc( parallel, sizeof(flac_parallel_t) );
+
+    if( !flac_read_info( reader, &parallel->info, NULL ) ) {
+        reader_close( reader );
+        squash_free( parallel );
+        return (void *)NULL;
+    }
+
+    if( !pcm_mix( &parallel->mix, parallel->info.channels, PCM_LAYOUT_WAVE ) ) {
+        squash_free( parallel->info.seek_points );
+        reader_close( reader );
+        squash_free( parallel );
+        return (void *)NULL;
+    }
+
+    flac_split( parallel, reader );
+    reader_close( reader );
+
+    parallel->filename = strdup( filename );
+    parallel->next_chunk = 0;
+    parallel->next_out = 0;
+    parallel->window = 0;
+    parallel->generation = 0;
+    parallel->out_data = NULL;
+    parallel->out_size = 0;
+    parallel->out_used = 0;
+    parallel->out_sample = 0;
+    parallel->skip_to = 0;
+    parallel->position = 0;
+    parallel->gain = pcm_gain( 0.0, 0.0 );
+    parallel->thread_count = 0;
+    parallel->quit = FALSE;
+    pthread_mutex_init( &parallel->lock, NULL );
+    pthread_cond_init( &parallel->changed, NULL );
+
+    sound_format->rate = parallel->info.sample_rate;
+    sound_format->channels = 2; /* everything is mixed to stereo */
+    sound_format->bits = 16;
+    sound_format->byte_format = SOUND_LITTLE;
+
+    return (void *)parallel;
+}
+
+/*
+ * Hand back the next block's worth of the song, waiting for its chunk to
+ * be decoded.  Blocks are the same size as flac_decode_frame()'s, so the
+ * player can cut songs just as finely.
+ */
+frame_data_t flac_parallel_decode_frame( void *data ) {
+    flac_parallel_t *parallel = (flac_parallel_t *)data;
+    frame_data_t frame_data;
+    flac_chunk_t *chunk;
+    long skip;
+
+    squash_lock( parallel->lock );
+
+    if( parallel->thread_count == 0 ) {
+        while( parallel->thread_count < config.analyzer_decode_threads && parallel->thread_count < FLAC_MAX_THREADS ) {
+            if( pthread_create( &parallel->threads[ parallel->thread_count ], NULL, flac_parallel_worker, (void *)parallel ) ) {
+                break;
+            }
+            parallel->thread_count++;
+        }
+        parallel->window = parallel->thread_count * FLAC_CHUNKS_AHEAD;
+    }
+
+    frame_data.pcm_data = NULL;
+    frame_data.position = parallel->position;
+
+    if( parallel->out_used >= parallel->out_size ) {
+        squash_free( parallel->out_data );
+        parallel->out_size = 0;
+        parallel->out_used = 0;
+
+        if( parallel->thread_count == 0 ) {
+            squash_unlock( parallel->lock );
+            frame_data.pcm_size = -2;
+            return frame_data;
+        }
+        if( parallel->next_out >= parallel->chunk_count ) {
+            squash_unlock( parallel->lock );
+            frame_data.pcm_size = 0;
+            return frame_data;
+        }
+
+        chunk = &parallel->chunks[ parallel->next_out ];
+        while( !chunk->done ) {
+            squash_wait( parallel->changed, parallel->lock );
+        }
+        parallel->next_out++;
+        squash_broadcast( parallel->changed );
+
+        if( chunk->pcm_size <= -2 ) {
+            squash_unlock( parallel->lock );
+            frame_data.pcm_size = -2;
+            return frame_data;
+        }
+        parallel->out_data = chunk->pcm_data;
+        parallel->out_size = chunk->pcm_size;
+        parallel->out_sample = chunk->first_sample;
+        chunk->pcm_data = NULL;
+
+        /* The chunk a seek lands in starts a little early */
+        if( parallel->skip_to > parallel->out_sample ) {
+            skip = (long)(parallel->skip_to - parallel->out_sample) * 4;
+            if( skip > parallel->out_size ) {
+                skip = parallel->out_size;
+            }
+            parallel->out_used = skip;
+            parallel->out_sample += skip / 4;
+        }
+
+        if( parallel->out_used >= parallel->out_size ) {
+            /* Nothing left in this one, but it isn't the end */
+            squash_unlock( parallel->lock );
+            frame_data.pcm_size = -1;
+            return frame_data;
+        }
+        parallel->skip_to = 0;
+    }
+
+    frame_data.pcm_data = parallel->out_data + parallel->out_used;
+    frame_data.pcm_size = parallel->out_size - parallel->out_used;
+    if( frame_data.pcm_size > parallel->info.max_blocksize * 4 ) {
+        frame_data.pcm_size = parallel->info.max_blocksize * 4;
+    }
+    parallel->position = (long)(parallel->out_sample * 1000 / parallel->info.sample_rate);
+    frame_data.position = parallel->position;
+    parallel->out_used += frame_data.pcm_size;
+    parallel->out_sample += frame_data.pcm_size / 4;
+
+    squash_unlock( parallel->lock );
+
+    return frame_data;
+}
+
+/*
+ * Return the number of milliseconds in the opened song
+ */
+long flac_parallel_calc_duration( void *data ) {
+    flac_parallel_t *parallel = (flac_parallel_t *)data;
+
+    if( parallel->info.total_samples == 0 ) {
+        return -1;
+    }
+    return (long)(parallel->info.total_samples * 1000 / parallel->info.sample_rate);
+}
+
+/*
+ * Seek to the seek_time position (in milliseconds), starting again from
+ * the chunk it's in.  Anything already decoded is thrown away.
+ */
+void flac_parallel_seek( void *data, long seek_time, long duration ) {
+    flac_parallel_t *parallel = (flac_parallel_t *)data;
+    FLAC__uint64 target;
+    int index, i;
+
+    target = (FLAC__uint64)seek_time * parallel->info.sample_rate / 1000;
+
+    squash_lock( parallel->lock );
+
+    index = 0;
+    for( i = 0; i < parallel->chunk_count && parallel->chunks[i].first_sample <= target; i++ ) {
+        index = i;
+    }
+
+    parallel->generation++;
+    for( i = 0; i < parallel->chunk_count; i++ ) {
+        squash_free( parallel->chunks[i].pcm_data );
+        parallel->chunks[i].done = FALSE;
+    }
+    squash_free( parallel->out_data );
+    parallel->out_size = 0;
+    parallel->out_used = 0;
+    parallel->next_chunk = index;
+    parallel->next_out = index;
+    parallel->skip_to = target;
+    parallel->position = seek_time;
+    squash_broadcast( parallel->changed );
+
+    squash_unlock( parallel->lock );
+}
+
+/*
+ * Stop the threads and close the opened song.
+ */
+void flac_parallel_close( void *data ) {
+    flac_parallel_t *parallel = (flac_parallel_t *)data;
+    int i;
+
+    squash_lock( parallel->lock );
+    parallel->quit = TRUE;
+    squash_broadcast( parallel->changed );
+    squash_unlock( parallel->lock );
+
+    for( i = 0; i < parallel->thread_count; i++ ) {
+        pthread_join( parallel->threads[i], NULL );
+    }
+
+    for( i = 0; i < parallel->chunk_count; i++ ) {
+        squash_free( parallel->chunks[i].pcm_data );
+    }
+    squash_free( parallel->chunks );
+    squash_free( parallel->out_data );
+    squash_free( parallel->info.seek_points );
+    squash_free( parallel->filename );
+    pthread_mutex_destroy( &parallel->lock );
+    pthread_cond_destroy( &parallel->changed );
+    squash_free( parallel );
+}
+
+/*
+ * Set the gain applied to chunks decoded from now on
+ */
+void flac_parallel_set_gain( void *data, pcm_gain_t gain ) {
+    flac_parallel_t *parallel = (flac_parallel_t *)data;
+
+    squash_lock( parallel->lock );
+    parallel->gain = gain;
+    squash_unlock( parallel->lock );
+}
@@ -22,8 +22,40 @@
 
 #include "global.h"
 #include "database.h" /* for insert_meta_data() */
+#include "pcm.h" /* for pcm_interleave_int32() */
 #include "play_mp3.h"
 
+/*
+ * Gives libmad the song from offset on, as much of it as the reader has
+ * mapped.  Returns FALSE past the end of the song.
+ */
+static bool mp3_feed( mp3_data_t *mp3_data, off_t offset ) {
+    const char *data;
+    long length;
+
+    if( (data = reader_map( mp3_data->reader, offset, PLAY_MP3_MIN_BUFFER, &length )) == NULL ) {
+        return FALSE;
+    }
+    mp3_data->offset = offset;
+    mad_stream_buffer( &mp3_data->stream, (const unsigned char *)data, length );
+
+    return TRUE;
+}
+
+/*
+ * Moves libmad on to the next part of the song when it runs out
+ * (MAD_ERROR_BUFLEN).  Returns FALSE at the end of the song.
+ */
+static bool mp3_refill( mp3_data_t *mp3_data ) {
+    struct mad_stream *stream = &mp3_data->stream;
+
+    if( mp3_data->offset + (stream->bufend - stream->buffer) >= mp3_data->reader->size ) {
+        return FALSE;
+    }
+
+    return mp3_feed( mp3_data, mp3_data->offset + (stream->next_frame - stream->buffer) );
+}
+
 /*
  * Open an mp3 file
  * sound_format will be modified and private state information
@@ -31,49 +63,49 @@
  */
 void *mp3_open( char *filename, sound_format_t *sound_format ) {
     mp3_data_t *mp3_data;
-    struct stat file_stat;
     struct mad_header m_header;
 
     /* Allocate space for data */
     squash_malloc( mp3_data, sizeof(mp3_data_t) );
 
     /* Open the song */
-    if( (mp3_data->file = fopen(filename, "r")) == NULL ) {
+    if( (mp3_data->reader = reader_open(filename)) == NULL ) {
+        squash_free( mp3_data );
         return (void *)NULL;
         // squash_error( "Unable to open file" );
     }
 
-    /* Open the mp3 file */
-    fstat(fileno(mp3_data->file), &file_stat);
-    mp3_data->file_size = file_stat.st_size;
-    mp3_data->buffer = mmap(0, mp3_data->file_size, PROT_READ, MAP_SHARED, fileno(mp3_data->file), 0);
-    if( mp3_data->buffer == (void *)-1 ) {
-        return (void *)NULL;
-        // squash_error( "Unable to open MP3 file" );
-    }
-
     mp3_data->pcm_data = NULL;
+    mp3_data->gain = pcm_gain( 0.0, 0.0 );
+    mp3_data->mix.channels = 0;
     mad_stream_init(&mp3_data->stream);
     mad_frame_init(&mp3_data->frame);
     mad_synth_init(&mp3_data->synth);
     mad_timer_reset(&mp3_data->timer);
-    mad_stream_buffer(&mp3_data->stream, (unsigned char *)mp3_data->buffer, mp3_data->file_size);
+    mp3_feed( mp3_data, 0 );
 
     while( 1 ) {
         if( mad_header_decode(&m_header, &mp3_data->stream) == -1 ) {
             if( MAD_RECOVERABLE(mp3_data->stream.error) ) {
                 continue;
             } else if( mp3_data->stream.error == MAD_ERROR_BUFLEN ) {
-                squash_error("Unable to get mp3info (EOF)");
+                if( mp3_refill( mp3_data ) ) {
+                    continue;
+                }
+                squash_log( "Unable to get mp3info (EOF): %s", filename );
             } else {
-                squash_error("Unable to get mp3info (Unrecoverable Error)");
+                squash_log( "Unable to get mp3info (Unrecoverable Error): %s", filename );
             }
+            /* Not an mp3 that can be played, let the caller deal with it */
+            mad_header_finish( &m_header );
+            mp3_close( mp3_data );
+            return (void *)NULL;
         }
         break;
     }
 
     sound_format->rate = m_header.samplerate;
-    sound_format->channels = MAD_NCHANNELS(&m_header);
+    sound_format->channels = 2; /* mono is spread to both channels */
     sound_format->byte_format = SOUND_LITTLE;
     sound_format->bits = 16;
 
@@ -81,7 +113,7 @@ void *mp3_open( char *filename, sound_format_t *sound_format ) {
     mad_stream_finish(&mp3_data->stream);
 
     mad_stream_init(&mp3_data->stream);
-    mad_stream_buffer(&mp3_data->stream, (unsigned char *)mp3_data->buffer, mp3_data->file_size);
+    mp3_feed( mp3_data, 0 );
 
     /* Return data */
     return (void *)mp3_data;
@@ -156,7 +188,7 @@ void mp3_load_meta( void *data, char *filename ) {
     ID3_FrameID frame_id;
 
     int i, value_length;
-    char *key, *value_raw, *cur_value, *cur_ptr;
+    char *key, *value_raw, *cur_value, *cur_ptr, *description;
 
     /* open the mp3 file and setup reading the id3 tag */
     tag = ID3Tag_New();
@@ -186,6 +218,17 @@ void mp3_load_meta( void *data, char *filename ) {
             continue;
         }
 
+        /* ReplayGain is kept in user text frames, named by their description */
+        description = NULL;
+        if( frame_id == ID3FID_USERTEXT && (field = ID3Frame_GetField( frame, ID3FN_DESCRIPTION )) != NULL ) {
+            value_length = ID3Field_Size( field );
+            squash_calloc( description, value_length + 1, 1 );
+            ID3Field_GetASCII( field, description, value_length );
+            if( strncasecmp( description, "replaygain_", 11 ) == 0 ) {
+                key = description;
+            }
+        }
+
         /* get the text portion of this frame */
         field = ID3Frame_GetField( frame, ID3FN_TEXT );
         value_length = ID3Field_Size( field );
@@ -213,6 +256,7 @@ void mp3_load_meta( void *data, char *filename ) {
 
         /* free up the data we got from the library */
         squash_free( value_raw );
+        squash_free( description );
     }
 
     /* free up the libraries data structures */
@@ -227,14 +271,16 @@ void mp3_load_meta( void *data, char *filename ) {
 frame_data_t mp3_decode_frame( void *data ) {
     mp3_data_t *mp3_data = (mp3_data_t *)data;
     frame_data_t frame_data;
-    int i, x;
+    const int *planes[2];
     int result;
     int channels;
     int pcm_size;
-    unsigned int sample;
 
-    /* Decode the next frame */
-    result = mad_frame_decode(&mp3_data->frame, &mp3_data->stream);
+    /* Decode the next frame, moving along the song as needed */
+    while( (result = mad_frame_decode(&mp3_data->frame, &mp3_data->stream)) != 0
+            && mp3_data->stream.error == MAD_ERROR_BUFLEN && mp3_refill( mp3_data ) ) {
+        /* the frame carried on past what libmad had */
+    }
     if (result != 0) {
         if (mp3_data->stream.error == MAD_ERROR_BUFLEN) {
             pcm_size = 0; /* EOF */
@@ -247,21 +293,17 @@ frame_data_t mp3_decode_frame( void *data ) {
         mad_timer_add(&mp3_data->timer, mp3_data->frame.header.duration);
         mad_synth_frame(&mp3_data->synth, &mp3_data->frame);
         channels = MAD_NCHANNELS(&mp3_data->frame.header);
-        pcm_size = mp3_data->synth.pcm.length*2*channels;
+        if( mp3_data->mix.channels != channels ) {
+            pcm_mix( &mp3_data->mix, channels, PCM_LAYOUT_WAVE );
+        }
+        pcm_size = mp3_data->synth.pcm.length*4;
         squash_realloc( mp3_data->pcm_data, sizeof(char)*pcm_size );
 
-        x = 0;
-        for(i = 0; i < mp3_data->synth.pcm.length; i++) {
-            sample = mad_to_16bit(mp3_data->synth.pcm.samples[0][i]);
-            mp3_data->pcm_data[x++] = sample & 0xff;
-            mp3_data->pcm_data[x++] = sample >> 8;
-
-            if (channels > 1) {
-                sample = mad_to_16bit(mp3_data->synth.pcm.samples[1][i]);
-                mp3_data->pcm_data[x++] = sample & 0xff;
-                mp3_data->pcm_data[x++] = sample >> 8;
-            }
-        }
+        /* Round, apply the gain and interleave as stereo in one go */
+        planes[0] = mp3_data->synth.pcm.samples[0];
+        planes[1] = mp3_data->synth.pcm.samples[1];
+        pcm_interleave_int32( mp3_data->pcm_data, planes, &mp3_data->mix, mp3_data->synth.pcm.length,
+                MAD_F_FRACBITS + 1, mp3_data->gain );
     }
     frame_data.pcm_size = pcm_size;
     frame_data.position = mad_timer_count(mp3_data->timer, MAD_UNITS_MILLISECONDS);
@@ -283,16 +325,18 @@ frame_data_t mp3_decode_frame( void *data ) {
  */
 void mp3_seek( void *data, long seek_time, long duration ) {
     mp3_data_t *mp3_data = (mp3_data_t *)data;
-    long new_file_position;
+    off_t new_file_position;
     if( duration <= 0 && seek_time != 0 ) {
         return;
     }
     if( seek_time == 0 ) {
         new_file_position = 0;
     } else {
-        new_file_position = (long)((double)mp3_data->file_size * seek_time / duration);
+        new_file_position = (off_t)((double)mp3_data->reader->size * seek_time / duration);
+    }
+    if( !mp3_feed( mp3_data, new_file_position ) ) {
+        return;
     }
-    mad_stream_buffer(&mp3_data->stream, (unsigned char *)&mp3_data->buffer[new_file_position], mp3_data->file_size - new_file_position);
     mad_timer_set( &mp3_data->timer, 0, seek_time, 1000 );
     mad_frame_mute( &mp3_data->frame );
     mad_synth_mute( &mp3_data->synth );
@@ -311,12 +355,8 @@ void mp3_close( void *data ) {
     mad_frame_finish(&mp3_data->frame);
     mad_stream_finish(&mp3_data->stream);
 
-    if( munmap(mp3_data->buffer, mp3_data->file_size) ) {
-        squash_error( "Unable to munmap" );
-    }
-
     /* Close file */
-    fclose( mp3_data->file );
+    reader_close( mp3_data->reader );
 
     /* Free allocated storage */
     if ( mp3_data->pcm_data != NULL ) {
@@ -328,17 +368,12 @@ void mp3_close( void *data ) {
 }
 
 /*
- * Takes the 24 bit sample given by libmad
- * and return a 16 bit sample.
+ * Set the gain applied to the decoded sound
  */
-unsigned int mad_to_16bit(mad_fixed_t f) {
-    f += (1L << (MAD_F_FRACBITS - 16));
-    if (f >= MAD_F_ONE) {
-        f = MAD_F_ONE - 1;
-    } else if (f < -MAD_F_ONE) {
-        f = -MAD_F_ONE;
-    }
-    return f >> (MAD_F_FRACBITS + 1 - 16);
+void mp3_set_gain( void *data, pcm_gain_t gain ) {
+    mp3_data_t *mp3_data = (mp3_data_t *)data;
+
+    mp3_data->gain = gain;
 }
 
 /*
@@ -354,6 +389,9 @@ long mp3_calc_duration(void * data) {
             if( MAD_RECOVERABLE(mp3_data->stream.error) ) {
                 continue;
             } else if( mp3_data->stream.error == MAD_ERROR_BUFLEN ) {
+                if( mp3_refill( mp3_data ) ) {
+                    continue;
+                }
                 break; /* EOF */
             } else {
                 break; /* BAD ERROR, oh well */
@@ -369,7 +407,7 @@ long mp3_calc_duration(void * data) {
 
     mad_stream_init(&mp3_data->stream);
     mad_timer_reset(&mp3_data->timer);
-    mad_stream_buffer(&mp3_data->stream, (unsigned char *)mp3_data->buffer, mp3_data->file_size);
+    mp3_feed( mp3_data, 0 );
 
     return duration;
 }
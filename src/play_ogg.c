@@ -22,8 +22,41 @@
 
 #include "global.h"
 #include "database.h" /* for insert_meta_data */
+#include "pcm.h" /* for pcm_interleave_float(), pcm_mix() */
 #include "play_ogg.h"
 
+/*
+ * vorbisfile reads the song through these, see reader.c
+ */
+static size_t ogg_read_callback( void *buffer, size_t size, size_t count, void *datasource ) {
+    long length;
+
+    if( size == 0 || (length = reader_read( (reader_t *)datasource, buffer, (long)(size * count) )) <= 0 ) {
+        return 0;
+    }
+    return length / size;
+}
+
+static int ogg_seek_callback( void *datasource, ogg_int64_t offset, int whence ) {
+    return reader_seek( (reader_t *)datasource, (off_t)offset, whence );
+}
+
+static int ogg_close_callback( void *datasource ) {
+    reader_close( (reader_t *)datasource );
+    return 0;
+}
+
+static long ogg_tell_callback( void *datasource ) {
+    return (long)reader_tell( (reader_t *)datasource );
+}
+
+static ov_callbacks ogg_callbacks = {
+    ogg_read_callback,
+    ogg_seek_callback,
+    ogg_close_callback,
+    ogg_tell_callback
+};
+
 /*
  * Open an ogg file
  * sound_format will be modified and private state information
@@ -32,10 +65,10 @@
 void *ogg_open( char *filename, sound_format_t *sound_format ) {
     ogg_data_t *ogg_data;
     vorbis_info *vorbis_info;
-    FILE *file;
+    reader_t *reader;
 
     /* Open the song */
-    if( (file = fopen(filename, "r")) == NULL ) {
+    if( (reader = reader_open(filename)) == NULL ) {
         return (void *)NULL;
         // squash_error( "Unable to open file" );
     }
@@ -44,18 +77,24 @@ void *ogg_open( char *filename, sound_format_t *sound_format ) {
     squash_malloc( ogg_data, sizeof(ogg_data_t) );
 
     /* Open the vorbis file */
-    if( ov_open(file, &ogg_data->file, NULL, 0) != 0 ) {
+    if( ov_open_callbacks(reader, &ogg_data->file, NULL, 0, ogg_callbacks) != 0 ) {
         squash_free( ogg_data );
-        fclose( file );
+        reader_close( reader );
         return (void *)NULL;
         // squash_error( "Unable to open Vorbis file" );
     }
 
     vorbis_info = ov_info(&ogg_data->file, -1);
+    if( !pcm_mix( &ogg_data->mix, vorbis_info->channels, PCM_LAYOUT_VORBIS ) ) {
+        ogg_close( ogg_data );
+        return (void *)NULL;
+    }
     sound_format->rate = vorbis_info->rate;
-    sound_format->channels = vorbis_info->channels;
+    sound_format->channels = 2; /* everything is mixed to stereo */
     sound_format->bits = 16;
     sound_format->byte_format = SOUND_LITTLE;
+    ogg_data->channels = vorbis_info->channels;
+    ogg_data->gain = pcm_gain( 0.0, 0.0 );
 
     /* Return data */
     return (void *)ogg_data;
@@ -69,18 +108,19 @@ void ogg_load_meta( void *data, char *filename ) {
 #else
     OggVorbis_File ogg_file;
     vorbis_comment *comment;
-    FILE *file;
+    reader_t *reader;
     char *start, *end, *key, *value;
     int i;
 
     /* Open the song */
-    if( (file = fopen(filename, "r")) == NULL ) {
-        squash_error( "Unable to open file %s", filename );
+    if( (reader = reader_open(filename)) == NULL ) {
+        squash_log( "Unable to open file %s", filename );
+        return;
     }
 
     /* Open the vorbis file */
-    if( ov_test(file, &ogg_file, NULL, 0) != 0 ) {
-        fclose( file );
+    if( ov_test_callbacks(reader, &ogg_file, NULL, 0, ogg_callbacks) != 0 ) {
+        reader_close( reader );
         return;
     }
 
@@ -106,6 +146,18 @@ void ogg_load_meta( void *data, char *filename ) {
 #endif
 }
 
+/*
+ * The frame size for one of vorbisfile's error codes.  OV_HOLE only means
+ * some data was skipped (a damaged or missing page), and decoding carries
+ * on past it; anything else ends the song.
+ */
+static long ogg_error_size( long error ) {
+    if( error == OV_HOLE ) {
+        return -1;
+    }
+    return -2;
+}
+
 /*
  * Decode a frame of ogg data.
  */
@@ -117,12 +169,36 @@ frame_data_t ogg_decode_frame( void *data ) {
     /* Decode the next frame */
 #ifdef TREMOR
     long cur_time;
-    frame_data.pcm_size = ov_read( &ogg_data->file, ogg_data->pcm_data, PLAY_OGG_PCM_BUFFER_SIZE, &song_section );
+    long frames;
+
+    /* Leave room for mono to be doubled up */
+    frame_data.pcm_size = ov_read( &ogg_data->file, ogg_data->pcm_data,
+            ogg_data->channels == 1 ? PLAY_OGG_PCM_BUFFER_SIZE / 2 : PLAY_OGG_PCM_BUFFER_SIZE, &song_section );
+    if( frame_data.pcm_size > 0 ) {
+        /* Tremor only gives out 16 bit samples, so this takes its own pass */
+        frames = frame_data.pcm_size / (2 * ogg_data->channels);
+        pcm_mix_in_place( (short *)ogg_data->pcm_data, &ogg_data->mix, frames, ogg_data->gain );
+        frame_data.pcm_size = frames * 4;
+    } else if( frame_data.pcm_size < 0 ) {
+        frame_data.pcm_size = ogg_error_size( frame_data.pcm_size );
+    }
     cur_time = ov_time_tell( &ogg_data->file );
     frame_data.position = cur_time;
 #else
     double cur_time;
-    frame_data.pcm_size = ov_read( &ogg_data->file, ogg_data->pcm_data, PLAY_OGG_PCM_BUFFER_SIZE, 0, 2, 1, &song_section );
+    float **pcm;
+    long frames;
+
+    /* Take the floating point samples, and convert them to stereo with the gain applied */
+    frames = ov_read_float( &ogg_data->file, &pcm, PLAY_OGG_PCM_BUFFER_SIZE / 4, &song_section );
+    if( frames > 0 ) {
+        pcm_interleave_float( ogg_data->pcm_data, (const float *const *)pcm, &ogg_data->mix, frames, ogg_data->gain );
+        frame_data.pcm_size = frames * 4;
+    } else if( frames < 0 ) {
+        frame_data.pcm_size = ogg_error_size( frames );
+    } else {
+        frame_data.pcm_size = 0;
+    }
     cur_time = ov_time_tell( &ogg_data->file );
     frame_data.position = (long)(cur_time * 1000);
 #endif
@@ -174,10 +250,19 @@ void ogg_close( void *data ) {
 
     /* Close vorbis file */
     ov_clear( &ogg_data->file );
-    /* closing the vorbis file also closed the FILE*! */
+    /* closing the vorbis file also closed the reader! */
 
     /* Free allocated storage */
     squash_free( ogg_data );
 
     return;
 }
+
+/*
+ * Set the gain applied to the decoded sound
+ */
+void ogg_set_gain( void *data, pcm_gain_t gain ) {
+    ogg_data_t *ogg_data = (ogg_data_t *)data;
+
+    ogg_data->gain = gain;
+}
@@ -0,0 +1,297 @@
+/*
+ * Copyright 2003 by Adam Luter
+ * This file is part of Squash, a C/Ncurses-based unix music player.
+ *
+ * Squash is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Squash is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Squash; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+/*
+ * play_wav.c
+ */
+
+#include "global.h"
+#include "database.h" /* for insert_meta_data() */
+#include "pcm.h" /* for pcm_interleave_packed(), pcm_mix() */
+#include "play_wav.h"
+
+/* WAVE_FORMAT_* tags */
+#define WAV_FORMAT_PCM 0x0001
+#define WAV_FORMAT_FLOAT 0x0003
+#define WAV_FORMAT_EXTENSIBLE 0xFFFE
+
+/*
+ * The LIST INFO tags that are kept, and what they are called here (the
+ * same as the ID3 names in play_mp3.c)
+ */
+static const char *wav_info_keys[][2] = {
+    { "INAM", "title" },
+    { "IART", "artist" },
+    { "IPRD", "album" },
+    { "ICRD", "year" },
+    { "IGNR", "genre" },
+    { "ICMT", "comment" },
+    { "ITRK", "tracknumber" },
+    { NULL, NULL }
+};
+
+static unsigned long wav_get_le( const unsigned char *data, int bytes ) {
+    unsigned long value = 0;
+
+    while( bytes-- > 0 ) {
+        value = (value << 8) | data[ bytes ];
+    }
+    return value;
+}
+
+/*
+ * Adds the tags in a LIST INFO chunk to a song's metadata.
+ */
+static void wav_read_info( const unsigned char *list, long length, song_info_t *song ) {
+    const unsigned char *end = list + length;
+    unsigned long size;
+    int i;
+
+    for( list += 4; end - list >= 8; list += 8 + size + (size & 1) ) {
+        size = wav_get_le( list + 4, 4 );
+        if( (unsigned long)(end - list - 8) < size ) {
+            return;
+        }
+        for( i = 0; wav_info_keys[i][0] != NULL; i++ ) {
+            if( memcmp( list, wav_info_keys[i][0], 4 ) == 0 && strnlen( (const char *)list + 8, size ) > 0 ) {
+                /* The text is usually, but not always, NUL terminated */
+                insert_meta_data( song, NULL, strdup( wav_info_keys[i][1] ),
+                        copy_string( (const char *)list + 8, (const char *)list + 8 + strnlen( (const char *)list + 8, size ) - 1 ) );
+                break;
+            }
+        }
+    }
+}
+
+/*
+ * Walks the chunks of a RIFF WAVE file, filling in the format and where
+ * the samples are.  If song isn't NULL, any LIST INFO tags go into its
+ * metadata.  Returns FALSE if it isn't a WAV file squash can play.
+ */
+static bool wav_read_header( wav_data_t *wav_data, song_info_t *song ) {
+    const unsigned char *block;
+    unsigned long size;
+    long available;
+    off_t offset;
+    int tag, bytes;
+    bool have_format, have_data;
+
+    block = (const unsigned char *)reader_map( wav_data->reader, 0, 12, &available );
+    if( block == NULL || available < 12 || memcmp( block, "RIFF", 4 ) != 0 || memcmp( block + 8, "WAVE", 4 ) != 0 ) {
+        return FALSE;
+    }
+
+    have_format = FALSE;
+    have_data = FALSE;
+    tag = 0;
+    bytes = 0;
+    for( offset = 12; !have_data || song != NULL; offset += size + (size & 1) ) {
+        block = (const unsigned char *)reader_map( wav_data->reader, offset, 8, &available );
+        if( block == NULL || available < 8 ) {
+            break;
+        }
+        size = wav_get_le( block + 4, 4 );
+        offset += 8;
+
+        if( memcmp( block, "fmt ", 4 ) == 0 && size >= 16 ) {
+            block = (const unsigned char *)reader_map( wav_data->reader, offset, size, &available );
+            if( block == NULL || available < 16 ) {
+                return FALSE;
+            }
+            tag = (int)wav_get_le( block, 2 );
+            wav_data->channels = (int)wav_get_le( block + 2, 2 );
+            wav_data->sample_rate = (int)wav_get_le( block + 4, 4 );
+            wav_data->block_align = (int)wav_get_le( block + 12, 2 );
+            if( tag == WAV_FORMAT_EXTENSIBLE && available >= 26 ) {
+                /* The first two bytes of the sub format GUID */
+                tag = (int)wav_get_le( block + 24, 2 );
+            }
+            have_format = TRUE;
+        } else if( memcmp( block, "data", 4 ) == 0 ) {
+            wav_data->data_offset = offset;
+            /* Files still being written, or over 4GB, have the size wrong */
+            if( size > (unsigned long)(wav_data->reader->size - offset) ) {
+                size = (unsigned long)(wav_data->reader->size - offset);
+            }
+            wav_data->data_size = size;
+            have_data = TRUE;
+        } else if( memcmp( block, "LIST", 4 ) == 0 && song != NULL ) {
+            block = (const unsigned char *)reader_map( wav_data->reader, offset, size, &available );
+            if( block != NULL && (unsigned long)available >= size && size >= 4 && memcmp( block, "INFO", 4 ) == 0 ) {
+                wav_read_info( block, size, song );
+            }
+        }
+    }
+
+    if( !have_format || !have_data || wav_data->channels <= 0 || wav_data->sample_rate <= 0 ) {
+        return FALSE;
+    }
+
+    bytes = wav_data->block_align / wav_data->channels;
+    if( bytes * wav_data->channels != wav_data->block_align ) {
+        return FALSE;
+    }
+    if( tag == WAV_FORMAT_PCM && bytes >= 1 && bytes <= 4 ) {
+        wav_data->format = bytes == 1 ? PCM_SAMPLE_U8 : bytes == 2 ? PCM_SAMPLE_S16 : bytes == 3 ? PCM_SAMPLE_S24 : PCM_SAMPLE_S32;
+    } else if( tag == WAV_FORMAT_FLOAT && bytes == 4 ) {
+        wav_data->format = PCM_SAMPLE_FLOAT;
+    } else {
+        return FALSE;
+    }
+    wav_data->data_size -= wav_data->data_size % wav_data->block_align;
+
+    return TRUE;
+}
+
+/*
+ * Open a wav file
+ * sound_format will be modified and private state information
+ * will be returned.
+ */
+void *wav_open( char *filename, sound_format_t *sound_format ) {
+    wav_data_t *wav_data;
+
+    squash_malloc( wav_data, sizeof(wav_data_t) );
+
+    if( (wav_data->reader = reader_open(filename)) == NULL ) {
+        squash_free( wav_data );
+        return (void *)NULL;
+    }
+
+    if( !wav_read_header( wav_data, NULL ) || !pcm_mix( &wav_data->mix, wav_data->channels, PCM_LAYOUT_WAVE ) ) {
+        reader_close( wav_data->reader );
+        squash_free( wav_data );
+        return (void *)NULL;
+    }
+
+    wav_data->position = 0;
+    wav_data->gain = pcm_gain( 0.0, 0.0 );
+    squash_malloc( wav_data->buffer, PLAY_WAV_FRAME_SAMPLES * 4 );
+
+    sound_format->rate = wav_data->sample_rate;
+    sound_format->channels = 2; /* everything is mixed to stereo */
+    sound_format->bits = 16;
+    sound_format->byte_format = SOUND_LITTLE;
+
+    return (void *)wav_data;
+}
+
+void wav_load_meta( void *data, char *filename ) {
+    wav_data_t wav_data;
+
+    if( (wav_data.reader = reader_open(filename)) == NULL ) {
+        squash_log( "Unable to open file %s", filename );
+        return;
+    }
+
+    wav_read_header( &wav_data, (song_info_t *)data );
+
+    reader_close( wav_data.reader );
+}
+
+/*
+ * Hand out the next PLAY_WAV_FRAME_SAMPLES.  16 bit stereo at its
+ * natural volume is already what the player wants, so it is handed over
+ * straight from the file's mapping without being copied; anything else
+ * is converted in one pass.
+ */
+frame_data_t wav_decode_frame( void *data ) {
+    wav_data_t *wav_data = (wav_data_t *)data;
+    frame_data_t frame_data;
+    const char *samples;
+    long frames, available;
+
+    frame_data.pcm_data = NULL;
+    frame_data.position = (long)((double)(wav_data->position / wav_data->block_align) * 1000.0 / wav_data->sample_rate);
+
+    frames = PLAY_WAV_FRAME_SAMPLES;
+    if( frames > (wav_data->data_size - wav_data->position) / wav_data->block_align ) {
+        frames = (long)((wav_data->data_size - wav_data->position) / wav_data->block_align);
+    }
+    if( frames <= 0 ) {
+        frame_data.pcm_size = 0;
+        return frame_data;
+    }
+
+    samples = reader_map( wav_data->reader, wav_data->data_offset + wav_data->position, frames * wav_data->block_align, &available );
+    if( samples == NULL || available < wav_data->block_align ) {
+        frame_data.pcm_size = -2;
+        return frame_data;
+    }
+    if( frames > available / wav_data->block_align ) {
+        frames = available / wav_data->block_align;
+    }
+
+    if( wav_data->format == PCM_SAMPLE_S16 && wav_data->channels == 2 && wav_data->gain.scale_q12 == 4096
+            && ((unsigned long)samples & 1) == 0 ) {
+        /* The mapping is private, see reader_map() */
+        frame_data.pcm_data = (char *)samples;
+    } else {
+        pcm_interleave_packed( wav_data->buffer, (const unsigned char *)samples, wav_data->format, &wav_data->mix, frames, wav_data->gain );
+        frame_data.pcm_data = wav_data->buffer;
+    }
+    frame_data.pcm_size = frames * 4;
+
+    wav_data->position += frames * wav_data->block_align;
+
+    return frame_data;
+}
+
+/*
+ * Return the number of milliseconds in the opened song
+ */
+long wav_calc_duration( void *data ) {
+    wav_data_t *wav_data = (wav_data_t *)data;
+
+    return (long)((double)(wav_data->data_size / wav_data->block_align) * 1000.0 / wav_data->sample_rate);
+}
+
+/*
+ * Seek to the seek_time position (in milliseconds) in
+ * the opened song.  The samples are all the same size, so this is exact.
+ */
+void wav_seek( void *data, long seek_time, long duration ) {
+    wav_data_t *wav_data = (wav_data_t *)data;
+
+    wav_data->position = (off_t)((double)seek_time * wav_data->sample_rate / 1000.0) * wav_data->block_align;
+    if( wav_data->position > wav_data->data_size ) {
+        wav_data->position = wav_data->data_size;
+    } else if( wav_data->position < 0 ) {
+        wav_data->position = 0;
+    }
+}
+
+/*
+ * Close the opened song.
+ */
+void wav_close( void *data ) {
+    wav_data_t *wav_data = (wav_data_t *)data;
+
+    reader_close( wav_data->reader );
+    squash_free( wav_data->buffer );
+    squash_free( wav_data );
+}
+
+/*
+ * Set the gain applied to the decoded sound
+ */
+void wav_set_gain( void *data, pcm_gain_t gain ) {
+    wav_data_t *wav_data = (wav_data_t *)data;
+
+    wav_data->gain = gain;
+}
@@ -22,81 +22,248 @@
 
 #include "global.h"
 #include "sound.h"      /* for sound_*() */
-#include "play_flac.h"  /* for flac_*() */
-#include "play_mp3.h"   /* for mp3_*() */
-#include "play_ogg.h"   /* for ogg_*() */
+#include "decoder.h"    /* for decoder_functions() */
+#include "pcm_cache.h"  /* for pcm_cache_has() */
 #include "spectrum.h"   /* for spectrum_reset() */
-#include "stat.h"       /* for feedback() */
+#include "stat.h"       /* for queue_feedback() */
+#include "pcm.h"        /* for pcm_silent_*(), pcm_gain() */
+#include "database.h"   /* for get_meta_data() */
+#include "analyze.h"    /* for ANALYZE_REFERENCE_LOUDNESS */
+#include "resample.h"   /* for resample_*() */
 #include "player.h"
 
 /*
- * Define the song functions
+ * Copies a decoded frame into the frame buffer.  The frame buffer lock must
+ * be held.
  */
-song_functions_t song_functions[] = {
-    { NULL, NULL, NULL, NULL, NULL },
-    { ogg_open, ogg_decode_frame, ogg_calc_duration, ogg_seek, ogg_close },
-    { mp3_open, mp3_decode_frame, mp3_calc_duration, mp3_seek, mp3_close },
-    { flac_open, flac_decode_frame, flac_calc_duration, flac_seek, flac_close }
-};
+static void frame_decoder_push( frame_data_t frame ) {
+    if( frame_buffer.size == 0 ) {
+        squash_broadcast( frame_buffer.new_data );
+    }
+    if( frame.pcm_data && frame.pcm_size > 0 ) {
+        char *pcm_data;
+        squash_malloc( pcm_data, frame.pcm_size );
+        memcpy( pcm_data, frame.pcm_data, frame.pcm_size );
+        frame.pcm_data = pcm_data;
+    } else {
+        frame.pcm_data = NULL;
+    }
+    frame_buffer_push( frame );
+    if( frame_buffer.pcm_size >= frame_buffer.high_water ) {
+        frame_buffer.filling = FALSE;
+    }
+}
 
+/*
+ * Whether the frame decoder has nothing to do until the player asks for
+ * more.  The frame buffer lock must be held.
+ */
+static bool frame_decoder_idle( decoder_slot_t current ) {
+    return !(frame_buffer.filling && frame_buffer.size < PLAYER_MAX_BUFFER_FRAMES
+                && (current.decode || frame_buffer.new_file || frame_buffer.next_file)
+                && !frame_buffer.fade_wanted)
+            && !frame_buffer.song_eof && !frame_buffer.drop_next;
+}
+
+/*
+ * Decodes the current song into the frame buffer.  When it gets to the
+ * song's fade_position it asks the player for the next song, and if that
+ * comes it is decoded alongside, faded in over the end of the current song
+ * (both are 16 bit stereo at the same rate, see start_crossfade()).  Once
+ * the current song ends the next one carries on as the current song.
+ * It works in bursts, from the low watermark up to the high one, and
+ * sleeps in between.
+ */
 void *frame_decoder( void *input_data ) {
-    frame_data_t new_frame;
-    void *decoder_data = NULL;
-    frame_data_t(* decoder_function)(void *) = NULL;
-    void (*close_function)(void *) = NULL;
+    frame_data_t new_frame, next_frame;
+    decoder_slot_t current, next;
+    frame_data_t next_end;      /* how the next song ended, if it did during the fade */
+    bool next_running = FALSE;
+    char *fade_data = NULL;     /* decoded from the next song, but not faded in yet */
+    long fade_size = 0, fade_allocated = 0;
+    long fade_done = 0, fade_length = 0; /* sample frames */
+    long fade_position = -1;
+    long frames, mixed;
     bool have_new_frame = FALSE;
+    bool faded_out = FALSE;
+    struct timeval busy_start;
 
-    while( 1 ) {
+    gettimeofday( &busy_start, NULL );
+    current.decode = NULL;
+    next.decode = NULL;
+    next_end.pcm_size = 0;
+    next_end.pcm_data = NULL;
+    next_end.position = 0;
+
+    while( !squash_quitting() ) {
         /* decode some data */
-        if( decoder_function ) {
-            new_frame = decoder_function( decoder_data );
+        if( current.decode ) {
+            new_frame = current.decode( current.data );
             have_new_frame = TRUE;
+
+            if( new_frame.pcm_size > 0 && current.end_position != -1 && new_frame.position >= current.end_position ) {
+                /* Only silence is left, so end the song here */
+                new_frame.pcm_size = 0;
+            } else if( new_frame.pcm_size > 0 && next.decode ) {
+                /* Get as much of the next song as there is of this frame */
+                while( fade_size < new_frame.pcm_size && next_running ) {
+                    next_frame = next.decode( next.data );
+                    if( next_frame.pcm_size > 0 ) {
+                        if( fade_size + next_frame.pcm_size > fade_allocated ) {
+                            fade_allocated = (fade_size + next_frame.pcm_size) * 2;
+                            squash_realloc( fade_data, fade_allocated );
+                        }
+                        memcpy( fade_data + fade_size, next_frame.pcm_data, next_frame.pcm_size );
+                        fade_size += next_frame.pcm_size;
+                        next_end.position = next_frame.position;
+                    } else if( next_frame.pcm_size != -1 ) {
+                        /* It's over already */
+                        next_end = next_frame;
+                        next_running = FALSE;
+                    }
+                }
+
+                /* Stereo 16 bit frames are 4 bytes */
+                frames = new_frame.pcm_size / 4;
+                mixed = fade_size / 4 < frames ? fade_size / 4 : frames;
+                pcm_crossfade( (short *)new_frame.pcm_data, (short *)new_frame.pcm_data, (short *)fade_data,
+                        mixed, fade_done, fade_length );
+                if( mixed < frames ) {
+                    pcm_crossfade( (short *)new_frame.pcm_data + mixed * 2, (short *)new_frame.pcm_data + mixed * 2, NULL,
+                            frames - mixed, fade_done + mixed, fade_length );
+                }
+                memmove( fade_data, fade_data + mixed * 4, fade_size - mixed * 4 );
+                fade_size -= mixed * 4;
+                fade_done += frames;
+
+                /* Nothing of this song can be heard any more */
+                if( fade_done >= fade_length ) {
+                    faded_out = TRUE;
+                }
+            } else if( new_frame.pcm_size > 0 && fade_done < fade_length ) {
+                /* Still fading in, the last song ended early */
+                frames = new_frame.pcm_size / 4;
+                pcm_crossfade( (short *)new_frame.pcm_data, NULL, (short *)new_frame.pcm_data, frames, fade_done, fade_length );
+                fade_done += frames;
+            }
         }
 
         squash_lock( frame_buffer.lock );
 
         if( frame_buffer.song_eof ) {
-            if( close_function ) {
-                close_function( decoder_data );
-                close_function = NULL;
-                decoder_function = NULL;
-                frame_buffer.song_eof = FALSE;
+            /* The player has already finished with this song, so
+             * anything more from it goes */
+            frame_buffer.song_eof = FALSE;
+            have_new_frame = FALSE;
+            faded_out = FALSE;
+            if( current.decode ) {
+                current.close( current.data );
+                current.decode = NULL;
             }
         }
 
+        if( frame_buffer.drop_next ) {
+            /* The current song was sent back to the start, so it will need
+             * fading out all over again */
+            frame_buffer.drop_next = FALSE;
+            if( next.decode ) {
+                next.close( next.data );
+                next.decode = NULL;
+            }
+            if( frame_buffer.next_file ) {
+                frame_buffer.next.close( frame_buffer.next.data );
+                frame_buffer.next_file = FALSE;
+            }
+            have_new_frame = FALSE;
+            faded_out = FALSE;
+            fade_size = 0;
+            fade_done = fade_length = 0;
+            fade_position = current.fade_position;
+        }
+
         if( have_new_frame ) {
             have_new_frame = FALSE;
-            if( new_frame.pcm_size == 0 || new_frame.pcm_size <= -2 ) {
-                if( close_function ) {
-                    close_function( decoder_data );
-                    close_function = NULL;
-                    decoder_function = NULL;
-                    frame_buffer.song_eof = FALSE;
-                }
-            } else {
-                frame_buffer.pcm_size += new_frame.pcm_size;
+            frame_decoder_push( new_frame );
+            if( new_frame.pcm_size > 0 && faded_out ) {
+                new_frame.pcm_size = 0;
+                frame_decoder_push( new_frame );
             }
-            if( frame_buffer.size == 0 ) {
+            if( new_frame.pcm_size == 0 || new_frame.pcm_size <= -2 ) {
+                current.close( current.data );
+                current.decode = NULL;
+                faded_out = FALSE;
+            } else if( new_frame.pcm_size > 0 && fade_position != -1 && new_frame.position >= fade_position ) {
+                /* Time to start fading in the next song */
+                fade_position = -1;
+                frame_buffer.fade_wanted = TRUE;
                 squash_broadcast( frame_buffer.new_data );
             }
-            frame_buffer.frames[frame_buffer.size] = new_frame;
-            if( new_frame.pcm_data && new_frame.pcm_size > 0 ) {
-                squash_malloc( frame_buffer.frames[frame_buffer.size].pcm_data, new_frame.pcm_size );
-                memcpy(frame_buffer.frames[frame_buffer.size].pcm_data, new_frame.pcm_data, new_frame.pcm_size);
-            }
-            frame_buffer.size++;
         }
 
         if( frame_buffer.new_file ) {
             frame_buffer.new_file = FALSE;
-            decoder_data = frame_buffer.decoder_data;
-            decoder_function = frame_buffer.decoder_function;
-            close_function = frame_buffer.close_function;
+            if( current.decode ) {
+                current.close( current.data );
+            }
+            current = frame_buffer.current;
+            fade_position = current.fade_position;
+            fade_done = fade_length = 0;
+        }
+
+        if( frame_buffer.next_file ) {
+            frame_buffer.next_file = FALSE;
+            next = frame_buffer.next;
+            next_running = TRUE;
+            fade_size = 0;
+            fade_done = 0;
+            fade_length = frame_buffer.fade_length;
         }
 
-        while( !(frame_buffer.size < PLAYER_MAX_BUFFER_SIZE && frame_buffer.pcm_size < PLAYER_MAX_BUFFER_PCM_SIZE
-                    && (decoder_function || frame_buffer.new_file)) ) {
-            squash_wait( frame_buffer.restart, frame_buffer.lock );
+        /* With the current song gone, the one fading in takes over */
+        if( current.decode == NULL && next.decode != NULL ) {
+            current = next;
+            next.decode = NULL;
+            frame_buffer.current = current;
+            fade_position = current.fade_position;
+
+            if( fade_size > 0 ) {
+                frames = fade_size / 4;
+                pcm_crossfade( (short *)fade_data, NULL, (short *)fade_data, frames, fade_done, fade_length );
+                fade_done += frames;
+
+                next_frame.pcm_data = fade_data;
+                next_frame.pcm_size = fade_size;
+                next_frame.position = next_end.position;
+                frame_decoder_push( next_frame );
+                fade_size = 0;
+            }
+            if( !next_running ) {
+                frame_decoder_push( next_end );
+                current.close( current.data );
+                current.decode = NULL;
+            }
+        }
+
+        if( frame_decoder_idle(current) ) {
+            /* The end of a burst, sleep until the player wants more */
+            squash_lock( wakeup_info.lock );
+            wakeup_info.busy_seconds += squash_elapsed_usec( &busy_start ) / 1000000.0;
+            squash_unlock( wakeup_info.lock );
+
+            while( frame_decoder_idle(current) && !squash_quitting() ) {
+                squash_wait( frame_buffer.restart, frame_buffer.lock );
+                squash_lock( wakeup_info.lock );
+                wakeup_info.decoder_wakeups++;
+                squash_unlock( wakeup_info.lock );
+            }
+
+            gettimeofday( &busy_start, NULL );
+            if( frame_buffer.filling ) {
+                squash_lock( wakeup_info.lock );
+                wakeup_info.bursts++;
+                squash_broadcast( wakeup_info.burst );
+                squash_unlock( wakeup_info.lock );
+            }
         }
 
        squash_unlock( frame_buffer.lock );
@@ -105,37 +272,182 @@ void *frame_decoder( void *input_data ) {
     return (void *)NULL;
 }
 
+/*
+ * Takes the next song off the song queue and works out where to play it
+ * from, skipping past any leading silence and stopping at any trailing
+ * silence found by song_analyzer(), leaving as much as detect_silence()
+ * would play.  The song queue lock must be held, and the queue can't be
+ * empty.
+ */
+static void take_next_song( next_song_t *next ) {
+    song_info_t *song;
+
+    get_next_song_info( &next->song, &next->start_position );
+    song = next->song;
+
+    next->first_position = 0;
+    next->end_position = -1;
+    if( config.player_silence_duration > 0 && song->stat.trim_start != -1 ) {
+        if( song->stat.trim_start > config.player_silence_duration ) {
+            next->first_position = song->stat.trim_start - config.player_silence_duration;
+        }
+        if( song->stat.trim_end != -1 ) {
+            next->end_position = song->stat.trim_end + config.player_silence_duration;
+        }
+    }
+    if( next->start_position < next->first_position ) {
+        next->start_position = next->first_position;
+    }
+
+    next->decoder_data = NULL;
+    next->fading = FALSE;
+}
+
+/*
+ * Opens the decoder for the next song, levelled out and at its start
+ * position.  A song in the PCM cache is played from there instead.
+ * Expects a read lock on database_info.  Returns FALSE if the song can't
+ * be opened, and sends it off to be quarantined.
+ */
+static bool open_next_song( next_song_t *next ) {
+    song_info_t *song = next->song;
+    char *full_filename;
+
+    next->decoder_data = NULL;
+    if( pcm_cache_has(song) ) {
+        full_filename = pcm_cache_filename( song );
+        next->functions = &song_functions[ TYPE_WAV ];
+        next->decoder_data = next->functions->open( full_filename, &next->sound_format );
+        squash_free( full_filename );
+        if( next->decoder_data != NULL ) {
+            squash_lock( pcm_cache_info.lock );
+            pcm_cache_info.hits++;
+            squash_unlock( pcm_cache_info.lock );
+        }
+    }
+
+    if( next->decoder_data == NULL ) {
+        squash_asprintf(full_filename, "%s/%s", song->basename[ BASENAME_SONG ], song->filename );
+
+        next->functions = decoder_functions( song->song_type, render_info.active );
+        next->decoder_data = next->functions->open( full_filename, &next->sound_format );
+        if( next->decoder_data == NULL ) {
+            squash_log( "Problem opening file: %s", full_filename );
+            squash_free( full_filename );
+            queue_feedback( song, 0 );
+            return FALSE;
+        }
+        squash_free( full_filename );
+    }
+
+    /* Level the song out */
+    next->functions->set_gain( next->decoder_data, get_replay_gain( song ) );
+
+    /* skip to the start position */
+    next->functions->seek( next->decoder_data, next->start_position, song->play_length );
+
+    return TRUE;
+}
+
+/*
+ * Sets the frame decoder up to decode the next song.  It will crossfade
+ * into the song after this one Crossfade milliseconds before this one
+ * ends, going by where the trailing silence starts if that's known, or
+ * else by how long the song is.  Songs too short to fade both in and out
+ * are left alone.
+ */
+static decoder_slot_t next_song_slot( next_song_t *next ) {
+    decoder_slot_t slot;
+    long end;
+
+    slot.song = next->song;
+    slot.data = next->decoder_data;
+    slot.decode = next->functions->decode_frame;
+    slot.seek = next->functions->seek;
+    slot.close = next->functions->close;
+    slot.end_position = next->end_position;
+
+    end = next->end_position != -1 ? next->end_position : next->song->play_length;
+    slot.fade_position = -1;
+    if( config.player_crossfade > 0 && end - next->first_position >= 2 * (long)config.player_crossfade
+            && end - config.player_crossfade > next->start_position ) {
+        slot.fade_position = end - config.player_crossfade;
+    }
+
+    return slot;
+}
+
+/*
+ * Answers the frame decoder when it wants the next song to fade in.  It
+ * gets it unless there's no next song yet or it would need a different
+ * sound format, in which case the current song plays out on its own.  The
+ * next song is kept either way, for STATE_BEFORE_SONG, unless it can't be
+ * opened.
+ */
+static void start_crossfade( next_song_t *next, sound_format_t sound_format ) {
+    squash_rlock( database_info.lock );
+    if( next->song == NULL ) {
+        squash_lock( song_queue.lock );
+        if( song_queue.size > 0 ) {
+            take_next_song( next );
+        }
+        squash_unlock( song_queue.lock );
+    }
+    if( next->song != NULL && next->song->song_type != TYPE_UNKNOWN && next->decoder_data == NULL ) {
+        if( !open_next_song(next) ) {
+            next->song = NULL;
+        }
+    }
+    squash_runlock( database_info.lock );
+
+    squash_lock( frame_buffer.lock );
+    if( next->decoder_data != NULL && sound_format_equal(next->sound_format, sound_format) ) {
+        frame_buffer.next = next_song_slot( next );
+        frame_buffer.next_file = TRUE;
+        frame_buffer.fade_length = (long)config.player_crossfade * sound_format.rate / 1000;
+        next->fading = TRUE;
+        squash_log( "Crossfading into: %s", next->song->filename );
+    }
+    frame_buffer.fade_wanted = FALSE;
+    squash_broadcast( frame_buffer.restart );
+    squash_unlock( frame_buffer.lock );
+}
+
 /*
  * Thread start function
  */
 void *player( void *input_data ) {
     song_info_t *cur_song;
-    sound_device_t *cur_sound_device;
-    unsigned int silence_duration;
+    next_song_t next_song;
+    silence_info_t silence;
     sound_format_t sound_format;
+    sound_format_t output_format;
+    resample_t resampler;
+    bool reopen;
     enum { STATE_BEFORE_SONG, STATE_IN_SONG, STATE_AFTER_SONG } play_state;
-    player_command_entry_t *command_entry;
-    char *full_filename;
-    long start_position;
+    player_command_entry_t command_entry;
+    long latency;
+    long start_position, first_position;
 
     play_state = STATE_BEFORE_SONG;
+    resample_init( &resampler );
+    reopen = TRUE;
 
     /* make the compiler happy */
     cur_song = NULL;
+    first_position = 0;
+    next_song.song = NULL;
+    next_song.decoder_data = NULL;
+    next_song.fading = FALSE;
 
-    while( 1 ) {
+    while( !squash_quitting() ) {
         /* Process any commands */
-        squash_lock( player_command.lock );
-        if( player_command.head != NULL ) {
-            squash_unlock( player_command.lock );
-            squash_wlock( database_info.lock );
+        if( player_command_pending() ) {
             squash_lock( player_info.lock );
-            squash_lock( player_command.lock );
             squash_lock( frame_buffer.lock );
-            command_entry = player_command.head;
-            while( command_entry != NULL ) {
-                squash_log( "Reading command %d", command_entry->command );
-                switch( command_entry->command ) {
+            while( player_next_command(&command_entry) ) {
+                squash_log( "Reading command %d", command_entry.command );
+                switch( command_entry.command ) {
                     /* TODO: fix this so that skip and stop are not ignored when
                      * not inside a song
                      */
@@ -144,37 +456,47 @@ void *player( void *input_data ) {
                          * a regular CD player:
                         player_info.state = STATE_PLAY;
                          */
-                        {
-                            int x;
-                            for( x = 0; x < frame_buffer.size; x++ ) {
-                                squash_free( frame_buffer.frames[x].pcm_data );
-                            }
+                        if( play_state == STATE_IN_SONG && frame_buffer.current.song != cur_song ) {
+                            /* The frame decoder is well into the song that
+                             * was fading in, so carry on with that */
+                            frame_buffer_drop_song();
+                        } else {
+                            frame_buffer_clear();
+                            frame_buffer.song_eof = TRUE;
+                            frame_buffer.fade_wanted = FALSE;
                         }
-                        frame_buffer.song_eof = TRUE;
-                        frame_buffer.size = 0;
-                        frame_buffer.pcm_size = 0;
+                        sound_queue_flush( &command_entry.queued );
+                        resample_reset( &resampler );
 
                         if( play_state == STATE_IN_SONG ) {
                             play_state = STATE_AFTER_SONG;
                         }
-                        feedback(cur_song, -1);
+                        queue_feedback( cur_song, -1 );
                         break;
                     case CMD_STOP:
-                        {
-                            int x;
-                            for( x = 0; x < frame_buffer.size; x++ ) {
-                                squash_free( frame_buffer.frames[x].pcm_data );
-                            }
-                        }
                         player_info.state = STATE_STOP;
-                        frame_buffer.size = 0;
-                        frame_buffer.pcm_size = 0;
-                        squash_broadcast( frame_buffer.restart );
-
-                        if( play_state == STATE_IN_SONG ) {
-                            /* Return to the begenning of the song */
-                            song_functions[ cur_song->song_type ].seek( frame_buffer.decoder_data, 0, cur_song->play_length );
-                            player_info.current_position = 0;
+                        frame_buffer_clear();
+                        sound_queue_flush( &command_entry.queued );
+                        resample_reset( &resampler );
+
+                        if( play_state == STATE_IN_SONG && frame_buffer.current.song != cur_song ) {
+                            /* All that's left of this song is in the frame
+                             * buffer, so start over on the one that was
+                             * fading in */
+                            frame_buffer.current.seek( frame_buffer.current.data, next_song.start_position, next_song.song->play_length );
+                            frame_buffer.drop_next = TRUE;
+                            play_state = STATE_AFTER_SONG;
+                        } else if( play_state == STATE_IN_SONG ) {
+                            /* Return to the begenning of the song, and
+                             * fade the next one in all over again */
+                            frame_buffer.current.seek( frame_buffer.current.data, first_position, cur_song->play_length );
+                            player_info.current_position = first_position;
+                            frame_buffer.drop_next = TRUE;
+                            frame_buffer.fade_wanted = FALSE;
+                            if( next_song.fading ) {
+                                next_song.fading = FALSE;
+                                next_song.decoder_data = NULL;
+                            }
 
                             /* Reset the spectrum display */
                             spectrum_reset( sound_format );
@@ -185,36 +507,48 @@ void *player( void *input_data ) {
                         break;
                     case CMD_PAUSE:
                         player_info.state = STATE_PAUSE;
+                        sound_queue_pause( TRUE, &command_entry.queued );
                         break;
                     case CMD_PLAY:
                         player_info.state = STATE_PLAY;
+                        sound_queue_pause( FALSE, &command_entry.queued );
                         squash_broadcast( frame_buffer.restart );
                         break;
                     default:
                         /* ignore */
                         break;
                 }
-                command_entry = command_entry->next;
-                if( player_command.head == player_command.tail ) {
-                    player_command.tail = command_entry;
+
+                /* Keep track of how long commands wait before they are done */
+                latency = squash_elapsed_usec( &command_entry.queued );
+                player_info.command_count++;
+                player_info.command_latency_sum += latency;
+                if( latency > player_info.command_latency_max ) {
+                    player_info.command_latency_max = latency;
                 }
-                squash_free( player_command.head );
-                player_command.head = command_entry;
-                player_command.size--;
+                squash_log( "Command %d done after %ld usec", command_entry.command, latency );
             }
             squash_unlock( player_info.lock );
             squash_unlock( frame_buffer.lock );
-            squash_wunlock( database_info.lock );
         }
 
-        /* only pause if we were going to be playing and we shouldn't */
+        /* only pause if we were going to be playing and we shouldn't
+         * (after a song too, so that a paused output queue is never
+         * waited on to drain) */
         if( player_info.state == STATE_BIG_STOP ||
-            ( play_state == STATE_IN_SONG && player_info.state != STATE_PLAY) ) {
-            squash_wait( player_command.changed, player_command.lock );
+            ( play_state != STATE_BEFORE_SONG && player_info.state != STATE_PLAY) ) {
+            squash_lock( player_command.lock );
+            /* Tell player_queue_command() to wake us, then make sure
+             * nothing came in before it could see that */
+            player_command.waiting = TRUE;
+            squash_barrier();
+            if( !player_command_pending() && !squash_quitting() ) {
+                squash_wait( player_command.changed, player_command.lock );
+            }
+            player_command.waiting = FALSE;
             squash_unlock( player_command.lock );
             continue;
         }
-        squash_unlock( player_command.lock );
 
         /* Actually play stuff */
         switch( play_state ) {
@@ -225,7 +559,7 @@ void *player( void *input_data ) {
                 squash_lock( frame_buffer.lock );
 
                 /* Wait for a song to be added */
-                while( song_queue.size <= 0 ) {
+                while( next_song.song == NULL && song_queue.size <= 0 && !squash_quitting() ) {
                     squash_unlock( frame_buffer.lock );
                     squash_unlock( player_info.lock );
                     squash_runlock( database_info.lock );
@@ -236,9 +570,23 @@ void *player( void *input_data ) {
                     squash_lock( player_info.lock );
                     squash_lock( frame_buffer.lock );
                 }
+                if( next_song.song == NULL && song_queue.size <= 0 ) {
+                    /* Quitting */
+                    squash_unlock( frame_buffer.lock );
+                    squash_unlock( player_info.lock );
+                    squash_unlock( song_queue.lock );
+                    squash_runlock( database_info.lock );
+                    continue;
+                }
 
-                /* Get the next song */
-                get_next_song_info(&cur_song, &start_position);
+                /* Get the next song, unless it was already gotten to
+                 * crossfade into */
+                if( next_song.song == NULL ) {
+                    take_next_song( &next_song );
+                }
+                cur_song = next_song.song;
+                start_position = next_song.start_position;
+                first_position = next_song.first_position;
 
                 /* Set Now Playing Information */
                 set_now_playing_info( cur_song, start_position );
@@ -248,44 +596,39 @@ void *player( void *input_data ) {
                 squash_unlock( song_queue.lock );
 
                 /* Make sure this is a file we can deal with */
-                if( cur_song->song_type == TYPE_UNKNOWN ) {
+                if( cur_song->song_type == TYPE_UNKNOWN
+                        || (!next_song.fading && next_song.decoder_data == NULL && !open_next_song(&next_song)) ) {
+                    next_song.song = NULL;
+                    squash_unlock( frame_buffer.lock );
+                    squash_unlock( player_info.lock );
+                    squash_runlock( database_info.lock );
                     continue;
                 }
 
-                /* Open the decoder  */
-                squash_asprintf(full_filename, "%s/%s", cur_song->basename[ BASENAME_SONG ], cur_song->filename );
-
-                frame_buffer.decoder_data = song_functions[ cur_song->song_type ].open( full_filename, &sound_format );
-                if( frame_buffer.decoder_data == NULL ) {
-                    squash_error("Problem opening file: %s");
-                }
-                squash_free( full_filename );
-
-                /* skip to the start position */
-                song_functions[ cur_song->song_type ].seek( frame_buffer.decoder_data, start_position, cur_song->play_length );
-
-                frame_buffer.decoder_function = song_functions[ cur_song->song_type ].decode_frame;
-                frame_buffer.close_function = song_functions[ cur_song->song_type ].close;
-                frame_buffer.new_file = TRUE;
-                {
-                    int x;
-                    for( x = 0; x < frame_buffer.size; x++ ) {
-                        squash_free( frame_buffer.frames[x].pcm_data );
-                    }
+                if( !next_song.fading ) {
+                    /* The decoder was opened above */
+                    frame_buffer.current = next_song_slot( &next_song );
+                    frame_buffer.new_file = TRUE;
+                    frame_buffer_set_format( next_song.sound_format );
+                    frame_buffer_clear();
                 }
-                frame_buffer.size = 0;
-                frame_buffer.pcm_size = 0;
-                squash_broadcast( frame_buffer.restart );
+                /* else the frame decoder has already started on it */
+                sound_format = next_song.sound_format;
+                next_song.song = NULL;
+                next_song.decoder_data = NULL;
+                next_song.fading = FALSE;
                 squash_unlock( frame_buffer.lock );
                 squash_runlock( database_info.lock );
 
-                silence_duration = 0;
+                silence.duration = 0;
 
-                /* Open the sound device */
-                player_info.device = sound_open(sound_format); // mem leak here or at close.
-                if( player_info.device == NULL ) {
-                    squash_error("Problem opening the sound device!");
+                /* The sound devices stay open as long as what they are
+                 * playing doesn't change, see STATE_IN_SONG */
+                if( reopen || !sound_format_equal(resample_output_format(sound_format), output_format) ) {
+                    output_format = resample_output_format( sound_format );
+                    reopen = TRUE;
                 }
+                resample_set_format( &resampler, sound_format, output_format );
 
                 squash_unlock( player_info.lock );
 
@@ -295,36 +638,37 @@ void *player( void *input_data ) {
                 play_state = STATE_IN_SONG;
                 break;
             case STATE_IN_SONG:
+                /* Wait for the output here, where a command can still get
+                 * in ahead of the next frame */
+                if( !sound_queue_wait() ) {
+                    break;
+                }
                 squash_lock(frame_buffer.lock);
-                if( frame_buffer.size > 0 ) {
-                    bool need_more = FALSE;
+                if( frame_buffer.fade_wanted && !next_song.fading ) {
+                    squash_unlock( frame_buffer.lock );
+                    start_crossfade( &next_song, sound_format );
+                } else if( frame_buffer.size > 0 ) {
                     frame_data_t cur_frame;
-                    int x;
-                    cur_frame = frame_buffer.frames[0];
-                    for( x = 1; x < frame_buffer.size; x++ ) {
-                        frame_buffer.frames[x - 1] = frame_buffer.frames[x];
-                    }
-                    frame_buffer.size--;
-                    frame_buffer.pcm_size -= cur_frame.pcm_size;
-                    if( frame_buffer.size * 10 < PLAYER_MAX_BUFFER_SIZE * 9 || frame_buffer.pcm_size * 10 < PLAYER_MAX_BUFFER_PCM_SIZE * 9 ) {
-                        need_more = TRUE;
+                    frame_buffer_pop( &cur_frame );
+                    if( !frame_buffer.filling && (frame_buffer.pcm_size < frame_buffer.low_water || next_song.fading) ) {
+                        /* Below the low watermark, so fill back up to the high
+                         * one.  A crossfade decodes two songs at once, so
+                         * keep as far ahead as possible through it */
+                        frame_buffer.filling = TRUE;
+                        squash_broadcast( frame_buffer.restart );
                     }
                     squash_unlock( frame_buffer.lock );
 
                     if( cur_frame.pcm_size == 0 ) {
                         /* EOF */
-                        squash_wlock( database_info.lock );
-                        feedback(cur_song, 1);
-                        squash_wunlock( database_info.lock );
+                        queue_feedback( cur_song, 1 );
                         play_state = STATE_AFTER_SONG;
                     } else if( cur_frame.pcm_size == -1 ) {
                         /* Recoverable error */
                     } else if( cur_frame.pcm_size <= -2 ) {
-                        squash_wlock( database_info.lock );
-                        feedback(cur_song, 1);
-                        squash_wunlock( database_info.lock );
+                        /* Non-recoverable error, keep it from being picked again */
+                        queue_feedback( cur_song, 0 );
                         play_state = STATE_AFTER_SONG;
-                        /* Non-recoverable error */
                     } else {
                         spectrum_update( cur_frame );
 
@@ -336,20 +680,54 @@ void *player( void *input_data ) {
                         player_info.current_position = cur_frame.position;
                         squash_unlock( player_info.lock );
 
-                        cur_sound_device = player_info.device;  /* grab a copy of the device
-                                                                 * (hope that the sound driver itself is thread safe */
+                        if( detect_silence(cur_frame, sound_format, &silence) ) {
+                            /* Keep whatever is around the silent range */
+                            int frame_bytes = sound_format.channels * sound_format.bits / 8;
 
-                        if( !detect_silence(cur_frame, &silence_duration) ) {
-                            sound_play( cur_frame, cur_sound_device );
+                            memmove( cur_frame.pcm_data + silence.skip_start * frame_bytes,
+                                     cur_frame.pcm_data + silence.skip_end * frame_bytes,
+                                     cur_frame.pcm_size - silence.skip_end * frame_bytes );
+                            cur_frame.pcm_size -= (silence.skip_end - silence.skip_start) * frame_bytes;
+                        }
+
+                        if( render_info.active ) {
+                            render_info.rendered += (double)cur_frame.pcm_size
+                                / (sound_format.rate * sound_format.channels * sound_format.bits / 8);
+                        }
+                        if( cur_frame.pcm_size > 0 ) {
+                            cur_frame = resample_frame( &resampler, cur_frame );
+                        }
+
+                        if( reopen ) {
+                            /* Finish the last song before changing format.  This
+                             * waits until now, when we can't be paused. */
+                            sound_queue_drain();
+
+                            squash_lock( player_info.lock );
+                            if( player_info.device != NULL ) {
+                                sound_queue_close();
+                            }
+                            player_info.device = sound_queue_open( output_format );
+                            if( player_info.device == NULL ) {
+                                squash_error("Problem opening the sound device!");
+                            }
+                            squash_unlock( player_info.lock );
+                            reopen = FALSE;
+                        }
+
+                        /* The output thread plays (and frees) it from here */
+                        if( cur_frame.pcm_size > 0 ) {
+                            sound_queue_frame( cur_frame );
+                        } else {
+                            squash_free( cur_frame.pcm_data );
                         }
-                        squash_free( cur_frame.pcm_data );
-                    }
-                    if( need_more ) {
-                        squash_broadcast( frame_buffer.restart );
                     }
                 } else {
+                    frame_buffer.filling = TRUE;
                     squash_broadcast( frame_buffer.restart );
-                    squash_wait( frame_buffer.new_data, frame_buffer.lock );
+                    if( !squash_quitting() ) {
+                        squash_wait( frame_buffer.new_data, frame_buffer.lock );
+                    }
                     squash_unlock( frame_buffer.lock );
                 }
                 break;
@@ -360,9 +738,32 @@ void *player( void *input_data ) {
                 squash_unlock( past_queue.lock );
                 squash_runlock( database_info.lock );
 
+                /* The sound devices are left open for the next song */
                 squash_lock( player_info.lock );
-                /* Close the sound device */
-                sound_close( player_info.device );
+
+                /* A render stops after the song that takes it past its limit */
+                if( render_info.active ) {
+                    render_info.song_count++;
+                    if( render_info.rendered >= render_info.limit ) {
+                        player_info.state = STATE_BIG_STOP;
+
+                        /* Let the output threads finish, then close the
+                         * devices so the files are complete */
+                        squash_unlock( player_info.lock );
+                        sound_queue_drain();
+                        squash_lock( player_info.lock );
+                        if( player_info.device != NULL ) {
+                            sound_queue_close();
+                            player_info.device = NULL;
+                            reopen = TRUE;
+                        }
+
+                        squash_lock( status_info.lock );
+                        status_info.exit_status = 0;
+                        squash_unlock( status_info.lock );
+                        squash_signal( status_info.exit );
+                    }
+                }
                 squash_unlock( player_info.lock );
 
                 play_state = STATE_BEFORE_SONG;
@@ -373,6 +774,137 @@ void *player( void *input_data ) {
     return 0;
 }
 
+/*
+ * Adds a frame to the end of the frame buffer, making room if needed.
+ * The frame buffer lock must be held.
+ */
+void frame_buffer_push( frame_data_t frame ) {
+    if( frame_buffer.size == frame_buffer.allocated ) {
+        frame_data_t *frames;
+        int x;
+
+        /* Grow the ring, unwrapping it as we go */
+        squash_malloc( frames, frame_buffer.allocated * 2 * sizeof(frame_data_t) );
+        for( x = 0; x < frame_buffer.size; x++ ) {
+            frames[x] = frame_buffer.frames[ (frame_buffer.start + x) % frame_buffer.allocated ];
+        }
+        squash_free( frame_buffer.frames );
+        frame_buffer.frames = frames;
+        frame_buffer.allocated *= 2;
+        frame_buffer.start = 0;
+    }
+
+    frame_buffer.frames[ (frame_buffer.start + frame_buffer.size) % frame_buffer.allocated ] = frame;
+    frame_buffer.size++;
+    if( frame.pcm_size > 0 ) {
+        frame_buffer.pcm_size += frame.pcm_size;
+    }
+}
+
+/*
+ * Takes the oldest frame out of the frame buffer, returns FALSE if it
+ * is empty.  The frame buffer lock must be held.
+ */
+bool frame_buffer_pop( frame_data_t *frame ) {
+    if( frame_buffer.size <= 0 ) {
+        return FALSE;
+    }
+
+    *frame = frame_buffer.frames[ frame_buffer.start ];
+    frame_buffer.start = (frame_buffer.start + 1) % frame_buffer.allocated;
+    frame_buffer.size--;
+    if( frame->pcm_size > 0 ) {
+        frame_buffer.pcm_size -= frame->pcm_size;
+    }
+
+    return TRUE;
+}
+
+/*
+ * Throws away everything in the frame buffer and tells the frame decoder
+ * to fill it back up.  The frame buffer lock must be held.
+ */
+void frame_buffer_clear( void ) {
+    frame_data_t frame;
+
+    while( frame_buffer_pop(&frame) ) {
+        squash_free( frame.pcm_data );
+    }
+    frame_buffer.start = 0;
+    frame_buffer.pcm_size = 0;
+    frame_buffer.filling = TRUE;
+    squash_broadcast( frame_buffer.restart );
+}
+
+/*
+ * Throws away the rest of the song at the front of the frame buffer, up to
+ * and including its end, leaving whatever follows it.  The frame buffer
+ * lock must be held.
+ */
+void frame_buffer_drop_song( void ) {
+    frame_data_t frame;
+
+    while( frame_buffer_pop(&frame) ) {
+        squash_free( frame.pcm_data );
+        if( frame.pcm_size == 0 || frame.pcm_size <= -2 ) {
+            break;
+        }
+    }
+}
+
+/*
+ * Sizes the frame buffer for a song's sound format.  The frame buffer lock
+ * must be held.
+ */
+void frame_buffer_set_format( sound_format_t sound_format ) {
+    frame_buffer.bytes_per_second = sound_format.rate * sound_format.channels * sound_format.bits / 8;
+    frame_buffer_set_watermarks();
+}
+
+/*
+ * Turns the Buffer_Low and Buffer_High times into byte counts for the
+ * current format, keeping the high watermark inside Buffer_Memory.  Call
+ * this again whenever any of those change.  The frame buffer lock must be
+ * held.
+ */
+void frame_buffer_set_watermarks( void ) {
+    long budget = (long)config.player_buffer_memory * 1024;
+    long low, high;
+
+    if( frame_buffer.bytes_per_second <= 0 ) {
+        frame_buffer.bytes_per_second = 44100 * 2 * 2;
+    }
+
+    high = (long)((double)frame_buffer.bytes_per_second * config.player_buffer_high / 1000);
+    low = (long)((double)frame_buffer.bytes_per_second * config.player_buffer_low / 1000);
+    if( low > high ) {
+        low = high;
+    }
+
+    /* Squeeze both into the memory budget, keeping their ratio */
+    if( high > budget ) {
+        low = (long)((double)low * budget / high);
+        high = budget;
+    }
+
+    frame_buffer.high_water = high;
+    frame_buffer.low_water = low;
+
+    squash_log( "Frame buffer watermarks %ld/%ld bytes at %d bytes/s", low, high, frame_buffer.bytes_per_second );
+}
+
+/*
+ * How many milliseconds of sound are in the frame buffer.  The frame buffer
+ * lock must be held.
+ */
+long frame_buffer_duration( void ) {
+    if( frame_buffer.bytes_per_second <= 0 ) {
+        return 0;
+    }
+
+    return (long)((double)frame_buffer.pcm_size * 1000 / frame_buffer.bytes_per_second);
+}
+
 /*
  * Gets the next song off the playlist.
  */
@@ -449,41 +981,94 @@ void done_with_song_info( song_info_t *song ) {
 }
 
 /*
- * This is a fast silence detection hueristic.  I am not a sound engineer.
- * This routine was roughly tuned and appears to work well.  It looks for
- * 30% zeros in a frame.  If this happens for a whole second, then that
- * frame and any following frames are considered silent; until a frame with
- * less than 30% zeros is found.
- * Roughly tuned means on a handful of tracks at 44100hz, stereo and reasonable
- * compression.
+ * Silence detection.  A sample frame is silent when every channel is at or
+ * below the Silence_Threshold (in dBFS).  Once silence has lasted for
+ * Silence_Duration milliseconds (measured using the song's own sample rate),
+ * the rest of that silence is reported in silence->skip_start and
+ * silence->skip_end (sample frames within this frame) and 1 is returned.
+ * silence->duration carries the length of the current silent run from one
+ * frame to the next, and should be zeroed when a new song starts.
+ * Only 16 bit samples are understood, anything else is never silent.
  */
-int detect_silence( frame_data_t frame_data, unsigned int *silence_duration ) {
-    const int one_second = 176400;
-    const int threshold = frame_data.pcm_size * 30 / 100; /* 30% of the buffer length */
-    int zero_count = 0;
-    int i;
+int detect_silence( frame_data_t frame_data, sound_format_t sound_format, silence_info_t *silence ) {
+    long sample_count, frame_count, lead, limit;
+    short threshold;
+    int skip = 0;
 
-    /* Find Zeroes */
-    for( i = 0; i < frame_data.pcm_size; i++ ) {
-        if( frame_data.pcm_data[i] == 0 ) {
-            zero_count++;
-            if( zero_count >= threshold ) {
-                *silence_duration += frame_data.pcm_size;
-                break;
-            }
-        } else if( (threshold - zero_count) >= (frame_data.pcm_size - i) ) {
-            /* there is less than 30% zeros, therefore we are not silent */
-            *silence_duration = 0;
-            break;
+    silence->skip_start = 0;
+    silence->skip_end = 0;
+
+    if( config.player_silence_duration <= 0 || sound_format.bits != 16 || sound_format.channels <= 0 || frame_data.pcm_size <= 0 ) {
+        silence->duration = 0;
+        return 0;
+    }
+
+    threshold = pcm_db_to_amplitude( config.player_silence_threshold );
+    limit = (long)sound_format.rate * config.player_silence_duration / 1000;
+    sample_count = frame_data.pcm_size / 2;
+    frame_count = sample_count / sound_format.channels;
+
+    /* How far does the silence from the last frame continue into this one */
+    lead = pcm_silent_prefix( (short *)frame_data.pcm_data, sample_count, threshold ) / sound_format.channels;
+
+    if( silence->duration + lead > limit ) {
+        silence->skip_start = limit - silence->duration;
+        if( silence->skip_start < 0 ) {
+            silence->skip_start = 0;
         }
+        silence->skip_end = lead;
+        skip = 1;
     }
 
-    /* Detemine Silence */
-    if( *silence_duration > one_second ) {
-        return 1;
+    if( lead == frame_count ) {
+        /* The whole frame is silent */
+        silence->duration += frame_count;
+    } else {
+        /* Start counting again from any silence at the end of this frame */
+        silence->duration = pcm_silent_suffix( (short *)frame_data.pcm_data, sample_count, threshold ) / sound_format.channels;
     }
 
-    return 0;
+    return skip;
+}
+
+/*
+ * Works out the gain to play a song at from its ReplayGain tags and the
+ * Replay_Gain setting.  Album gain falls back to the track gain when a
+ * song has no album tags, and a song without tags goes by the loudness
+ * song_analyzer() measured.  Expects a read lock on database_info.
+ */
+pcm_gain_t get_replay_gain( song_info_t *song ) {
+    meta_key_t *gain_key, *peak_key;
+    double peak = 0.0;
+
+    if( strcasecmp( config.player_replay_gain, "off" ) == 0 ) {
+        return pcm_gain( 0.0, 0.0 );
+    }
+
+    gain_key = NULL;
+    peak_key = NULL;
+    if( strcasecmp( config.player_replay_gain, "album" ) == 0 ) {
+        gain_key = get_meta_data( song, "replaygain_album_gain" );
+        peak_key = get_meta_data( song, "replaygain_album_peak" );
+    }
+    if( gain_key == NULL ) {
+        gain_key = get_meta_data( song, "replaygain_track_gain" );
+        peak_key = get_meta_data( song, "replaygain_track_peak" );
+    }
+
+    if( gain_key == NULL || gain_key->value_count <= 0 ) {
+        /* Nothing to go on, so leave it alone */
+        if( song->stat.loudness == STAT_LOUDNESS_UNKNOWN ) {
+            return pcm_gain( 0.0, 0.0 );
+        }
+        return pcm_gain( ANALYZE_REFERENCE_LOUDNESS - song->stat.loudness + config.player_replay_gain_preamp, song->stat.peak );
+    }
+
+    if( peak_key != NULL && peak_key->value_count > 0 ) {
+        peak = atof( peak_key->values[0] );
+    }
+
+    return pcm_gain( atof( gain_key->values[0] ) + config.player_replay_gain_preamp, peak );
 }
 
 /*
@@ -499,26 +1084,88 @@ void set_now_playing_info( song_info_t *song, long start_position ) {
 }
 
 /*
- * Called by other commands to queue a command for the player thread
+ * Called by other threads to queue a command for the player thread.  This is
+ * a bounded multi-producer, single-consumer ring; each entry's sequence number
+ * says which lap of the ring it is ready for, so producers only have to agree
+ * on the tail (using compare-and-swap) and no lock is needed.  Returns FALSE,
+ * dropping the command, if PLAYER_COMMAND_RING_SIZE commands are already
+ * waiting.
  */
-void player_queue_command( enum player_command_e command ) {
-    player_command_entry_t *new_entry;
+bool player_queue_command( enum player_command_e command ) {
+    player_command_entry_t *entry;
+    unsigned long position;
+    long difference;
 
     #ifdef INPUT_DEBUG
     squash_log( "Queueing player_command %d", command );
     #endif
 
-    squash_malloc( new_entry, sizeof(player_command_entry_t) );
-    new_entry->command = command;
-    new_entry->next = NULL;
-    if( player_command.head == NULL ) {
-        player_command.head = new_entry;
-        player_command.tail = new_entry;
-    } else {
-        player_command.tail->next = new_entry;
-        if( player_command.tail == player_command.head ) {
-            player_command.head = new_entry;
+    /* Claim an entry */
+    position = player_command.tail;
+    while( 1 ) {
+        entry = &player_command.entries[ position & (PLAYER_COMMAND_RING_SIZE - 1) ];
+        difference = (long)(entry->sequence - position);
+        if( difference == 0 ) {
+            if( squash_cas(&player_command.tail, position, position + 1) ) {
+                break;
+            }
+        } else if( difference < 0 ) {
+            squash_log( "Player command ring is full, dropping command %d", command );
+            return FALSE;
         }
+        /* Someone else got there first */
+        position = player_command.tail;
+    }
+
+    /* Fill it in and hand it to the player */
+    entry->command = command;
+    gettimeofday( &entry->queued, NULL );
+    squash_barrier();
+    entry->sequence = position + 1;
+
+    /* Wake the player if it is waiting */
+    squash_barrier();
+    if( player_command.waiting ) {
+        squash_lock( player_command.lock );
+        squash_broadcast( player_command.changed );
+        squash_unlock( player_command.lock );
     }
-    player_command.size++;
+    sound_queue_interrupt();
+
+    return TRUE;
+}
+
+/*
+ * Are there any commands for the player?  Only the player thread should
+ * call this.
+ */
+bool player_command_pending( void ) {
+    unsigned long position = player_command.head;
+    player_command_entry_t *entry = &player_command.entries[ position & (PLAYER_COMMAND_RING_SIZE - 1) ];
+
+    return (long)(entry->sequence - (position + 1)) >= 0;
+}
+
+/*
+ * Takes the next command off the ring, returns FALSE if there are none.
+ * Only the player thread may call this.
+ */
+bool player_next_command( player_command_entry_t *command_entry ) {
+    unsigned long position = player_command.head;
+    player_command_entry_t *entry = &player_command.entries[ position & (PLAYER_COMMAND_RING_SIZE - 1) ];
+
+    if( (long)(entry->sequence - (position + 1)) < 0 ) {
+        return FALSE;
+    }
+    squash_barrier();
+
+    command_entry->command = entry->command;
+    command_entry->queued = entry->queued;
+
+    /* Give the entry back to the producers for the next lap */
+    squash_barrier();
+    entry->sequence = position + PLAYER_COMMAND_RING_SIZE;
+    player_command.head = position + 1;
+
+    return TRUE;
 }
@@ -22,15 +22,22 @@
 
 #include "global.h"
 #include "database.h"   /* for save_song() */
-#include "stat.h"       /* for pick_song() */
-#include "player.h"     /* for song_functions[] */
+#include "stat.h"       /* for pick_song(), quarantine_song() */
+#include "decoder.h"    /* for song_functions[] */
+#include "scheduler.h"  /* for scheduler_*() */
 #include "playlist_manager.h"
 
 #include <sys/time.h>   /* for gettimeofday() */
 
-void ensure_song_fully_loaded( song_info_t *song_info ) {
+/*
+ * Load a song's type, meta data and play length if they are missing.
+ * Returns FALSE if the song can't be opened, in which case it has been
+ * quarantined.  The caller must hold the database write lock, so use
+ * preload_song() first where the lock can be let go.
+ */
+bool ensure_song_fully_loaded( song_info_t *song_info ) {
     if( song_info == NULL ) {
-        return;
+        return FALSE;
     }
 
     if( song_info->song_type == -1 ) {
@@ -69,7 +76,10 @@ void ensure_song_fully_loaded( song_info_t *song_info ) {
 
             decoder_data = song_functions[ song_info->song_type ].open( full_filename, &sound_format );
             if( decoder_data == NULL ) {
-                squash_error("Can't open file %s", full_filename );
+                squash_log( "Can't open file %s", full_filename );
+                squash_free( full_filename );
+                quarantine_song( song_info );
+                return FALSE;
             }
 
             /* Set Now Playing Information */
@@ -83,6 +93,138 @@ void ensure_song_fully_loaded( song_info_t *song_info ) {
             squash_free( full_filename );
         }
     }
+
+    return TRUE;
+}
+
+/*
+ * Loads a song's type, meta data and play length as
+ * ensure_song_fully_loaded() would, but into a copy of the song with no
+ * lock held, so tags are parsed and durations worked out while the rest
+ * of squash carries on.  The meta data is only kept if keep_meta is
+ * TRUE, otherwise just the type and play length are.  A song that can't
+ * be opened is quarantined.  Takes the database locks itself.
+ */
+void preload_song( int song_index, bool keep_meta ) {
+    song_info_t *song, loaded;
+    sound_format_t sound_format;
+    meta_key_t *meta_length;
+    void *decoder_data;
+    char *full_filename;
+    bool failed;
+
+    squash_rlock( database_info.lock );
+    song = &database_info.songs[ song_index ];
+    if( song->meta_key_count != -1 ) {
+        squash_runlock( database_info.lock );
+        return;
+    }
+    loaded = *song;
+    loaded.filename = strdup( song->filename );
+    loaded.meta_keys = NULL;
+    squash_runlock( database_info.lock );
+
+    if( loaded.song_type == -1 ) {
+        loaded.song_type = get_song_type( loaded.basename[ BASENAME_SONG ], loaded.filename );
+    }
+
+    load_meta_data( &loaded, TYPE_META );
+
+    failed = FALSE;
+    if( loaded.play_length == -1 ) {
+        /* empeg's metainfo files use duration instead of length */
+        meta_length = get_meta_data( &loaded, "duration" );
+        if( meta_length == NULL ) {
+            meta_length = get_meta_data( &loaded, "length" );
+        }
+        if( meta_length != NULL && meta_length->value_count != 0 ) {
+            loaded.play_length = atoi( meta_length->values[0] );
+        } else if( loaded.song_type != TYPE_UNKNOWN ) {
+            full_filename = build_fullfilename( &loaded, BASENAME_SONG );
+            decoder_data = song_functions[ loaded.song_type ].open( full_filename, &sound_format );
+            if( decoder_data == NULL ) {
+                squash_log( "Can't open file %s", full_filename );
+                failed = TRUE;
+            } else {
+                loaded.play_length = song_functions[ loaded.song_type ].calc_duration( decoder_data );
+                song_functions[ loaded.song_type ].close( decoder_data );
+            }
+            squash_free( full_filename );
+        }
+    }
+
+    /* Keep what another thread hasn't found out in the meantime */
+    squash_wlock( database_info.lock );
+    song = &database_info.songs[ song_index ];
+    if( song->song_type == -1 ) {
+        song->song_type = loaded.song_type;
+    }
+    if( song->play_length == -1 ) {
+        song->play_length = loaded.play_length;
+    }
+    if( keep_meta && song->meta_key_count == -1 ) {
+        song->meta_keys = loaded.meta_keys;
+        song->meta_key_count = loaded.meta_key_count;
+        loaded.meta_keys = NULL;
+        loaded.meta_key_count = 0;
+    }
+    if( failed ) {
+        quarantine_song( song );
+        save_song( song );
+    }
+    squash_wunlock( database_info.lock );
+
+    clear_song_meta( &loaded );
+    squash_free( loaded.filename );
+}
+
+/*
+ * Thread start function.  Works out the type and play length of every
+ * song in the background, writing any missing ".info" files on the way,
+ * so that queueing a song later needs little more than reading its
+ * ".info" file.  The meta data itself is not kept, to save memory.
+ */
+void *song_loader( void *input_data ) {
+    struct timespec wait_time = { 5, 000000000 };
+    song_info_t *song;
+    int song_index;
+    bool wanted;
+
+    /* Only use spare cycles */
+    scheduler_idle_priority();
+
+    song_index = 0;
+    while( !squash_quitting() ) {
+        squash_rlock( database_info.lock );
+
+        /* The song list isn't settled until the statistics are loaded */
+        if( !database_info.stats_loaded ) {
+            squash_runlock( database_info.lock );
+            nanosleep( &wait_time, NULL );
+            continue;
+        }
+
+        if( song_index >= database_info.song_count ) {
+            /* Everything has been looked at, check again later */
+            squash_runlock( database_info.lock );
+            song_index = 0;
+            scheduler_idle();
+            continue;
+        }
+
+        song = &database_info.songs[ song_index ];
+        wanted = song->meta_key_count == -1 && song->play_length == -1
+              && song->song_type != TYPE_UNKNOWN && song->stat.quarantine_size == -1;
+        squash_runlock( database_info.lock );
+
+        if( wanted ) {
+            preload_song( song_index, FALSE );
+            scheduler_next( JOB_LOAD );
+        }
+        song_index++;
+    }
+
+    return (void *)NULL;
 }
 
 /*
@@ -93,6 +235,7 @@ void ensure_song_fully_loaded( song_info_t *song_info ) {
  */
 void *playlist_manager( void *input_data ) {
     struct timeval cur_time;
+    int song_index;
 
     gettimeofday( &cur_time, NULL );
     srand( cur_time.tv_sec );
@@ -102,7 +245,7 @@ void *playlist_manager( void *input_data ) {
     squash_lock( song_queue.lock );
 
     /* While we have too many songs (in this case, wanted_size has not been set) */
-    while( song_queue.size >= song_queue.wanted_size ) {
+    while( song_queue.size >= song_queue.wanted_size && !squash_quitting() ) {
         squash_wait( song_queue.not_full, song_queue.lock );
     }
 
@@ -110,14 +253,14 @@ void *playlist_manager( void *input_data ) {
     squash_unlock( song_queue.lock );
 
     /* Load songs */
-    while( 1 ) {
+    while( !squash_quitting() ) {
         squash_log("playlist loop");
         /* Acquire lock */
         squash_wlock( database_info.lock );
         squash_lock( song_queue.lock );
 
         /* We only get in this loop if there are too many (or just enough) songs */
-        while( song_queue.size >= song_queue.wanted_size ) {
+        while( song_queue.size >= song_queue.wanted_size && !squash_quitting() ) {
             squash_wunlock( database_info.lock );
             squash_wait( song_queue.not_full, song_queue.lock );
             squash_unlock( song_queue.lock );
@@ -133,7 +276,7 @@ void *playlist_manager( void *input_data ) {
         }
 
         /* Now wait for the statistics data to be loaded */
-        while( !database_info.stats_loaded ) {
+        while( !database_info.stats_loaded && !squash_quitting() ) {
             squash_log("Waiting for stats to load");
             squash_wunlock( database_info.lock );
             squash_wait( database_info.stats_finished, song_queue.lock );
@@ -142,7 +285,24 @@ void *playlist_manager( void *input_data ) {
             squash_lock( song_queue.lock );
         }
 
-        playlist_queue_song( &database_info.songs[ pick_song() ], 0 );
+        if( squash_quitting() ) {
+            squash_unlock( song_queue.lock );
+            squash_wunlock( database_info.lock );
+            break;
+        }
+
+        song_index = pick_song();
+
+        /* Read the song's files without holding everyone else up */
+        if( database_info.songs[ song_index ].meta_key_count == -1 ) {
+            squash_unlock( song_queue.lock );
+            squash_wunlock( database_info.lock );
+            preload_song( song_index, TRUE );
+            squash_wlock( database_info.lock );
+            squash_lock( song_queue.lock );
+        }
+
+        playlist_queue_song( &database_info.songs[ song_index ], 0 );
 
         /* Save the database statistics to disk if we are done adding songs */
         if( song_queue.size >= song_queue.wanted_size ) {
@@ -166,13 +326,20 @@ void *playlist_manager( void *input_data ) {
 }
 
 /*
- * Add an entry to the playlist
+ * Add an entry to the playlist.  Returns FALSE, and adds nothing, if the
+ * song is in quarantine or can't be opened.
  */
-void playlist_queue_song( song_info_t *song, long start_position ) {
+bool playlist_queue_song( song_info_t *song, long start_position ) {
     song_queue_entry_t *new_song_queue_entry;
 
+    if( song->stat.quarantine_size != -1 ) {
+        return FALSE;
+    }
+
     /* ensure that the song is fully loaded (meta info, song length and song type) */
-    ensure_song_fully_loaded( song );
+    if( !ensure_song_fully_loaded(song) ) {
+        return FALSE;
+    }
 
     /* Allocate space for a new queue entry */
     squash_malloc( new_song_queue_entry, sizeof(song_queue_entry_t) );
@@ -190,4 +357,6 @@ void playlist_queue_song( song_info_t *song, long start_position ) {
     song_queue.tail = new_song_queue_entry;
     song_queue.size++;
     squash_log("song_queue.size = %d", song_queue.size);
+
+    return TRUE;
 }
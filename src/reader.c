@@ -0,0 +1,235 @@
+/*
+ * Copyright 2003 by Adam Luter
+ * This file is part of Squash, a C/Ncurses-based unix music player.
+ *
+ * Squash is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Squash is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Squash; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+/*
+ * reader.c
+ * Every decoder reads its song through here.  Songs are mapped a window
+ * at a time rather than all at once, and the kernel is told the file
+ * is being read straight through: what is coming up is asked for ahead
+ * of time, in large bursts, and what has been played is dropped from the
+ * page cache, so playing (or analyzing) the whole library doesn't push
+ * everything else out of memory.
+ */
+
+#include "global.h"
+#include "reader.h"
+
+/*
+ * Open a song for reading, returns NULL if it can't be.
+ */
+reader_t *reader_open( const char *filename ) {
+    reader_t *reader;
+    struct stat file_stat;
+    int fd;
+
+    if( (fd = open(filename, O_RDONLY)) == -1 ) {
+        return (reader_t *)NULL;
+    }
+    if( fstat(fd, &file_stat) != 0 ) {
+        close( fd );
+        return (reader_t *)NULL;
+    }
+
+    squash_malloc( reader, sizeof(reader_t) );
+    reader->fd = fd;
+    reader->size = file_stat.st_size;
+    reader->position = 0;
+    reader->window = NULL;
+    reader->window_start = 0;
+    reader->window_size = 0;
+    reader->advised = 0;
+    reader->dropped = 0;
+
+#ifdef POSIX_FADV_SEQUENTIAL
+    /* Read further ahead than usual */
+    posix_fadvise( fd, 0, 0, POSIX_FADV_SEQUENTIAL );
+#endif
+
+    return reader;
+}
+
+/*
+ * Called whenever the window moves.  Once less than READER_AHEAD past the
+ * window has been asked for, the kernel is asked for everything up to
+ * the next READER_BURST boundary in one go.  It is also told that
+ * everything before the window won't be needed again, which is taken back
+ * if the window moves back.
+ */
+static void reader_advise( reader_t *reader ) {
+#ifdef POSIX_FADV_WILLNEED
+    off_t from, end;
+
+    /* Moved back over what was dropped, such as after a decoder looked at
+     * the end of the file or a song was started over, so ask for it all
+     * again from here */
+    if( reader->window_start < reader->dropped ) {
+        reader->dropped = reader->window_start;
+        reader->advised = reader->window_start;
+    }
+
+    end = reader->window_start + reader->window_size + READER_AHEAD;
+    if( end > reader->size ) {
+        end = reader->size;
+    }
+    if( reader->advised < end ) {
+        from = reader->advised > reader->window_start ? reader->advised : reader->window_start;
+        end = (end / READER_BURST + 1) * READER_BURST;
+        if( end > reader->size ) {
+            end = reader->size;
+        }
+        posix_fadvise( reader->fd, from, end - from, POSIX_FADV_WILLNEED );
+        reader->advised = end;
+
+        squash_lock( wakeup_info.lock );
+        wakeup_info.disk_reads++;
+        squash_unlock( wakeup_info.lock );
+    }
+
+    if( reader->dropped < reader->window_start ) {
+        posix_fadvise( reader->fd, reader->dropped, reader->window_start - reader->dropped, POSIX_FADV_DONTNEED );
+        reader->dropped = reader->window_start;
+    }
+#endif
+#ifdef MADV_SEQUENTIAL
+    madvise( reader->window, reader->window_size, MADV_SEQUENTIAL );
+#endif
+}
+
+/*
+ * Returns where the song's data at offset can be found, and in length
+ * how much of it follows there.  That will be at least want bytes (up to
+ * half a window), or whatever is left of the song, moving the window if
+ * it needs to.  Returns NULL past the end of the song.  The data stays
+ * where it is until the next call.
+ */
+const char *reader_map( reader_t *reader, off_t offset, long want, long *length ) {
+    off_t start;
+    long page;
+
+    if( offset < 0 || offset >= reader->size ) {
+        *length = 0;
+        return (const char *)NULL;
+    }
+    if( want > READER_WINDOW / 2 ) {
+        want = READER_WINDOW / 2;
+    }
+    if( want > reader->size - offset ) {
+        want = (long)(reader->size - offset);
+    }
+
+    if( reader->window == NULL || offset < reader->window_start
+            || offset + want > reader->window_start + reader->window_size ) {
+        if( reader->window != NULL ) {
+            munmap( reader->window, reader->window_size );
+            reader->window = NULL;
+        }
+
+        /* mmap() only starts on a page */
+        page = getpagesize();
+        start = offset - offset % page;
+        reader->window_size = READER_WINDOW;
+        if( reader->window_size > reader->size - start ) {
+            reader->window_size = (long)(reader->size - start);
+        }
+
+        /* Private and writable, so that a decoder can hand the window
+         * straight to the player (see play_wav.c), which fades songs in
+         * place, without the file itself ever being touched */
+        reader->window = mmap( NULL, reader->window_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, reader->fd, start );
+        if( reader->window == MAP_FAILED ) {
+            reader->window = NULL;
+            *length = 0;
+            return (const char *)NULL;
+        }
+        reader->window_start = start;
+
+        reader_advise( reader );
+    }
+
+    *length = (long)(reader->window_start + reader->window_size - offset);
+    return reader->window + (offset - reader->window_start);
+}
+
+/*
+ * Copies length bytes from the current position like fread(), returning
+ * how many there were (0 at the end of the song), or -1 on an error.
+ */
+long reader_read( reader_t *reader, void *buffer, long length ) {
+    const char *data;
+    long available, done;
+
+    done = 0;
+    while( done < length ) {
+        if( (data = reader_map( reader, reader->position, 1, &available )) == NULL ) {
+            if( done == 0 && reader->position < reader->size ) {
+                return -1;
+            }
+            break;
+        }
+        if( available > length - done ) {
+            available = length - done;
+        }
+        memcpy( (char *)buffer + done, data, available );
+        done += available;
+        reader->position += available;
+    }
+
+    return done;
+}
+
+/*
+ * Moves the current position like fseek(), returning 0 or -1 on an error.
+ */
+int reader_seek( reader_t *reader, off_t offset, int whence ) {
+    switch( whence ) {
+        case SEEK_SET:
+            break;
+        case SEEK_CUR:
+            offset += reader->position;
+            break;
+        case SEEK_END:
+            offset += reader->size;
+            break;
+        default:
+            return -1;
+    }
+    if( offset < 0 ) {
+        return -1;
+    }
+    reader->position = offset;
+
+    return 0;
+}
+
+/*
+ * Returns the current position.
+ */
+off_t reader_tell( reader_t *reader ) {
+    return reader->position;
+}
+
+/*
+ * Close the song.
+ */
+void reader_close( reader_t *reader ) {
+    if( reader->window != NULL ) {
+        munmap( reader->window, reader->window_size );
+    }
+    close( reader->fd );
+    squash_free( reader );
+}
@@ -0,0 +1,366 @@
+/*
+ * Copyright 2003 by Adam Luter
+ * This file is part of Squash, a C/Ncurses-based unix music player.
+ *
+ * Squash is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Squash is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Squash; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+/*
+ * resample.c
+ */
+#include "global.h"
+#include "sound.h"      /* for sound_format_equal() */
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "resample.h"
+
+/*
+ * The sound devices stay open in the format this returns, and every song
+ * is converted to it.  The empeg can only play 44.1kHz stereo.  On the PC
+ * [Sound] Rate and Channels pick it, 0 meaning to follow the song (and
+ * reopen the devices whenever the song's format changes).
+ */
+sound_format_t resample_output_format( sound_format_t in ) {
+    sound_format_t out = in;
+
+#ifdef EMPEG_DSP
+    out.rate = 44100;
+    out.channels = 2;
+#else
+    if( config.sound_rate > 0 ) {
+        out.rate = config.sound_rate;
+    }
+    if( config.sound_channels > 0 ) {
+        out.channels = config.sound_channels;
+    }
+#endif
+    if( out.channels > RESAMPLE_MAX_CHANNELS ) {
+        out.channels = RESAMPLE_MAX_CHANNELS;
+    }
+    out.bits = 16;
+    out.byte_format = SOUND_LITTLE;
+
+    return out;
+}
+
+/*
+ * Sets up an empty resampler, which passes nothing until it is given a
+ * format.
+ */
+void resample_init( resample_t *resample ) {
+    int c;
+
+    resample->in.rate = 0;
+    resample->in.channels = 0;
+    resample->out = resample->in;
+    resample->convert = FALSE;
+    resample->phases = 1;
+    resample->step = 1;
+    resample->phase = 0;
+    resample->table_phases = 0;
+    resample->coefficients = NULL;
+    for( c = 0; c < RESAMPLE_MAX_CHANNELS; c++ ) {
+        resample->history[c] = NULL;
+    }
+    resample->history_count = 0;
+    resample->history_allocated = 0;
+}
+
+/*
+ * Make room for some more input frames.
+ */
+static void resample_reserve( resample_t *resample, long frames ) {
+    int c;
+
+    if( resample->history_count + frames <= resample->history_allocated ) {
+        return;
+    }
+
+    resample->history_allocated = (resample->history_count + frames) * 2;
+    for( c = 0; c < resample->out.channels; c++ ) {
+        squash_realloc( resample->history[c], resample->history_allocated * sizeof(short) );
+    }
+}
+
+/*
+ * Prepares to convert from one format to another.  When the formats are
+ * the same as last time the filter carries on where it was, so one song
+ * runs into the next without a click.
+ *
+ * The rate is changed with a polyphase windowed sinc filter: the output
+ * rate is phases / step times the input rate, and each output frame is
+ * made from RESAMPLE_TAPS input frames with one of the phases' set of
+ * coefficients.  An odd rate can need thousands of phases; then the rate
+ * is still followed exactly, but each output frame uses the nearest of
+ * RESAMPLE_MAX_PHASES sets.  The coefficients are 1.15 fixed point, so
+ * the same table serves the SSE2 loop and the integer one the empeg uses.
+ */
+void resample_set_format( resample_t *resample, sound_format_t in, sound_format_t out ) {
+    double taps[ RESAMPLE_TAPS ];
+    double cutoff, d, sum;
+    long a, b, r;
+    int p, t, total, coefficient;
+    short *coefficients;
+
+    if( sound_format_equal(resample->in, in) && sound_format_equal(resample->out, out) ) {
+        return;
+    }
+
+    resample_free( resample );
+    resample->in = in;
+    resample->out = out;
+    resample->convert = !sound_format_equal( in, out );
+    resample->phases = 1;
+    resample->step = 1;
+
+    /* Just changing the channels doesn't need the filter */
+    if( in.rate == out.rate ) {
+        return;
+    }
+
+    /* Reduce the ratio of the rates */
+    a = out.rate;
+    b = in.rate;
+    while( b != 0 ) {
+        r = a % b;
+        a = b;
+        b = r;
+    }
+    resample->phases = out.rate / a;
+    resample->step = in.rate / a;
+    resample->table_phases = resample->phases;
+    if( resample->table_phases > RESAMPLE_MAX_PHASES ) {
+        resample->table_phases = RESAMPLE_MAX_PHASES;
+    }
+
+    /* Cut off a little below the lower of the two Nyquist frequencies
+     * (in cycles per input frame) */
+    cutoff = 0.45;
+    if( resample->phases < resample->step ) {
+        cutoff = cutoff * resample->phases / resample->step;
+    }
+
+    squash_malloc( resample->coefficients, resample->table_phases * RESAMPLE_TAPS * sizeof(short) );
+    for( p = 0; p < resample->table_phases; p++ ) {
+        /* Set p is p / table_phases of a frame past the middle of its taps */
+        sum = 0.0;
+        for( t = 0; t < RESAMPLE_TAPS; t++ ) {
+            d = t - (RESAMPLE_TAPS / 2 - 1) - (double)p / resample->table_phases;
+            if( d == 0.0 ) {
+                taps[t] = 2.0 * cutoff;
+            } else {
+                taps[t] = sin( 2.0 * M_PI * cutoff * d ) / (M_PI * d);
+            }
+            /* Blackman window */
+            taps[t] *= 0.42 + 0.5 * cos( 2.0 * M_PI * d / RESAMPLE_TAPS ) + 0.08 * cos( 4.0 * M_PI * d / RESAMPLE_TAPS );
+            sum += taps[t];
+        }
+
+        coefficients = resample->coefficients + p * RESAMPLE_TAPS;
+        total = 0;
+        for( t = 0; t < RESAMPLE_TAPS; t++ ) {
+            coefficient = (int)floor( taps[t] / sum * 32768.0 + 0.5 );
+            if( coefficient > 32767 ) {
+                coefficient = 32767;
+            } else if( coefficient < -32768 ) {
+                coefficient = -32768;
+            }
+            coefficients[t] = coefficient;
+            total += coefficient;
+        }
+
+        /* Have each phase add up to one, so silence stays silent */
+        t = RESAMPLE_TAPS / 2 - 1 + (2 * p >= resample->table_phases ? 1 : 0);
+        coefficient = coefficients[t] + 32768 - total;
+        coefficients[t] = coefficient > 32767 ? 32767 : coefficient;
+    }
+
+    resample_reset( resample );
+}
+
+/*
+ * Forget the sound waiting in the filter, for after a flush or seek.
+ */
+void resample_reset( resample_t *resample ) {
+    int c;
+    long i;
+
+    resample->history_count = 0;
+    resample->phase = 0;
+    if( resample->phases == resample->step ) {
+        return;
+    }
+
+    /* Start with half the filter's worth of silence so the first output
+     * frame lines up with the first input frame */
+    resample_reserve( resample, RESAMPLE_TAPS / 2 - 1 );
+    for( c = 0; c < resample->out.channels; c++ ) {
+        for( i = 0; i < RESAMPLE_TAPS / 2 - 1; i++ ) {
+            resample->history[c][i] = 0;
+        }
+    }
+    resample->history_count = RESAMPLE_TAPS / 2 - 1;
+}
+
+/*
+ * Returns one channel of an input frame, mapped to the output channels:
+ * mono is spread to every channel, everything is averaged down to mono,
+ * and any channels past the output's are dropped.
+ */
+static short resample_map( resample_t *resample, const short *frame, int channel ) {
+    int c, sum;
+
+    if( resample->out.channels == 1 && resample->in.channels > 1 ) {
+        sum = 0;
+        for( c = 0; c < resample->in.channels; c++ ) {
+            sum += frame[c];
+        }
+        return sum / resample->in.channels;
+    }
+
+    if( channel >= resample->in.channels ) {
+        channel = resample->in.channels - 1;
+    }
+    return frame[ channel ];
+}
+
+/*
+ * Runs one output sample through the filter.
+ */
+static short resample_filter( const short *samples, const short *coefficients ) {
+    int sum;
+#ifdef __SSE2__
+    __m128i total;
+    int i;
+
+    total = _mm_setzero_si128();
+    for( i = 0; i < RESAMPLE_TAPS; i += 8 ) {
+        total = _mm_add_epi32( total, _mm_madd_epi16( _mm_loadu_si128( (const __m128i *)&samples[i] ),
+                    _mm_loadu_si128( (const __m128i *)&coefficients[i] ) ) );
+    }
+    total = _mm_add_epi32( total, _mm_shuffle_epi32( total, _MM_SHUFFLE(1, 0, 3, 2) ) );
+    total = _mm_add_epi32( total, _mm_shuffle_epi32( total, _MM_SHUFFLE(2, 3, 0, 1) ) );
+    sum = _mm_cvtsi128_si32( total );
+#else
+    int i;
+
+    sum = 0;
+    for( i = 0; i < RESAMPLE_TAPS; i++ ) {
+        sum += samples[i] * coefficients[i];
+    }
+#endif
+
+    sum = (sum + 16384) >> 15;
+    if( sum > 32767 ) {
+        return 32767;
+    } else if( sum < -32768 ) {
+        return -32768;
+    }
+    return sum;
+}
+
+/*
+ * Converts a frame to the output format, freeing the original.  Frames
+ * that need no converting are returned as they are.  The filter holds on
+ * to a few frames of sound, so a frame's worth of input doesn't always
+ * give exactly a frame's worth of output.
+ */
+frame_data_t resample_frame( resample_t *resample, frame_data_t frame ) {
+    frame_data_t out_frame;
+    const short *coefficients;
+    const short *in;
+    short *out;
+    long frames, count, position, i;
+    int c;
+
+    if( !resample->convert ) {
+        return frame;
+    }
+
+    in = (const short *)frame.pcm_data;
+    frames = frame.pcm_size / (2 * resample->in.channels);
+    out_frame.position = frame.position;
+
+    if( resample->phases == resample->step ) {
+        /* Only the channels change */
+        count = frames;
+        squash_malloc( out_frame.pcm_data, count * resample->out.channels * 2 + 1 );
+        out = (short *)out_frame.pcm_data;
+        for( i = 0; i < frames; i++ ) {
+            for( c = 0; c < resample->out.channels; c++ ) {
+                out[ i * resample->out.channels + c ] = resample_map( resample, in + i * resample->in.channels, c );
+            }
+        }
+    } else {
+        /* Queue the new frames up behind what the last ones left */
+        resample_reserve( resample, frames );
+        for( c = 0; c < resample->out.channels; c++ ) {
+            for( i = 0; i < frames; i++ ) {
+                resample->history[c][ resample->history_count + i ] = resample_map( resample, in + i * resample->in.channels, c );
+            }
+        }
+        resample->history_count += frames;
+
+        squash_malloc( out_frame.pcm_data,
+                (resample->history_count * resample->phases / resample->step + 2) * resample->out.channels * 2 );
+        out = (short *)out_frame.pcm_data;
+
+        count = 0;
+        position = 0;
+        while( position + RESAMPLE_TAPS <= resample->history_count ) {
+            coefficients = resample->coefficients
+                + resample->phase * resample->table_phases / resample->phases * RESAMPLE_TAPS;
+            for( c = 0; c < resample->out.channels; c++ ) {
+                out[ count * resample->out.channels + c ] = resample_filter( resample->history[c] + position,
+                        coefficients );
+            }
+            count++;
+
+            resample->phase += resample->step;
+            position += resample->phase / resample->phases;
+            resample->phase %= resample->phases;
+        }
+
+        /* Only a huge drop in rate can step past the end; lose the difference */
+        if( position > resample->history_count ) {
+            position = resample->history_count;
+        }
+
+        /* Keep what the next output frames will need */
+        resample->history_count -= position;
+        for( c = 0; c < resample->out.channels; c++ ) {
+            memmove( resample->history[c], resample->history[c] + position, resample->history_count * sizeof(short) );
+        }
+    }
+
+    out_frame.pcm_size = count * resample->out.channels * 2;
+    squash_free( frame.pcm_data );
+
+    return out_frame;
+}
+
+/*
+ * Frees what the resampler allocated.
+ */
+void resample_free( resample_t *resample ) {
+    int c;
+
+    squash_free( resample->coefficients );
+    for( c = 0; c < RESAMPLE_MAX_CHANNELS; c++ ) {
+        squash_free( resample->history[c] );
+    }
+    resample->history_count = 0;
+    resample->history_allocated = 0;
+}
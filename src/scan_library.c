@@ -0,0 +1,305 @@
+/*
+ * Copyright 2003 by Adam Luter
+ * This file is part of Squash, a C/Ncurses-based unix music player.
+ *
+ * Squash is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Squash is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Squash; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+/*
+ *scan_library.c
+ */
+
+/*
+ * This is a stand-alone utility for squash users.  It decodes every song
+ * in the database on every processor, throwing the sound away, to find
+ * files that are truncated or corrupt before they are copied to a
+ * portable device.  Each song's decoding errors, how long it really is
+ * and how fast it decoded are saved in its ".stat" file, and a song that
+ * can't be decoded is quarantined.  Songs already scanned are skipped
+ * unless their file has changed, so a scan can be stopped and carried on
+ * later.  Problems are printed, one song per line.  Don't run it while
+ * squash is running, as both would write the ".stat" files.
+ */
+
+#include "global.h"
+#include "stat.h"
+#include "database.h"
+#include "decoder.h"
+#include <sys/time.h>   /* for gettimeofday() */
+
+/* How far, in milliseconds, a song may be from its tagged length before
+ * it is reported */
+#define SCAN_LENGTH_SLACK 1000
+
+/* to satisfy database wanting to update the display */
+void draw_info() {
+}
+
+/* Shared by the scanner threads */
+static struct {
+    pthread_mutex_t lock;
+    int cursor;                 /* next song to scan */
+    int scanned;
+    int failed;
+    int damaged;                /* decoded, but with errors */
+    int mismatched;             /* decoded, but not to the tagged length */
+    long long bytes;
+    struct timeval io_ready;    /* when the next song may be read */
+} scan_info = { PTHREAD_MUTEX_INITIALIZER, 0, 0, 0, 0, 0, 0, { 0, 0 } };
+
+/*
+ * Holds a scanner back so that together they read no more than
+ * [Scanner] IO_Rate kilobytes a second.  A song's whole file is booked
+ * against the rate before it is decoded, so it averages out over a scan.
+ */
+static void scan_throttle( off_t size ) {
+    struct timeval now, start;
+    struct timespec wait_time;
+    long long usec;
+
+    if( config.scanner_io_rate <= 0 ) {
+        return;
+    }
+
+    usec = (long long)size * 1000000 / ((long long)config.scanner_io_rate * 1024);
+
+    squash_lock( scan_info.lock );
+    gettimeofday( &now, NULL );
+    if( timercmp(&scan_info.io_ready, &now, <) ) {
+        scan_info.io_ready = now;
+    }
+    start = scan_info.io_ready;
+    scan_info.io_ready.tv_sec += usec / 1000000;
+    scan_info.io_ready.tv_usec += usec % 1000000;
+    if( scan_info.io_ready.tv_usec >= 1000000 ) {
+        scan_info.io_ready.tv_sec++;
+        scan_info.io_ready.tv_usec -= 1000000;
+    }
+    squash_unlock( scan_info.lock );
+
+    if( timercmp(&start, &now, >) ) {
+        usec = (long long)(start.tv_sec - now.tv_sec) * 1000000 + (start.tv_usec - now.tv_usec);
+        wait_time.tv_sec = usec / 1000000;
+        wait_time.tv_nsec = (usec % 1000000) * 1000;
+        nanosleep( &wait_time, NULL );
+    }
+}
+
+/*
+ * How long the song claims to be in its "duration" or "length" tag, in
+ * milliseconds, or -1 if it has neither.  The meta data is let go again
+ * afterwards, so a big library doesn't end up all in memory.  Expects the
+ * database write lock.
+ */
+static long tagged_length( song_info_t *song ) {
+    meta_key_t *meta_length;
+    long length;
+    bool loaded, changed;
+
+    loaded = song->meta_key_count == -1;
+    if( loaded ) {
+        load_meta_data( song, TYPE_META );
+    }
+
+    /* empeg's metainfo files use duration instead of length */
+    length = -1;
+    meta_length = get_meta_data( song, "duration" );
+    if( meta_length == NULL ) {
+        meta_length = get_meta_data( song, "length" );
+    }
+    if( meta_length != NULL && meta_length->value_count != 0 ) {
+        length = atol( meta_length->values[0] );
+    }
+
+    if( loaded ) {
+        changed = song->stat.changed;
+        clear_song_meta( song );
+        song->meta_key_count = -1;
+        song->stat.changed = changed;
+    }
+
+    return length;
+}
+
+/*
+ * How long the song claims to be going by its headers, in milliseconds,
+ * or -1 if it can't be opened or doesn't say.  Only FLAC's STREAMINFO and
+ * WAV's data chunk are written before the sound and read without going
+ * through it; an MP3's or an Ogg's length comes from its frames, which a
+ * truncated file is just as short of.
+ */
+static long header_length( enum song_type_e type, char *filename ) {
+    sound_format_t sound_format;
+    void *decoder_data;
+    long length;
+
+    if( type != TYPE_FLAC && type != TYPE_WAV ) {
+        return -1;
+    }
+    if( (decoder_data = song_functions[ type ].open(filename, &sound_format)) == NULL ) {
+        return -1;
+    }
+    length = song_functions[ type ].calc_duration( decoder_data );
+    song_functions[ type ].close( decoder_data );
+
+    return length;
+}
+
+/*
+ * Thread start function.  Takes songs from the database one at a time
+ * and decodes each from start to finish.
+ */
+void *scanner( void *input_data ) {
+    song_info_t *song;
+    enum song_type_e type;
+    struct stat song_stat;
+    struct timeval start;
+    char *filename;
+    long tagged, length, usec;
+    int index, errors;
+    bool failed, scanned;
+
+    while( 1 ) {
+        squash_lock( scan_info.lock );
+        index = scan_info.cursor++;
+        squash_unlock( scan_info.lock );
+        if( index >= database_info.song_count ) {
+            break;
+        }
+
+        song = &database_info.songs[ index ];
+        filename = build_fullfilename( song, BASENAME_SONG );
+        if( stat(filename, &song_stat) != 0 ) {
+            printf( "%s\tmissing\n", filename );
+            squash_free( filename );
+            continue;
+        }
+
+        /* Skip it if this file was already scanned */
+        squash_wlock( database_info.lock );
+        scanned = song->stat.scan_size == song_stat.st_size && song->stat.scan_mtime == (long)song_stat.st_mtime;
+        if( song->song_type == -1 ) {
+            song->song_type = get_song_type( song->basename[ BASENAME_SONG ], song->filename );
+        }
+        type = song->song_type;
+        tagged = -1;
+        if( !scanned && type != TYPE_UNKNOWN ) {
+            tagged = tagged_length( song );
+        }
+        squash_wunlock( database_info.lock );
+        if( scanned || type == TYPE_UNKNOWN ) {
+            squash_free( filename );
+            continue;
+        }
+
+        scan_throttle( song_stat.st_size );
+        if( tagged == -1 ) {
+            tagged = header_length( type, filename );
+        }
+
+        /* Decode the whole song into nowhere */
+        gettimeofday( &start, NULL );
+        failed = !decoder_scan( type, filename, &length, &errors, NULL );
+        usec = squash_elapsed_usec( &start );
+
+        /* Save what was found */
+        squash_wlock( database_info.lock );
+        song->stat.scan_size = song_stat.st_size;
+        song->stat.scan_mtime = (long)song_stat.st_mtime;
+        song->stat.scan_length = length;
+        song->stat.scan_errors = errors;
+        song->stat.scan_failed = failed;
+        song->stat.scan_speed = usec > 0 ? (double)length * 1000.0 / usec : 0.0;
+        song->stat.changed = TRUE;
+        if( failed ) {
+            quarantine_song( song );
+        }
+        save_song( song );
+        squash_wunlock( database_info.lock );
+
+        squash_lock( scan_info.lock );
+        scan_info.scanned++;
+        scan_info.bytes += song_stat.st_size;
+        if( failed ) {
+            scan_info.failed++;
+            printf( "%s\tfailed after %ld ms, %d errors\n", filename, length, errors );
+        } else if( errors > 0 ) {
+            scan_info.damaged++;
+            printf( "%s\t%d errors\n", filename, errors );
+        }
+        if( !failed && tagged != -1 && labs(length - tagged) > SCAN_LENGTH_SLACK ) {
+            scan_info.mismatched++;
+            printf( "%s\tdecoded %ld ms, tagged %ld ms\n", filename, length, tagged );
+        }
+        fflush( stdout );
+        squash_unlock( scan_info.lock );
+
+        squash_free( filename );
+    }
+
+    return (void *)NULL;
+}
+
+/* Takes an optional argument, the number of songs to decode at once. */
+
+int main( int argc, char *argv[] ) {
+    pthread_t *threads;
+    struct timeval start, end;
+    int thread_count;
+    int i;
+
+    fprintf(stderr, "Loading configuration...\n");
+    init_config();
+
+    thread_count = config.scanner_threads;
+    if( argc >= 2 ) {
+        thread_count = atoi( argv[1] );
+    }
+    if( thread_count <= 0 ) {
+        thread_count = sysconf( _SC_NPROCESSORS_ONLN );
+    }
+    if( thread_count <= 0 ) {
+        thread_count = 1;
+    }
+
+    fprintf(stderr, "Loading filenames...\n");
+    load_db_filenames();
+
+    fprintf(stderr, "Loading statistics...\n");
+    load_all_meta_data( TYPE_STAT );
+
+    /* Lets quarantined songs whose files changed back in, and allows
+     * save_song() to write statistics */
+    start_song_picker();
+
+    fprintf(stderr, "Scanning %d songs on %d threads...\n", database_info.song_count, thread_count);
+    gettimeofday( &start, NULL );
+    squash_malloc( threads, thread_count * sizeof(pthread_t) );
+    for( i = 0; i < thread_count; i++ ) {
+        if( pthread_create(&threads[i], NULL, scanner, NULL) ) {
+            squash_error( "Unable to create scanner thread" );
+        }
+    }
+    for( i = 0; i < thread_count; i++ ) {
+        pthread_join( threads[i], NULL );
+    }
+    squash_free( threads );
+
+    gettimeofday( &end, NULL );
+    fprintf(stderr, "Scanned %d songs (%lld MB) in %ld seconds: %d failed, %d with errors, %d with the wrong length\n",
+            scan_info.scanned, scan_info.bytes / (1024 * 1024), (long)(end.tv_sec - start.tv_sec),
+            scan_info.failed, scan_info.damaged, scan_info.mismatched);
+
+    return 0;
+}
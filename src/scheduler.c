@@ -0,0 +1,154 @@
+/*
+ * Copyright 2003 by Adam Luter
+ * This file is part of Squash, a C/Ncurses-based unix music player.
+ *
+ * Squash is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Squash is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Squash; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+/*
+ * scheduler.c
+ */
+
+/*
+ * Decides when library upkeep may run.  Each kind of background job
+ * (loading songs, analyzing them, filling the PCM cache and scanning
+ * them for damage) keeps its own threads, but they all run at the lowest
+ * priority there is, rest between units of work for as long as their
+ * job type's throttle says, and wake up together with the frame
+ * decoder's bursts.  While a song is
+ * playing and the frame buffer is running low they stop where they are,
+ * so upkeep never takes time that playback needs.
+ */
+
+#include "global.h"
+#include <sched.h>          /* for SCHED_IDLE, SCHED_OTHER */
+#include <sys/resource.h>   /* for setpriority() */
+#include "scheduler.h"
+
+/*
+ * How long, in milliseconds, a job of each type rests between units.
+ */
+static long scheduler_rest( enum job_type_e type ) {
+    switch( type ) {
+        case JOB_LOAD:
+            return config.scheduler_load_rest;
+        case JOB_ANALYZE:
+            return config.analyzer_rest;
+        case JOB_CACHE:
+            return config.cache_rest;
+        case JOB_SCAN:
+            return config.scanner_rest;
+    }
+
+    return 0;
+}
+
+/*
+ * Returns TRUE if a song is playing and the frame buffer holds less than
+ * [Scheduler] Pause_Buffer milliseconds of it.
+ */
+static bool scheduler_buffer_low( void ) {
+    enum player_state_e state;
+    bool low;
+
+    if( config.scheduler_pause_buffer <= 0 ) {
+        return FALSE;
+    }
+
+    squash_lock( player_info.lock );
+    state = player_info.state;
+    squash_unlock( player_info.lock );
+    if( state != STATE_PLAY ) {
+        return FALSE;
+    }
+
+    squash_lock( frame_buffer.lock );
+    low = frame_buffer.bytes_per_second > 0
+       && (long long)frame_buffer.pcm_size * 1000 < (long long)config.scheduler_pause_buffer * frame_buffer.bytes_per_second;
+    squash_unlock( frame_buffer.lock );
+
+    return low;
+}
+
+/*
+ * Puts the calling thread below everything else.  Linux runs a
+ * SCHED_IDLE thread only when nothing else wants the processor, and
+ * older kernels get the lowest nice value instead.  On the empeg every
+ * thread is started SCHED_FIFO (see main()), and even the lowest real
+ * time priority would starve the ordinary processes, so jobs drop back
+ * to SCHED_OTHER first.
+ */
+void scheduler_idle_priority( void ) {
+    struct sched_param sched_param;
+
+    sched_param.sched_priority = 0;
+#ifdef SCHED_IDLE
+    if( pthread_setschedparam(pthread_self(), SCHED_IDLE, &sched_param) == 0 ) {
+        return;
+    }
+#endif
+    pthread_setschedparam( pthread_self(), SCHED_OTHER, &sched_param );
+
+    /* Linux renices just this thread */
+    setpriority( PRIO_PROCESS, 0, 19 );
+}
+
+/*
+ * Holds a job back while the frame buffer is running low.  Jobs call
+ * this between units of work and every so often within them, holding no
+ * locks.  Once squash is quitting the frame buffer is never filled
+ * again, so jobs are let go to finish.
+ */
+void scheduler_pause( void ) {
+    struct timespec wait_time = { 0, SCHEDULER_PAUSE_CHECK * 1000000 };
+    struct timeval start;
+    bool paused = FALSE;
+
+    while( scheduler_buffer_low() && !squash_quitting() ) {
+        if( !paused ) {
+            gettimeofday( &start, NULL );
+            paused = TRUE;
+        }
+        nanosleep( &wait_time, NULL );
+    }
+
+    if( paused ) {
+        squash_lock( scheduler_info.lock );
+        scheduler_info.pauses++;
+        scheduler_info.paused_seconds += squash_elapsed_usec( &start ) / 1000000.0;
+        squash_unlock( scheduler_info.lock );
+    }
+}
+
+/*
+ * Called by a job after each unit of work.  Counts it, rests for the
+ * job type's throttle (waking with the frame decoder's next burst), and
+ * then waits until the frame buffer is healthy.
+ */
+void scheduler_next( enum job_type_e type ) {
+    squash_lock( scheduler_info.lock );
+    scheduler_info.done[ type ]++;
+    squash_unlock( scheduler_info.lock );
+
+    squash_coalesced_sleep( scheduler_rest(type), SCHEDULER_REST_SLACK );
+    scheduler_pause();
+}
+
+/*
+ * Called by a job that has nothing to do right now.
+ */
+void scheduler_idle( void ) {
+    squash_coalesced_sleep( SCHEDULER_IDLE_TIME, SCHEDULER_IDLE_SLACK );
+    scheduler_pause();
+}
@@ -21,6 +21,12 @@
  */
 
 #include "global.h"
+#ifdef ALSA
+#include "sound_alsa.h" /* for alsa_*() */
+#endif
+#ifndef EMPEG_DSP
+#include "sound_pipe.h" /* for pipe_*() */
+#endif
 #include "sound.h"
 
 #ifdef EMPEG_DSP
@@ -39,6 +45,27 @@
 #define EMPEG_MIXER_WRITE_FLAGS _IOW(EMPEG_MIXER_MAGIC, 1, int)
 #define EMPEG_MIXER_SET_SAM _IOW(EMPEG_MIXER_MAGIC, 15, int)
 
+#else
+/*
+ * Define the sound drivers, selected with the [Sound] Driver setting
+ */
+sound_driver_t sound_drivers[] = {
+    { "ao", sound_ao_open, sound_ao_play, NULL, NULL, sound_ao_close },
+    { "pipe", pipe_open, pipe_play, NULL, pipe_delay, pipe_close },
+    { "null", sound_null_open, sound_null_play, sound_null_flush, sound_null_delay, sound_null_close },
+    { "wav", sound_wav_open, sound_wav_play, NULL, NULL, sound_wav_close }
+#ifdef ALSA
+    , { "alsa", alsa_open, alsa_play, alsa_flush, alsa_delay, alsa_close }
+#endif
+};
+int sound_driver_count = sizeof(sound_drivers) / sizeof(sound_drivers[0]);
+
+/*
+ * The null and wav drivers keep going from song to song, so their state
+ * outlives any one device
+ */
+static null_output_t null_output;
+static wav_output_t wav_output = { -1 };
 #endif
 
 /*
@@ -51,12 +78,37 @@ void sound_init( void ) {
 #endif
 }
 
+#ifndef EMPEG_DSP
 /*
- * Open an instance of the sound device.
- * An instance can play sound and multiple, but
- * different instances used at once will mix.
+ * Find a driver by name, or NULL if there is no such driver
  */
-sound_device_t *sound_open( sound_format_t format ) {
+sound_driver_t *sound_find_driver( char *name ) {
+    int i;
+
+    for( i = 0; i < sound_driver_count; i++ ) {
+        if( strcasecmp(sound_drivers[i].name, name) == 0 ) {
+            return &sound_drivers[i];
+        }
+    }
+
+    return NULL;
+}
+#endif
+
+/*
+ * Returns TRUE if two formats are the same
+ */
+bool sound_format_equal( sound_format_t a, sound_format_t b ) {
+    return a.rate == b.rate && a.channels == b.channels
+        && a.bits == b.bits && a.byte_format == b.byte_format;
+}
+
+/*
+ * Open an instance of the sound device, using the named driver (the
+ * empeg only has the one).  An instance can play sound and multiple,
+ * but different instances used at once will mix.
+ */
+sound_device_t *sound_open( char *driver_name, sound_format_t format ) {
 #ifdef EMPEG_DSP
     sound_device_t *t;
     int i;
@@ -96,11 +148,25 @@ sound_device_t *sound_open( sound_format_t format ) {
 
     return t;
 #else
-    int default_driver;
+    sound_device_t *device;
+    sound_driver_t *driver;
+    void *data;
 
-    default_driver = ao_default_driver_id();
+    if( (driver = sound_find_driver( driver_name )) == NULL ) {
+        squash_log( "Unknown sound driver \"%s\"", driver_name );
+        return NULL;
+    }
 
-    return ao_open_live( default_driver, &format, NULL );
+    if( (data = driver->open( format )) == NULL ) {
+        return NULL;
+    }
+
+    squash_malloc( device, sizeof(sound_device_t) );
+    device->driver = driver;
+    device->data = data;
+    device->format = format;
+
+    return device;
 #endif
 }
 
@@ -174,7 +240,42 @@ void sound_play( frame_data_t frame_data, sound_device_t *sound_device ) {
         }
     }
 #else
-    ao_play( sound_device, frame_data.pcm_data, frame_data.pcm_size );
+    sound_device->driver->play( sound_device->data, frame_data );
+#endif
+}
+
+/*
+ * Throw away any sound that has not been handed to the device yet.
+ * (libao has no way to drop what it has already accepted.)
+ */
+void sound_flush( sound_device_t *device ) {
+    if( device == NULL ) {
+        return;
+    }
+#ifdef EMPEG_DSP
+    device->buffer_size = 0;
+#else
+    if( device->driver->flush != NULL ) {
+        device->driver->flush( device->data );
+    }
+#endif
+}
+
+/*
+ * How many milliseconds of sound the device has been given but not yet
+ * played, or -1 if the driver can't tell.
+ */
+long sound_delay( sound_device_t *device ) {
+    if( device == NULL ) {
+        return -1;
+    }
+#ifdef EMPEG_DSP
+    return -1;
+#else
+    if( device->driver->delay == NULL ) {
+        return -1;
+    }
+    return device->driver->delay( device->data );
 #endif
 }
 
@@ -202,7 +303,8 @@ void sound_close( sound_device_t *device ) {
     squash_free( device->buffer );
     squash_free( device );
 #else
-    ao_close( device );
+    device->driver->close( device->data );
+    squash_free( device );
 #endif
 }
 
@@ -215,3 +317,599 @@ void sound_shutdown( void ) {
     ao_shutdown();
 #endif
 }
+
+#ifndef EMPEG_DSP
+/*
+ * The libao driver
+ */
+void *sound_ao_open( sound_format_t format ) {
+    return ao_open_live( ao_default_driver_id(), &format, NULL );
+}
+
+void sound_ao_play( void *data, frame_data_t frame_data ) {
+    ao_play( (ao_device *)data, frame_data.pcm_data, frame_data.pcm_size );
+}
+
+void sound_ao_close( void *data ) {
+    ao_close( (ao_device *)data );
+}
+
+/*
+ * The null driver throws the sound away, either as fast as it arrives or
+ * (with Null_Paced) at the speed a sound card would play it, so the rest
+ * of squash behaves as it does with real hardware.
+ */
+void *sound_null_open( sound_format_t format ) {
+    null_output.bytes_per_second = format.rate * format.channels * format.bits / 8;
+
+    return (void *)&null_output;
+}
+
+void sound_null_play( void *data, frame_data_t frame_data ) {
+    null_output_t *output = (null_output_t *)data;
+    struct timespec sleep_time;
+    long ahead;
+
+    if( !config.sound_null_paced ) {
+        return;
+    }
+
+    /* Start the clock over if we have fallen behind it, like an underrun */
+    ahead = sound_null_delay( data );
+    if( ahead <= 0 ) {
+        gettimeofday( &output->clock_start, NULL );
+        output->clock_seconds = 0;
+        ahead = 0;
+    }
+    output->clock_seconds += (double)frame_data.pcm_size / output->bytes_per_second;
+
+    /* Act like a sound card with a buffer of NULL_BUFFER_TIME */
+    if( ahead > NULL_BUFFER_TIME ) {
+        ahead -= NULL_BUFFER_TIME;
+        sleep_time.tv_sec = ahead / 1000;
+        sleep_time.tv_nsec = (ahead % 1000) * 1000000;
+        nanosleep( &sleep_time, NULL );
+    }
+}
+
+void sound_null_flush( void *data ) {
+    null_output_t *output = (null_output_t *)data;
+
+    output->clock_seconds = 0;
+}
+
+long sound_null_delay( void *data ) {
+    null_output_t *output = (null_output_t *)data;
+    long delay;
+
+    if( !config.sound_null_paced ) {
+        return 0;
+    }
+    delay = (long)(output->clock_seconds * 1000) - squash_elapsed_usec( &output->clock_start ) / 1000;
+
+    return delay > 0 ? delay : 0;
+}
+
+void sound_null_close( void *data ) {
+}
+
+/*
+ * The wav driver writes everything played into WAV_File.  The file stays
+ * open from song to song, and its header is brought up to date at the end
+ * of each song so the file is always complete.  A song in a different
+ * format, or more sound than a WAV file can hold, starts a new file,
+ * numbered before the extension.  sound_wav_start() opens the next file
+ * for output->format and writes its header.
+ */
+bool sound_wav_start( wav_output_t *output ) {
+    sound_format_t format = output->format;
+    char *filename, *extension;
+    unsigned char header[ WAV_HEADER_SIZE ];
+
+    if( output->file_count == 0 ) {
+        filename = strdup( config.sound_wav_file );
+    } else if( (extension = strrchr( config.sound_wav_file, '.' )) != NULL
+            && strchr( extension, '/' ) == NULL ) {
+        squash_asprintf( filename, "%.*s-%d%s", (int)(extension - config.sound_wav_file),
+                config.sound_wav_file, output->file_count, extension );
+    } else {
+        squash_asprintf( filename, "%s-%d", config.sound_wav_file, output->file_count );
+    }
+
+    if( (output->fd = open( filename, O_WRONLY | O_CREAT | O_TRUNC, 0666 )) == -1 ) {
+        squash_log( "Can't open wav file \"%s\": %s", filename, strerror(errno) );
+        squash_free( filename );
+        return FALSE;
+    }
+    squash_log( "Writing sound to \"%s\"", filename );
+    squash_free( filename );
+
+    output->data_size = 0;
+
+    /* The sizes are filled in by sound_wav_close() */
+    memcpy( header, "RIFF", 4 );
+    sound_put_le( header + 4, 36, 4 );
+    memcpy( header + 8, "WAVEfmt ", 8 );
+    sound_put_le( header + 16, 16, 4 );
+    sound_put_le( header + 20, 1, 2 ); /* PCM */
+    sound_put_le( header + 22, format.channels, 2 );
+    sound_put_le( header + 24, format.rate, 4 );
+    sound_put_le( header + 28, format.rate * format.channels * format.bits / 8, 4 );
+    sound_put_le( header + 32, format.channels * format.bits / 8, 2 );
+    sound_put_le( header + 34, format.bits, 2 );
+    memcpy( header + 36, "data", 4 );
+    sound_put_le( header + 40, 0, 4 );
+    sound_wav_write( output, (char *)header, WAV_HEADER_SIZE );
+
+    return TRUE;
+}
+
+void *sound_wav_open( sound_format_t format ) {
+    wav_output_t *output = &wav_output;
+
+    if( output->fd != -1
+            && output->format.rate == format.rate
+            && output->format.channels == format.channels
+            && output->format.bits == format.bits ) {
+        return (void *)output;
+    }
+
+    if( output->fd != -1 ) {
+        close( output->fd );
+        output->file_count++;
+    }
+
+    output->format = format;
+    if( !sound_wav_start( output ) ) {
+        return NULL;
+    }
+
+    return (void *)output;
+}
+
+void sound_wav_play( void *data, frame_data_t frame_data ) {
+    wav_output_t *output = (wav_output_t *)data;
+
+    /* Carry on in the next file before the header's sizes overflow */
+    if( output->data_size + frame_data.pcm_size > WAV_MAX_DATA_SIZE ) {
+        sound_wav_close( output );
+        close( output->fd );
+        output->file_count++;
+        if( !sound_wav_start( output ) ) {
+            squash_error( "Problem starting the next wav file" );
+        }
+    }
+
+    sound_wav_write( output, frame_data.pcm_data, frame_data.pcm_size );
+    output->data_size += frame_data.pcm_size;
+}
+
+void sound_wav_close( void *data ) {
+    wav_output_t *output = (wav_output_t *)data;
+    unsigned char size[4];
+
+    sound_put_le( size, output->data_size + 36, 4 );
+    if( pwrite( output->fd, size, 4, 4 ) != 4 ) {
+        squash_error( "Problem writing to wav file: %s", strerror(errno) );
+    }
+    sound_put_le( size, output->data_size, 4 );
+    if( pwrite( output->fd, size, 4, 40 ) != 4 ) {
+        squash_error( "Problem writing to wav file: %s", strerror(errno) );
+    }
+}
+
+void sound_wav_write( wav_output_t *output, char *buffer, int size ) {
+    ssize_t written;
+
+    while( size > 0 ) {
+        if( (written = write( output->fd, buffer, size )) == -1 ) {
+            if( errno == EINTR ) {
+                continue;
+            }
+            squash_error( "Problem writing to wav file: %s", strerror(errno) );
+        }
+        buffer += written;
+        size -= written;
+    }
+}
+
+/*
+ * Write a little endian number, for file headers
+ */
+void sound_put_le( unsigned char *buffer, unsigned long value, int bytes ) {
+    int i;
+
+    for( i = 0; i < bytes; i++ ) {
+        buffer[i] = (value >> (i * 8)) & 0xFF;
+    }
+}
+#endif
+
+/*
+ * Set up the sinks from the [Sound] Driver setting, a comma separated list
+ * of drivers each optionally followed by ":block" (the default) or
+ * ":drop".  A blocking sink holds up the player while it is behind, a
+ * dropping one just misses frames, so a slow pipe or file can't stall
+ * the sound card.
+ */
+void sound_queue_init( void ) {
+    output_sink_t *sink;
+#ifndef EMPEG_DSP
+    char *list, *entry, *policy, *save_ptr;
+#endif
+
+    output_queue.sink_count = 0;
+    output_queue.writing = 0;
+    output_queue.paused = FALSE;
+    output_queue.interrupted = FALSE;
+    output_queue.silence_pending = FALSE;
+    output_queue.drop_pending = FALSE;
+    output_queue.silence_count = 0;
+    output_queue.silence_latency_sum = 0;
+    output_queue.silence_latency_max = 0;
+
+#ifdef EMPEG_DSP
+    sink = &output_queue.sinks[ output_queue.sink_count++ ];
+    sink->driver = NULL;
+    sink->drop = FALSE;
+    sink->start = 0;
+    sink->size = 0;
+    sink->device = NULL;
+    sink->writing = FALSE;
+    sink->dropped = 0;
+    sink->write_count = 0;
+    sink->write_usec_sum = 0;
+    sink->write_usec_max = 0;
+#else
+    list = strdup( config.sound_driver );
+    for( entry = strtok_r( list, ",", &save_ptr ); entry != NULL; entry = strtok_r( NULL, ",", &save_ptr ) ) {
+        while( *entry == ' ' ) {
+            entry++;
+        }
+        if( output_queue.sink_count == OUTPUT_MAX_SINKS ) {
+            squash_error( "No more than %d sound drivers may be used at once", OUTPUT_MAX_SINKS );
+        }
+        sink = &output_queue.sinks[ output_queue.sink_count++ ];
+        sink->drop = FALSE;
+        if( (policy = strchr( entry, ':' )) != NULL ) {
+            *policy++ = '\0';
+            if( strcasecmp( policy, "drop" ) == 0 ) {
+                sink->drop = TRUE;
+            } else if( strcasecmp( policy, "block" ) != 0 ) {
+                squash_error( "Unknown sound driver policy \"%s\"", policy );
+            }
+        }
+        if( sound_find_driver( entry ) == NULL ) {
+            squash_error( "Unknown sound driver \"%s\"", entry );
+        }
+        sink->driver = strdup( entry );
+        sink->start = 0;
+        sink->size = 0;
+        sink->device = NULL;
+        sink->writing = FALSE;
+        sink->dropped = 0;
+        sink->write_count = 0;
+        sink->write_usec_sum = 0;
+        sink->write_usec_max = 0;
+    }
+    squash_free( list );
+    if( output_queue.sink_count == 0 ) {
+        squash_error( "No sound driver given" );
+    }
+#endif
+}
+
+/*
+ * Drop a sink's hold on a frame.  The output_queue lock must be held.
+ */
+void sound_queue_release( output_frame_t *output_frame ) {
+    if( --output_frame->references == 0 ) {
+        squash_free( output_frame->frame.pcm_data );
+        squash_free( output_frame );
+    }
+}
+
+/*
+ * Output thread, one per sink (passed in input_data).  Plays the frames
+ * handed over by sound_queue_frame(), so that the player never blocks
+ * inside a sound device and can act on commands right away.
+ */
+void *sound_output( void *input_data ) {
+    output_sink_t *sink = (output_sink_t *)input_data;
+    output_frame_t *output_frame;
+    sound_device_t *device;
+    struct timeval write_start;
+    long write_time;
+
+    while( 1 ) {
+        squash_lock( output_queue.lock );
+        while( sink->size == 0 || output_queue.paused ) {
+            squash_wait( output_queue.not_empty, output_queue.lock );
+        }
+        output_frame = sink->frames[ sink->start ];
+        sink->start = (sink->start + 1) % OUTPUT_QUEUE_SIZE;
+        sink->size--;
+        device = sink->device;
+        sink->writing = TRUE;
+        output_queue.writing++;
+        squash_broadcast( output_queue.not_full );
+        squash_unlock( output_queue.lock );
+
+        /* Sinks only ever read the frame, so they share it unlocked */
+        write_time = -1;
+        if( device != NULL ) {
+            gettimeofday( &write_start, NULL );
+            sound_play( output_frame->frame, device );
+            write_time = squash_elapsed_usec( &write_start );
+        }
+
+        squash_lock( output_queue.lock );
+        if( write_time != -1 ) {
+            sink->write_count++;
+            sink->write_usec_sum += write_time;
+            if( write_time > sink->write_usec_max ) {
+                sink->write_usec_max = write_time;
+            }
+        }
+        sound_queue_release( output_frame );
+        sink->writing = FALSE;
+        output_queue.writing--;
+        if( output_queue.silence_pending && output_queue.writing == 0 ) {
+            sound_queue_silenced();
+        }
+        squash_broadcast( output_queue.idle );
+        squash_unlock( output_queue.lock );
+    }
+
+    return (void *)NULL;
+}
+
+/*
+ * Waits until every blocking sink has room for another frame, so that
+ * sound_queue_frame() won't hold up the player.  Returns FALSE early if
+ * a command has come in, for the player to see to first; otherwise it
+ * would only get to it once the output thread had started on the next
+ * frame, and a skip or pause would wait for that whole write too.
+ */
+bool sound_queue_wait( void ) {
+    output_sink_t *sink;
+    bool full;
+    bool room;
+    int i;
+
+    squash_lock( output_queue.lock );
+    do {
+        full = FALSE;
+        for( i = 0; i < output_queue.sink_count; i++ ) {
+            sink = &output_queue.sinks[i];
+            if( !sink->drop && sink->device != NULL && sink->size >= OUTPUT_QUEUE_SIZE ) {
+                full = TRUE;
+            }
+        }
+        if( full && !output_queue.interrupted ) {
+            squash_wait( output_queue.not_full, output_queue.lock );
+        }
+    } while( full && !output_queue.interrupted );
+    room = !output_queue.interrupted;
+    output_queue.interrupted = FALSE;
+    squash_unlock( output_queue.lock );
+
+    return room;
+}
+
+/*
+ * Lets the player out of sound_queue_wait() to read a new command.
+ */
+void sound_queue_interrupt( void ) {
+    squash_lock( output_queue.lock );
+    output_queue.interrupted = TRUE;
+    squash_broadcast( output_queue.not_full );
+    squash_unlock( output_queue.lock );
+}
+
+/*
+ * Hands a frame to every open sink, waiting while a blocking sink is full.
+ * The frame's pcm_data is freed once the last sink has played it.
+ */
+void sound_queue_frame( frame_data_t frame_data ) {
+    output_frame_t *output_frame;
+    output_sink_t *sink;
+    bool full;
+    int i;
+
+    squash_malloc( output_frame, sizeof(output_frame_t) );
+    output_frame->frame = frame_data;
+    output_frame->references = 1; /* ours, until it has been handed out */
+
+    squash_lock( output_queue.lock );
+    do {
+        full = FALSE;
+        for( i = 0; i < output_queue.sink_count; i++ ) {
+            sink = &output_queue.sinks[i];
+            if( !sink->drop && sink->device != NULL && sink->size >= OUTPUT_QUEUE_SIZE ) {
+                full = TRUE;
+                squash_wait( output_queue.not_full, output_queue.lock );
+                break;
+            }
+        }
+    } while( full );
+
+    for( i = 0; i < output_queue.sink_count; i++ ) {
+        sink = &output_queue.sinks[i];
+        if( sink->device == NULL ) {
+            continue;
+        }
+        if( sink->size >= OUTPUT_QUEUE_SIZE ) {
+            sink->dropped++;
+            continue;
+        }
+        sink->frames[ (sink->start + sink->size) % OUTPUT_QUEUE_SIZE ] = output_frame;
+        sink->size++;
+        output_frame->references++;
+    }
+    sound_queue_release( output_frame );
+    squash_broadcast( output_queue.not_empty );
+    squash_unlock( output_queue.lock );
+}
+
+/*
+ * Throws away everything waiting to be played (used by skip and stop).
+ * requested is when the command was queued, to measure how long it takes
+ * for the sound to actually stop.
+ */
+void sound_queue_flush( struct timeval *requested ) {
+    output_sink_t *sink;
+    int i;
+
+    squash_lock( output_queue.lock );
+    for( i = 0; i < output_queue.sink_count; i++ ) {
+        sink = &output_queue.sinks[i];
+        while( sink->size > 0 ) {
+            sound_queue_release( sink->frames[ sink->start ] );
+            sink->start = (sink->start + 1) % OUTPUT_QUEUE_SIZE;
+            sink->size--;
+        }
+    }
+    output_queue.silence_requested = *requested;
+    output_queue.silence_pending = TRUE;
+    output_queue.drop_pending = TRUE;
+    if( output_queue.writing == 0 ) {
+        sound_queue_silenced();
+    }
+    squash_broadcast( output_queue.not_full );
+    squash_broadcast( output_queue.idle );
+    squash_unlock( output_queue.lock );
+}
+
+/*
+ * Stops or restarts the output threads, leaving the waiting frames alone
+ * so nothing is lost on resume.
+ */
+void sound_queue_pause( bool paused, struct timeval *requested ) {
+    squash_lock( output_queue.lock );
+    output_queue.paused = paused;
+    if( paused ) {
+        output_queue.silence_requested = *requested;
+        output_queue.silence_pending = TRUE;
+        if( output_queue.writing == 0 ) {
+            sound_queue_silenced();
+        }
+    } else {
+        squash_broadcast( output_queue.not_empty );
+    }
+    squash_unlock( output_queue.lock );
+}
+
+/*
+ * Waits until everything queued has been played.
+ */
+void sound_queue_drain( void ) {
+    bool waiting;
+    int i;
+
+    squash_lock( output_queue.lock );
+    do {
+        waiting = output_queue.writing > 0;
+        for( i = 0; i < output_queue.sink_count && !output_queue.paused; i++ ) {
+            if( output_queue.sinks[i].size > 0 ) {
+                waiting = TRUE;
+            }
+        }
+        if( waiting ) {
+            squash_wait( output_queue.idle, output_queue.lock );
+        }
+    } while( waiting );
+    squash_unlock( output_queue.lock );
+}
+
+/*
+ * Opens every sink's device for a new song.  A sink that won't open sits
+ * the song out.  Returns the first sink's device (for the volume), or
+ * NULL if none would open.  Drain the queue first.
+ */
+sound_device_t *sound_queue_open( sound_format_t format ) {
+    sound_device_t *devices[ OUTPUT_MAX_SINKS ];
+    sound_device_t *first = NULL;
+    int i;
+
+    /* Opening can wait (e.g. for a pipe's reader), so don't hold the lock */
+    for( i = 0; i < output_queue.sink_count; i++ ) {
+        devices[i] = sound_open( output_queue.sinks[i].driver, format );
+        if( devices[i] == NULL ) {
+            squash_log( "Sound device %d would not open", i );
+        } else if( first == NULL ) {
+            first = devices[i];
+        }
+    }
+
+    squash_lock( output_queue.lock );
+    for( i = 0; i < output_queue.sink_count; i++ ) {
+        output_queue.sinks[i].device = devices[i];
+    }
+    squash_unlock( output_queue.lock );
+
+    return first;
+}
+
+/*
+ * Closes every sink's device at the end of a song.  Drain the queue first.
+ */
+void sound_queue_close( void ) {
+    sound_device_t *devices[ OUTPUT_MAX_SINKS ];
+    int i;
+
+    squash_lock( output_queue.lock );
+    for( i = 0; i < output_queue.sink_count; i++ ) {
+        devices[i] = output_queue.sinks[i].device;
+        output_queue.sinks[i].device = NULL;
+        if( output_queue.sinks[i].dropped > 0 ) {
+            squash_log( "Sound device %d has dropped %ld frames", i, output_queue.sinks[i].dropped );
+        }
+        if( output_queue.sinks[i].write_count > 0 ) {
+            squash_log( "Sound device %d: %ld writes, average %.0f usec, max %ld usec", i,
+                    output_queue.sinks[i].write_count,
+                    output_queue.sinks[i].write_usec_sum / output_queue.sinks[i].write_count,
+                    output_queue.sinks[i].write_usec_max );
+        }
+    }
+    squash_unlock( output_queue.lock );
+
+    for( i = 0; i < output_queue.sink_count; i++ ) {
+        if( devices[i] != NULL ) {
+            sound_close( devices[i] );
+        }
+    }
+}
+
+/*
+ * Called once nothing more will be written after a pause or flush, to drop
+ * anything the devices still hold and record how long it will have taken,
+ * from the command being queued until the last device goes quiet.  The
+ * output_queue lock must be held.
+ */
+void sound_queue_silenced( void ) {
+    long latency, remaining, longest;
+    int i;
+
+    longest = 0;
+    for( i = 0; i < output_queue.sink_count; i++ ) {
+        if( output_queue.drop_pending ) {
+            sound_flush( output_queue.sinks[i].device );
+        }
+        remaining = sound_delay( output_queue.sinks[i].device );
+        if( remaining > longest ) {
+            longest = remaining;
+        }
+    }
+    output_queue.silence_pending = FALSE;
+    output_queue.drop_pending = FALSE;
+
+    /* Anything still inside the devices will be heard too */
+    latency = squash_elapsed_usec( &output_queue.silence_requested ) + longest * 1000;
+    output_queue.silence_count++;
+    output_queue.silence_latency_sum += latency;
+    if( latency > output_queue.silence_latency_max ) {
+        output_queue.silence_latency_max = latency;
+    }
+    squash_log( "Sound stopped %ld usec after the command", latency );
+}
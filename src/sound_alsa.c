@@ -0,0 +1,259 @@
+/*
+ * Copyright 2003 by Adam Luter
+ * This file is part of Squash, a C/Ncurses-based unix music player.
+ *
+ * Squash is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Squash is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Squash; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+/*
+ * sound_alsa.c
+ */
+#include "global.h"
+#include "sound_alsa.h"
+
+/*
+ * Open an ALSA playback device.  The device, period and buffer times come
+ * from the [Sound] config section.  mmap access is used when the device
+ * allows it, so frames are copied once, straight into the device's ring;
+ * otherwise this falls back to snd_pcm_writei().  Any ALSA device works,
+ * including the "null" and "file" plugins for testing without hardware.
+ */
+void *alsa_open( sound_format_t format ) {
+    alsa_data_t *alsa;
+    snd_pcm_hw_params_t *hw_params;
+    snd_pcm_sw_params_t *sw_params;
+    snd_pcm_format_t pcm_format;
+    unsigned int rate, period_time, buffer_time;
+    int err;
+
+    if( format.bits != 16 ) {
+        squash_log( "ALSA: %d bit samples are not supported", format.bits );
+        return NULL;
+    }
+    pcm_format = format.byte_format == SOUND_BIG ? SND_PCM_FORMAT_S16_BE : SND_PCM_FORMAT_S16_LE;
+
+    squash_malloc( alsa, sizeof(alsa_data_t) );
+    alsa->frame_bytes = format.channels * format.bits / 8;
+    alsa->xrun_count = 0;
+
+    if( (err = snd_pcm_open( &alsa->pcm, config.sound_alsa_device, SND_PCM_STREAM_PLAYBACK, 0 )) < 0 ) {
+        squash_log( "ALSA: can't open \"%s\": %s", config.sound_alsa_device, snd_strerror(err) );
+        squash_free( alsa );
+        return NULL;
+    }
+
+    /* Hardware parameters */
+    snd_pcm_hw_params_alloca( &hw_params );
+    rate = format.rate;
+    period_time = config.sound_alsa_period_time * 1000;
+    buffer_time = config.sound_alsa_buffer_time * 1000;
+    if( (err = snd_pcm_hw_params_any( alsa->pcm, hw_params )) >= 0 ) {
+        alsa->mmap = snd_pcm_hw_params_set_access( alsa->pcm, hw_params, SND_PCM_ACCESS_MMAP_INTERLEAVED ) >= 0;
+        if( !alsa->mmap ) {
+            err = snd_pcm_hw_params_set_access( alsa->pcm, hw_params, SND_PCM_ACCESS_RW_INTERLEAVED );
+        }
+    }
+    if( err >= 0 ) {
+        err = snd_pcm_hw_params_set_format( alsa->pcm, hw_params, pcm_format );
+    }
+    if( err >= 0 ) {
+        err = snd_pcm_hw_params_set_channels( alsa->pcm, hw_params, format.channels );
+    }
+    if( err >= 0 ) {
+        err = snd_pcm_hw_params_set_rate_near( alsa->pcm, hw_params, &rate, NULL );
+    }
+    if( err >= 0 ) {
+        err = snd_pcm_hw_params_set_buffer_time_near( alsa->pcm, hw_params, &buffer_time, NULL );
+    }
+    if( err >= 0 ) {
+        err = snd_pcm_hw_params_set_period_time_near( alsa->pcm, hw_params, &period_time, NULL );
+    }
+    if( err >= 0 ) {
+        err = snd_pcm_hw_params( alsa->pcm, hw_params );
+    }
+    if( err < 0 ) {
+        squash_log( "ALSA: can't set hardware parameters: %s", snd_strerror(err) );
+        snd_pcm_close( alsa->pcm );
+        squash_free( alsa );
+        return NULL;
+    }
+
+    /* Sound played at another rate would come out at the wrong pitch and
+     * speed, so use a device (such as "plug:") that can convert instead */
+    if( rate != (unsigned int)format.rate ) {
+        squash_log( "ALSA: \"%s\" plays at %uHz, not %dHz", config.sound_alsa_device, rate, format.rate );
+        snd_pcm_close( alsa->pcm );
+        squash_free( alsa );
+        return NULL;
+    }
+    snd_pcm_hw_params_get_period_size( hw_params, &alsa->period_size, NULL );
+    snd_pcm_hw_params_get_buffer_size( hw_params, &alsa->buffer_size );
+    alsa->rate = rate;
+
+    /* Software parameters: wake up once a period is free, and start once
+     * the buffer is full */
+    snd_pcm_sw_params_alloca( &sw_params );
+    if( (err = snd_pcm_sw_params_current( alsa->pcm, sw_params )) >= 0 ) {
+        err = snd_pcm_sw_params_set_avail_min( alsa->pcm, sw_params, alsa->period_size );
+    }
+    if( err >= 0 ) {
+        err = snd_pcm_sw_params_set_start_threshold( alsa->pcm, sw_params,
+                (alsa->buffer_size / alsa->period_size) * alsa->period_size );
+    }
+    if( err >= 0 ) {
+        err = snd_pcm_sw_params( alsa->pcm, sw_params );
+    }
+    if( err < 0 ) {
+        squash_log( "ALSA: can't set software parameters: %s", snd_strerror(err) );
+        snd_pcm_close( alsa->pcm );
+        squash_free( alsa );
+        return NULL;
+    }
+
+    squash_log( "ALSA: %s at %dHz, period %lu frames, buffer %lu frames, %s",
+            config.sound_alsa_device, alsa->rate, (unsigned long)alsa->period_size,
+            (unsigned long)alsa->buffer_size, alsa->mmap ? "mmap" : "writei" );
+
+    return (void *)alsa;
+}
+
+/*
+ * Play a frame of data, waiting for room in the device's buffer.
+ */
+void alsa_play( void *data, frame_data_t frame_data ) {
+    alsa_data_t *alsa = (alsa_data_t *)data;
+    char *pcm_data = frame_data.pcm_data;
+    snd_pcm_uframes_t remaining = frame_data.pcm_size / alsa->frame_bytes;
+    snd_pcm_sframes_t avail, written;
+    int err;
+
+    while( remaining > 0 ) {
+        if( !alsa->mmap ) {
+            written = snd_pcm_writei( alsa->pcm, pcm_data, remaining );
+            if( written < 0 ) {
+                if( !alsa_recover( alsa, written ) ) {
+                    return;
+                }
+                continue;
+            }
+        } else {
+            const snd_pcm_channel_area_t *areas;
+            snd_pcm_uframes_t offset, frames;
+
+            avail = snd_pcm_avail_update( alsa->pcm );
+            if( avail < 0 ) {
+                if( !alsa_recover( alsa, avail ) ) {
+                    return;
+                }
+                continue;
+            }
+
+            if( (snd_pcm_uframes_t)avail < alsa->period_size && (snd_pcm_uframes_t)avail < remaining ) {
+                /* The buffer is full; nothing starts an mmap stream but us */
+                if( snd_pcm_state( alsa->pcm ) == SND_PCM_STATE_PREPARED ) {
+                    if( (err = snd_pcm_start( alsa->pcm )) < 0 && !alsa_recover( alsa, err ) ) {
+                        return;
+                    }
+                    continue;
+                }
+                if( (err = snd_pcm_wait( alsa->pcm, 1000 )) < 0 && !alsa_recover( alsa, err ) ) {
+                    return;
+                }
+                continue;
+            }
+
+            frames = remaining;
+            if( (err = snd_pcm_mmap_begin( alsa->pcm, &areas, &offset, &frames )) < 0 ) {
+                if( !alsa_recover( alsa, err ) ) {
+                    return;
+                }
+                continue;
+            }
+
+            /* Interleaved, so the first area describes all of the channels */
+            memcpy( (char *)areas[0].addr + (areas[0].first + offset * areas[0].step) / 8,
+                    pcm_data, frames * alsa->frame_bytes );
+
+            written = snd_pcm_mmap_commit( alsa->pcm, offset, frames );
+            if( written < 0 ) {
+                if( !alsa_recover( alsa, written ) ) {
+                    return;
+                }
+                continue;
+            }
+        }
+        pcm_data += written * alsa->frame_bytes;
+        remaining -= written;
+    }
+}
+
+/*
+ * Drop anything not yet played, and get ready for more.
+ */
+void alsa_flush( void *data ) {
+    alsa_data_t *alsa = (alsa_data_t *)data;
+
+    snd_pcm_drop( alsa->pcm );
+    snd_pcm_prepare( alsa->pcm );
+}
+
+/*
+ * Milliseconds of sound written but not yet heard.
+ */
+long alsa_delay( void *data ) {
+    alsa_data_t *alsa = (alsa_data_t *)data;
+    snd_pcm_sframes_t frames;
+
+    if( snd_pcm_delay( alsa->pcm, &frames ) < 0 || frames < 0 ) {
+        return -1;
+    }
+
+    return (long)((double)frames * 1000 / alsa->rate);
+}
+
+/*
+ * Play out anything left and close the device.
+ */
+void alsa_close( void *data ) {
+    alsa_data_t *alsa = (alsa_data_t *)data;
+
+    /* A song shorter than the buffer may never have been started */
+    if( snd_pcm_state( alsa->pcm ) == SND_PCM_STATE_PREPARED ) {
+        snd_pcm_start( alsa->pcm );
+    }
+    snd_pcm_drain( alsa->pcm );
+    snd_pcm_close( alsa->pcm );
+
+    if( alsa->xrun_count > 0 ) {
+        squash_log( "ALSA: %ld underruns", alsa->xrun_count );
+    }
+    squash_free( alsa );
+}
+
+/*
+ * Recover from an underrun or a suspend.  Returns FALSE if the device is
+ * beyond help, in which case the rest of the frame is dropped.
+ */
+bool alsa_recover( alsa_data_t *alsa, int err ) {
+    if( err == -EPIPE ) {
+        alsa->xrun_count++;
+        squash_log( "ALSA: underrun" );
+    }
+    if( (err = snd_pcm_recover( alsa->pcm, err, 1 )) < 0 ) {
+        squash_log( "ALSA: can't recover: %s", snd_strerror(err) );
+        return FALSE;
+    }
+
+    return TRUE;
+}
@@ -0,0 +1,217 @@
+/*
+ * Copyright 2003 by Adam Luter
+ * This file is part of Squash, a C/Ncurses-based unix music player.
+ *
+ * Squash is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Squash is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Squash; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+/*
+ * sound_pipe.c
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* for vmsplice() */
+#endif
+#include "global.h"
+#include "sound.h" /* for sound_put_le() */
+#include "sound_pipe.h"
+
+#include <sys/uio.h> /* for struct iovec */
+
+/*
+ * There is only one output stream, kept open from song to song so the
+ * reader sees a single stream.
+ */
+static pipe_output_t pipe_output = { -1 };
+
+/*
+ * Open the pipe the first time a song starts.  Pipe_File is either "-"
+ * for stdout or a file name, usually of a named pipe (opening one waits
+ * for a reader).
+ */
+void *pipe_open( sound_format_t format ) {
+    pipe_output_t *output = &pipe_output;
+    long page_size;
+    int pipe_buffers;
+
+    if( output->fd == -1 ) {
+        if( strcmp(config.sound_pipe_file, "-") == 0 ) {
+            output->fd = STDOUT_FILENO;
+        } else if( (output->fd = open(config.sound_pipe_file, O_WRONLY | O_CREAT | O_TRUNC, 0666)) == -1 ) {
+            squash_log( "Can't open pipe file \"%s\": %s", config.sound_pipe_file, strerror(errno) );
+            return NULL;
+        }
+
+        /* Let a write fail so we can say why, rather than dying quietly */
+        (void)signal( SIGPIPE, SIG_IGN );
+
+        /*
+         * vmsplice() hands the pipe references to our pages instead of
+         * copying them, so a slot can't be reused until the reader has
+         * taken it.  Every slot fills at least one pipe buffer, so with
+         * one more slot than the pipe has buffers, a slot is always
+         * free again by the time we come back around to it.
+         */
+        page_size = sysconf( _SC_PAGESIZE );
+        pipe_buffers = PIPE_DEFAULT_BUFFERS;
+#ifdef F_GETPIPE_SZ
+        {
+            int pipe_size = fcntl( output->fd, F_GETPIPE_SZ );
+            if( pipe_size > 0 ) {
+                pipe_buffers = pipe_size / page_size;
+            }
+        }
+#endif
+        output->slot_size = page_size * PIPE_SLOT_PAGES;
+        output->slot_count = pipe_buffers + 1;
+        output->slot_next = 0;
+        output->ring = mmap( NULL, output->slot_size * output->slot_count, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+        if( output->ring == MAP_FAILED ) {
+            squash_error( "Can't allocate pipe ring" );
+        }
+#ifdef SPLICE_F_MOVE
+        {
+            struct stat stat_buffer;
+            output->splice = fstat( output->fd, &stat_buffer ) == 0 && S_ISFIFO( stat_buffer.st_mode );
+        }
+#else
+        output->splice = FALSE;
+#endif
+        output->format_sent = FALSE;
+
+        squash_log( "Pipe output to \"%s\" using %s, %d slots of %d bytes", config.sound_pipe_file,
+                output->splice ? "vmsplice" : "write", output->slot_count, output->slot_size );
+    }
+
+    if( !output->format_sent
+            || output->format.rate != format.rate
+            || output->format.channels != format.channels
+            || output->format.bits != format.bits
+            || output->format.byte_format != format.byte_format ) {
+        output->format = format;
+        output->format_sent = FALSE;
+    }
+    output->bytes_per_second = format.rate * format.channels * format.bits / 8;
+
+    return (void *)output;
+}
+
+/*
+ * Write a frame as a DATA chunk (preceded by a FMT chunk if the format has
+ * changed).  The chunks are built straight into the ring slots, and
+ * written as each slot fills.  This blocks while the pipe is full, which
+ * holds back the decoder.
+ */
+void pipe_play( void *data, frame_data_t frame_data ) {
+    pipe_output_t *output = (pipe_output_t *)data;
+    unsigned char *slot;
+    int used, copy_size, pcm_done;
+    int byte_order;
+
+    slot = (unsigned char *)output->ring + output->slot_next * output->slot_size;
+    used = 0;
+
+    if( !output->format_sent ) {
+        byte_order = output->format.byte_format == SOUND_BIG ? 1 : 0;
+        memcpy( slot, "FMT ", 4 );
+        sound_put_le( slot + 4, PIPE_FORMAT_SIZE, 4 );
+        sound_put_le( slot + 8, output->format.rate, 4 );
+        sound_put_le( slot + 12, output->format.channels, 2 );
+        sound_put_le( slot + 14, output->format.bits, 2 );
+        sound_put_le( slot + 16, byte_order, 4 );
+        used += PIPE_CHUNK_HEADER_SIZE + PIPE_FORMAT_SIZE;
+        output->format_sent = TRUE;
+    }
+
+    memcpy( slot + used, "DATA", 4 );
+    sound_put_le( slot + used + 4, frame_data.pcm_size, 4 );
+    used += PIPE_CHUNK_HEADER_SIZE;
+
+    pcm_done = 0;
+    while( 1 ) {
+        copy_size = frame_data.pcm_size - pcm_done;
+        if( copy_size > output->slot_size - used ) {
+            copy_size = output->slot_size - used;
+        }
+        memcpy( slot + used, frame_data.pcm_data + pcm_done, copy_size );
+        used += copy_size;
+        pcm_done += copy_size;
+
+        pipe_write( output, (char *)slot, used );
+        output->slot_next = (output->slot_next + 1) % output->slot_count;
+
+        if( pcm_done >= frame_data.pcm_size ) {
+            break;
+        }
+        slot = (unsigned char *)output->ring + output->slot_next * output->slot_size;
+        used = 0;
+    }
+}
+
+/*
+ * Milliseconds of sound sitting in the pipe, waiting for the reader.
+ */
+long pipe_delay( void *data ) {
+    pipe_output_t *output = (pipe_output_t *)data;
+    int waiting;
+
+    if( !output->splice || output->bytes_per_second == 0 ) {
+        return -1;
+    }
+    if( ioctl(output->fd, FIONREAD, &waiting) == -1 ) {
+        return -1;
+    }
+
+    return (long)((double)waiting * 1000 / output->bytes_per_second);
+}
+
+/*
+ * The stream stays open for the next song.
+ */
+void pipe_close( void *data ) {
+}
+
+/*
+ * Write one slot, with vmsplice() when the output is a pipe, otherwise
+ * (or if the kernel refuses) with write().
+ */
+void pipe_write( pipe_output_t *output, char *buffer, int size ) {
+    ssize_t written;
+
+    while( size > 0 ) {
+#ifdef SPLICE_F_MOVE
+        if( output->splice ) {
+            struct iovec iov;
+            iov.iov_base = buffer;
+            iov.iov_len = size;
+            written = vmsplice( output->fd, &iov, 1, 0 );
+            if( written == -1 && (errno == EINVAL || errno == ENOSYS) ) {
+                squash_log( "vmsplice() failed, using write() instead" );
+                output->splice = FALSE;
+                continue;
+            }
+        } else
+#endif
+        written = write( output->fd, buffer, size );
+
+        if( written == -1 ) {
+            if( errno == EINTR || errno == EAGAIN ) {
+                continue;
+            }
+            squash_error( "Problem writing to pipe file \"%s\": %s", config.sound_pipe_file, strerror(errno) );
+        }
+        buffer += written;
+        size -= written;
+    }
+}
@@ -90,6 +90,10 @@ void spectrum_resize(int height, int width) {
  * spectrum_info.active = FALSE;).  This is done from the input.c
  * file.
  *
+ * The timer is its own, not put off until the frame decoder's next
+ * burst (see squash_coalesced_sleep()), since the bars have to move
+ * smoothly.  The empeg doesn't run this thread.
+ *
  * TODO: Perhaps an optimization to not call draw spectrum unless
  * new data has entered the ring buffer should be added. (But only
  * the half that does the fourier transform.  The renderer should
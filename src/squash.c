@@ -22,13 +22,15 @@
 #include "global.h"
 #include "global_squash.h"
 #include "player.h"             /* for player() */
-#include "playlist_manager.h"   /* for playlist_manager() */
+#include "playlist_manager.h"   /* for playlist_manager(), song_loader() */
 #include "database.h"           /* for load_meta_data() etc. */
-#include "stat.h"               /* for start_song_picker() */
+#include "stat.h"               /* for start_song_picker(), stats_saver() */
 #include "display.h"            /* for display_monitor() */
 #include "input.h"              /* for keyboard_monitor(), fifo_monitor() */
 #include "spectrum.h"           /* for spectrum_monitor() */
-#include "sound.h"              /* for sound_init() sound_shutdown() */
+#include "sound.h"              /* for sound_init() sound_shutdown() sound_queue_init() */
+#include "analyze.h"            /* for song_analyzer() */
+#include "pcm_cache.h"          /* for pcm_cache_filler() */
 #ifdef EMPEG
 #include "vfdlib.h"             /* for exit status display */
 #include <sys/ioctl.h>          /* for ioctl() */
@@ -75,9 +77,14 @@ void *power(void *data) {
 #endif
 
 void *state_saver(void *data) {
-    struct timespec sleep_time = { 120, 000000000 };
     while(1) {
-        nanosleep( &sleep_time, NULL );
+        /* Every two minutes or so, whenever the player is busy anyway */
+        squash_coalesced_sleep( 120000, 30000 );
+
+        /* main() saves it one last time */
+        if( squash_quitting() ) {
+            break;
+        }
         squash_lock( state_info.lock );
         squash_lock( display_info.lock );
         squash_rlock( database_info.lock );
@@ -138,17 +145,17 @@ void *setup_database( void *data ) {
 
     squash_log("starting player in setup db");
     /* Tell the player to start playing */
-    squash_lock( player_command.lock );
     player_queue_command( CMD_PLAY );
-    squash_signal( player_command.changed );
-    squash_unlock( player_command.lock );
 
-    squash_log("loading state");
-    /* Load any previous playing song */
-    load_state();
+    /* A render starts from a fresh playlist and has no screen */
+    if( !render_info.active ) {
+        squash_log("loading state");
+        /* Load any previous playing song */
+        load_state();
 
-    squash_log("drawing screen");
-    draw_screen();
+        squash_log("drawing screen");
+        draw_screen();
+    }
 #ifdef EMPEG
     draw_empeg_display();
 #endif
@@ -191,12 +198,18 @@ int main( int argc, char *argv[] ) {
 #endif
     pthread_t fifo_input_thread;
     pthread_t player_thread;
+    pthread_t sound_output_threads[ OUTPUT_MAX_SINKS ];
     pthread_t frame_decoder_thread;
     pthread_t playlist_manager_thread;
 #ifndef EMPEG
     pthread_t spectrum_thread;
 #endif
     pthread_t state_saver_thread;
+    pthread_t song_analyzer_threads[ ANALYZE_MAX_THREADS ];
+    pthread_t pcm_cache_thread;
+    pthread_t song_scanner_thread;
+    pthread_t song_loader_thread;
+    pthread_t stats_saver_thread;
     pthread_t database_thread;
     pthread_attr_t thread_attr;
 #ifdef EMPEG
@@ -206,9 +219,55 @@ int main( int argc, char *argv[] ) {
 #endif
     struct stat fifo_stat;
     int fifo_stat_result;
+    int i;
+#ifndef EMPEG
+    int option;
+    struct timeval render_start, now;
+    double render_seconds;
+#endif
 
     init_config();
 
+    /* Read the command line */
+    render_info.active = FALSE;
+#ifndef EMPEG
+    while( (option = getopt( argc, argv, "r:o:n" )) != -1 ) {
+        switch( option ) {
+            case 'r':
+                render_info.active = TRUE;
+                render_info.limit = atof( optarg ) * 3600;
+                break;
+            case 'o':
+                squash_free( config.sound_pipe_file );
+                config.sound_pipe_file = strdup( optarg );
+                squash_free( config.sound_wav_file );
+                config.sound_wav_file = strdup( optarg );
+                break;
+            case 'n':
+                config.db_readonly = 1;
+                break;
+            default:
+                fprintf( stderr, "usage: %s [-r hours] [-o file] [-n]\n"
+                                 "  -r hours  render this many hours of songs as fast as possible, then exit\n"
+                                 "  -o file   where the pipe and wav drivers (and -r) write, \"-\" for stdout\n"
+                                 "  -n        dry run, don't save any statistics\n", argv[0] );
+                exit( 1 );
+        }
+    }
+    if( render_info.active ) {
+        /* Everything goes to one file, which is only as slow as the disk */
+        i = strlen( config.sound_wav_file );
+        squash_free( config.sound_driver );
+        if( i > 4 && strcasecmp( config.sound_wav_file + i - 4, ".wav" ) == 0 ) {
+            config.sound_driver = strdup( "wav" );
+        } else {
+            config.sound_driver = strdup( "pipe" );
+        }
+    }
+    render_info.rendered = 0;
+    render_info.song_count = 0;
+#endif
+
     /* Setup the log file */
 #ifdef DEBUG
     #ifdef EMPEG
@@ -227,26 +286,31 @@ int main( int argc, char *argv[] ) {
      * pid should be added to the name.  Also, unlink any
      * fifo's found that are of pid's that don't exist anymore.
      */
-    fifo_stat_result = stat(config.input_fifo_path, &fifo_stat);
-    if( fifo_stat_result == 0 ) {
-        /* File already exists */
-        if(! S_ISFIFO(fifo_stat.st_mode) ) {
-            fprintf(stderr, "Sorry '%s' already exists, but isn't a fifo", config.input_fifo_path);
-            exit(1);
-        } else {
-            if( unlink(config.input_fifo_path) != 0 ) {
-                fprintf(stderr, "Couldn't remove existing '%s'", config.input_fifo_path);
+    /* A render is not controlled, so leave the fifo to any squash that is playing */
+    if( !render_info.active ) {
+        fifo_stat_result = stat(config.input_fifo_path, &fifo_stat);
+        if( fifo_stat_result == 0 ) {
+            /* File already exists */
+            if(! S_ISFIFO(fifo_stat.st_mode) ) {
+                fprintf(stderr, "Sorry '%s' already exists, but isn't a fifo", config.input_fifo_path);
                 exit(1);
+            } else {
+                if( unlink(config.input_fifo_path) != 0 ) {
+                    fprintf(stderr, "Couldn't remove existing '%s'", config.input_fifo_path);
+                    exit(1);
+                }
             }
         }
-    }
-    if( mkfifo( config.input_fifo_path, 0666 ) < 0 ) {
-        fprintf(stderr, "Can't create '%s'\n", config.input_fifo_path);
-        exit(1);
+        if( mkfifo( config.input_fifo_path, 0666 ) < 0 ) {
+            fprintf(stderr, "Can't create '%s'\n", config.input_fifo_path);
+            exit(1);
+        }
     }
 
     /* Initilize the display */
-    display_init();
+    if( !render_info.active ) {
+        display_init();
+    }
     display_info.state = SYSTEM_LOADING;
     /* Set focus. */
 #ifndef NO_NCURSES
@@ -264,7 +328,9 @@ int main( int argc, char *argv[] ) {
 
     /* Initialize the windows, unless there are no windows */
 #ifndef NO_NCURSES
-    window_init();
+    if( !render_info.active ) {
+        window_init();
+    }
 #endif
 
     /* Initialize the spectrum analyzer */
@@ -280,11 +346,15 @@ int main( int argc, char *argv[] ) {
     */
     status_info.exit_status = -1;
     status_info.status_message = NULL;
+    status_info.quitting = FALSE;
 
     /* Initialize Database */
     database_info.song_count = 0;
     database_info.song_count_allocated = 0;
     database_info.songs = NULL;
+    database_info.quarantine = NULL;
+    database_info.quarantine_count = 0;
+    database_info.quarantine_allocated = 0;
     database_info.stats_loaded = FALSE;
 
     /* Initialize Song Queue */
@@ -311,25 +381,46 @@ int main( int argc, char *argv[] ) {
     past_queue.wanted_size = config.playlist_manager_pastlist_size;
 
     /* Initialize the now playing information */
-    player_command.head = NULL;
-    player_command.tail = NULL;
-    player_command.size = 0;
+    for( i = 0; i < PLAYER_COMMAND_RING_SIZE; i++ ) {
+        player_command.entries[i].sequence = i;
+    }
+    player_command.head = 0;
+    player_command.tail = 0;
+    player_command.waiting = FALSE;
+    feedback_queue.head = NULL;
+    feedback_queue.tail = NULL;
+    feedback_queue.size = 0;
+    gettimeofday( &wakeup_info.start, NULL );
     player_info.state = STATE_BIG_STOP;
     player_info.song = NULL;
     player_info.current_position = 0;
-    squash_malloc( frame_buffer.frames, PLAYER_MAX_BUFFER_SIZE * sizeof( frame_data_t ) );
+    player_info.command_count = 0;
+    player_info.command_latency_sum = 0;
+    player_info.command_latency_max = 0;
+    squash_malloc( frame_buffer.frames, PLAYER_INITIAL_BUFFER_FRAMES * sizeof( frame_data_t ) );
+    frame_buffer.allocated = PLAYER_INITIAL_BUFFER_FRAMES;
+    frame_buffer.start = 0;
     frame_buffer.song_eof = FALSE;
     frame_buffer.new_file = FALSE;
     frame_buffer.size = 0;
     frame_buffer.pcm_size = 0;
-    frame_buffer.decoder_function = NULL;
-    frame_buffer.decoder_data = NULL;
+    frame_buffer.bytes_per_second = 0;
+    frame_buffer.filling = TRUE;
+    frame_buffer_set_watermarks();
+    sound_queue_init();
+    frame_buffer.current.decode = NULL;
+    frame_buffer.current.song = NULL;
+    frame_buffer.fade_wanted = FALSE;
+    frame_buffer.next_file = FALSE;
+    frame_buffer.drop_next = FALSE;
 
     /* Initialize the audio device */
     sound_init();
 
     /* Draw the screen */
-    draw_screen();
+    if( !render_info.active ) {
+        draw_screen();
+    }
 
     squash_log("starting threads...");
     pthread_attr_init( &thread_attr );
@@ -352,8 +443,10 @@ int main( int argc, char *argv[] ) {
     pthread_attr_setschedpolicy( &thread_attr, SCHED_FIFO );
 #endif
 
-    squash_log("starting display");
-    pthread_create( &display_thread, &thread_attr, display_monitor, (void *)NULL );
+    if( !render_info.active ) {
+        squash_log("starting display");
+        pthread_create( &display_thread, &thread_attr, display_monitor, (void *)NULL );
+    }
 
 #ifdef EMPEG
     thread_sched_param.sched_priority = low_priority;
@@ -365,11 +458,32 @@ int main( int argc, char *argv[] ) {
     pthread_create( &database_thread, &thread_attr, setup_database, (void *)NULL );
     squash_log("starting playlist");
     pthread_create( &playlist_manager_thread, &thread_attr, playlist_manager, (void *)NULL );
+    squash_log("starting stats saver");
+    pthread_create( &stats_saver_thread, &thread_attr, stats_saver, (void *)NULL );
+    if( config.scheduler_load_rest >= 0 ) {
+        squash_log("starting song loader");
+        pthread_create( &song_loader_thread, &thread_attr, song_loader, (void *)NULL );
+    }
+    squash_log("starting song analyzers");
+    analyze_init();
+    for( i = 0; i < config.analyzer_threads && i < ANALYZE_MAX_THREADS; i++ ) {
+        pthread_create( &song_analyzer_threads[i], &thread_attr, song_analyzer, (void *)(long)i );
+    }
+    if( pcm_cache_enabled() && !render_info.active ) {
+        squash_log("starting pcm cache filler");
+        pthread_create( &pcm_cache_thread, &thread_attr, pcm_cache_filler, (void *)NULL );
+    }
+    if( config.scanner_rest >= 0 && !render_info.active ) {
+        squash_log("starting song scanner");
+        pthread_create( &song_scanner_thread, &thread_attr, song_scanner, (void *)NULL );
+    }
 
     /* trying to display this is a waste right now on the empeg */
 #ifndef EMPEG
-    squash_log("starting spectrum");
-    pthread_create( &spectrum_thread, &thread_attr, spectrum_monitor, (void *)NULL );
+    if( !render_info.active ) {
+        squash_log("starting spectrum");
+        pthread_create( &spectrum_thread, &thread_attr, spectrum_monitor, (void *)NULL );
+    }
 #endif
 
 #ifdef EMPEG
@@ -378,6 +492,9 @@ int main( int argc, char *argv[] ) {
     pthread_attr_setschedparam( &thread_attr, &thread_sched_param );
 #endif
     /* Start playing */
+#ifndef EMPEG
+    gettimeofday( &render_start, NULL );
+#endif
     squash_log("starting frame decoder");
     pthread_create( &frame_decoder_thread, &thread_attr, frame_decoder, (void *)NULL );
 
@@ -388,6 +505,10 @@ int main( int argc, char *argv[] ) {
 #endif
     squash_log("starting player");
     pthread_create( &player_thread, &thread_attr, player, (void *)NULL );
+    squash_log("starting sound output");
+    for( i = 0; i < output_queue.sink_count; i++ ) {
+        pthread_create( &sound_output_threads[i], &thread_attr, sound_output, (void *)&output_queue.sinks[i] );
+    }
 
 #ifdef EMPEG
     thread_sched_param.sched_priority = medium_priority;
@@ -395,8 +516,10 @@ int main( int argc, char *argv[] ) {
     pthread_attr_setschedpolicy( &thread_attr, SCHED_FIFO );
 #endif
 
-    squash_log("starting fifo");
-    pthread_create( &fifo_input_thread, &thread_attr, fifo_monitor, (void *)NULL );
+    if( !render_info.active ) {
+        squash_log("starting fifo");
+        pthread_create( &fifo_input_thread, &thread_attr, fifo_monitor, (void *)NULL );
+    }
 
 #ifdef EMPEG
     /* Listen for input */
@@ -411,15 +534,17 @@ int main( int argc, char *argv[] ) {
     pthread_create( &power_thread, &thread_attr, power, (void *)NULL );
 #endif
 
-    squash_log("starting state saver");
-    pthread_create( &state_saver_thread, &thread_attr, state_saver, (void *)NULL );
+    if( !render_info.active ) {
+        squash_log("starting state saver");
+        pthread_create( &state_saver_thread, &thread_attr, state_saver, (void *)NULL );
 
 #ifndef NO_NCURSES
-    squash_log("starting keyboard");
-    pthread_create( &keyboard_input_thread, &thread_attr, keyboard_monitor, (void *)NULL );
-    squash_log("starting screen redraw");
-    pthread_create( &screen_redraw_thread, &thread_attr, screen_redraw, (void *)NULL );
+        squash_log("starting keyboard");
+        pthread_create( &keyboard_input_thread, &thread_attr, keyboard_monitor, (void *)NULL );
+        squash_log("starting screen redraw");
+        pthread_create( &screen_redraw_thread, &thread_attr, screen_redraw, (void *)NULL );
 #endif
+    }
 
     squash_log("threads started, waiting till done");
 
@@ -431,38 +556,118 @@ int main( int argc, char *argv[] ) {
         squash_wait( status_info.exit, status_info.lock );
     }
 
-    /* Kill all threads */
+    if( status_info.exit_status == 0 ) {
+        /* An orderly exit (quitting, a power fail or the end of a
+         * render), so stop every thread that can touch the database
+         * where it is safe to, and wait for them.  Cancelling one in the
+         * middle of save_song() would leave its ".stat" file cut short,
+         * or the database locked so that flush_feedback() never gets it. */
+        status_info.quitting = TRUE;
+        squash_unlock( status_info.lock );
+
+        squash_lock( song_queue.lock );
+        squash_broadcast( song_queue.not_full );
+        squash_broadcast( song_queue.not_empty );
+        squash_broadcast( database_info.stats_finished );
+        squash_unlock( song_queue.lock );
+        squash_lock( player_command.lock );
+        squash_broadcast( player_command.changed );
+        squash_unlock( player_command.lock );
+        squash_lock( frame_buffer.lock );
+        squash_broadcast( frame_buffer.restart );
+        squash_broadcast( frame_buffer.new_data );
+        squash_unlock( frame_buffer.lock );
+        squash_lock( feedback_queue.lock );
+        squash_broadcast( feedback_queue.not_empty );
+        squash_unlock( feedback_queue.lock );
+        squash_lock( wakeup_info.lock );
+        squash_broadcast( wakeup_info.burst );
+        squash_unlock( wakeup_info.lock );
+
+        pthread_join( playlist_manager_thread, NULL );
+        pthread_join( player_thread, NULL );
+        pthread_join( frame_decoder_thread, NULL );
+        pthread_join( stats_saver_thread, NULL );
+        if( config.scheduler_load_rest >= 0 ) {
+            pthread_join( song_loader_thread, NULL );
+        }
+        for( i = 0; i < config.analyzer_threads && i < ANALYZE_MAX_THREADS; i++ ) {
+            pthread_join( song_analyzer_threads[i], NULL );
+        }
+        if( !render_info.active ) {
+            pthread_join( state_saver_thread, NULL );
+            if( config.scanner_rest >= 0 ) {
+                pthread_join( song_scanner_thread, NULL );
+            }
+            if( pcm_cache_enabled() ) {
+                pthread_join( pcm_cache_thread, NULL );
+            }
+        }
+
+        /* Keep the last songs' statistics */
+        flush_feedback();
+
+        squash_lock( status_info.lock );
+    } else {
+        /* Something went wrong (and whoever found it never returns), so
+         * there is nothing to do but stop everything where it is */
+        pthread_cancel( playlist_manager_thread );
+        pthread_cancel( player_thread );
+        pthread_cancel( frame_decoder_thread );
+        if( !render_info.active ) {
+            pthread_cancel( state_saver_thread );
+        }
+    }
+
+    /* Kill the threads that only take input or draw */
 #ifdef EMPEG
     pthread_cancel( ir_input_thread );
     pthread_cancel( power_thread );
 #endif
+    if( !render_info.active ) {
 #ifndef NO_NCURSES
-    pthread_cancel( keyboard_input_thread );
-    pthread_cancel( screen_redraw_thread );
+        pthread_cancel( keyboard_input_thread );
+        pthread_cancel( screen_redraw_thread );
 #endif
-    pthread_cancel( fifo_input_thread );
-    pthread_cancel( display_thread );
+        pthread_cancel( fifo_input_thread );
+        pthread_cancel( display_thread );
 #ifndef EMPEG
-    pthread_cancel( spectrum_thread );
+        pthread_cancel( spectrum_thread );
 #endif
-    pthread_cancel( playlist_manager_thread );
-    pthread_cancel( player_thread );
-    pthread_cancel( frame_decoder_thread );
-    pthread_cancel( state_saver_thread );
+    }
 
-    /* Save the state */
-    squash_lock( state_info.lock );
-    save_state();
-    squash_unlock( state_info.lock );
+    if( render_info.active ) {
+#ifndef EMPEG
+        /* Say how it went */
+        gettimeofday( &now, NULL );
+        render_seconds = (now.tv_sec - render_start.tv_sec) + (now.tv_usec - render_start.tv_usec) / 1000000.0;
+        fprintf( stderr, "Rendered %ld songs, %.2f hours of sound, in %.1f seconds (%.1fx realtime)\n",
+                render_info.song_count, render_info.rendered / 3600, render_seconds,
+                render_seconds > 0 ? render_info.rendered / render_seconds : 0.0 );
+        for( i = 0; i < output_queue.sink_count; i++ ) {
+            if( output_queue.sinks[i].write_count > 0 ) {
+                fprintf( stderr, "Sound device %d: %ld writes, average %.0f usec, max %ld usec\n", i,
+                        output_queue.sinks[i].write_count,
+                        output_queue.sinks[i].write_usec_sum / output_queue.sinks[i].write_count,
+                        output_queue.sinks[i].write_usec_max );
+            }
+        }
+#endif
+    } else {
+        /* Save the state */
+        squash_lock( state_info.lock );
+        save_state();
+        squash_unlock( state_info.lock );
 
-    /* Bring ncurses down, unless there is no ncurses */
+        /* Bring ncurses down, unless there is no ncurses */
 #ifndef NO_NCURSES
-    /* Shut down ncurses */
-    endwin();
+        /* Shut down ncurses */
+        endwin();
 
-    /* Reset the screen (some more) */
-    reset_shell_mode();
+        /* Reset the screen (some more) */
+        reset_shell_mode();
 #endif
+    }
 
     /* Shutdown the sound device */
     sound_shutdown();
@@ -470,7 +675,9 @@ int main( int argc, char *argv[] ) {
     if( fifo_info.fifo_file != NULL ) {
         fclose( fifo_info.fifo_file );
     }
-    unlink( config.input_fifo_path );
+    if( !render_info.active ) {
+        unlink( config.input_fifo_path );
+    }
 
     /* Print any error information */
     if( status_info.status_message != NULL ) {
@@ -44,6 +44,8 @@ double get_rating( stat_info_t stat ) {
  * the average and the standard deviation.
  * If a song's rating changes (that is play_count or skip_count),
  * the sum and sqr_sum must be adjusted to reflect those changes.
+ * This also rebuilds the quarantine list, letting back in any song
+ * whose file has changed since it failed to decode.
  */
 void start_song_picker() {
     int i;
@@ -56,6 +58,7 @@ void start_song_picker() {
     database_info.play_sqr_sum = 0;
     database_info.skip_sum = 0;
     database_info.skip_sqr_sum = 0;
+    database_info.quarantine_count = 0;
 
     for( i = 0; i < database_info.song_count; i++ ) {
         double rating;
@@ -71,6 +74,17 @@ void start_song_picker() {
         database_info.play_sqr_sum += database_info.songs[i].stat.play_count * database_info.songs[i].stat.play_count;
         database_info.skip_sum += database_info.songs[i].stat.skip_count;
         database_info.skip_sqr_sum += database_info.songs[i].stat.skip_count * database_info.songs[i].stat.skip_count;
+
+        if( database_info.songs[i].stat.quarantine_size != -1 ) {
+            if( quarantine_expired(&database_info.songs[i]) ) {
+                database_info.songs[i].stat.quarantine_size = -1;
+                database_info.songs[i].stat.changed = TRUE;
+            } else {
+                squash_ensure_alloc( database_info.quarantine_count, database_info.quarantine_allocated,
+                        database_info.quarantine, sizeof(int), 16, *=2 );
+                database_info.quarantine[ database_info.quarantine_count++ ] = i;
+            }
+        }
     }
 
     database_info.stats_loaded = TRUE;
@@ -79,10 +93,11 @@ void start_song_picker() {
 }
 
 /*
- * Does a normal test on X using A (average) and S (standard
- * deviation) to convert X to a Z value.
+ * Converts X to a Z value using A (average) and S (standard deviation),
+ * and returns the area under the normal curve to its left.  This is how
+ * likely normal_test() is to let a song with that rating through.
  */
-bool normal_test( double x, double a, double s ) {
+double pick_probability( double x, double a, double s ) {
     double pdf[5] = { 0.0000,
                       0.3413,
                       0.4772,
@@ -92,11 +107,10 @@ bool normal_test( double x, double a, double s ) {
     bool sign;
     int pdf_pos;
     double area;
-    double rand_val;
 
     z = (x - a) / s;
     if( isnan(z) ) {
-        return TRUE;
+        return 1.0;
     }
 
     sign    = z < 0;
@@ -118,9 +132,19 @@ bool normal_test( double x, double a, double s ) {
         area = 0.5 + area;
     }
 
+    return area;
+}
+
+/*
+ * Does a normal test on X using A (average) and S (standard
+ * deviation) to convert X to a Z value.
+ */
+bool normal_test( double x, double a, double s ) {
+    double rand_val;
+
     rand_val = (double)rand() / (RAND_MAX + 1.0);
 
-    return area > rand_val;
+    return pick_probability( x, a, s ) > rand_val;
 }
 
 /*
@@ -129,6 +153,7 @@ bool normal_test( double x, double a, double s ) {
  * skip_count statistics that are gathered.  See get_rating().
  * 2nd: The repeat_counter.  The song must count down from 10 before it
  * is actually picked.  This helps avoid duplicate songs.
+ * Songs in quarantine are never picked.
  */
 unsigned int pick_song() {
     double avg;
@@ -139,11 +164,18 @@ unsigned int pick_song() {
     /* This is a random pick.  It sucks. */
     /* return (int)((double)database_info.song_count * rand() / (RAND_MAX + 1.0)); */
 
+    if( database_info.quarantine_count >= database_info.song_count ) {
+        squash_error( "None of the %d songs can be decoded", database_info.song_count );
+    }
+
     avg = database_info.sum / database_info.song_count;
     std_dev = sqrt( fabs(database_info.sqr_sum / database_info.song_count - avg*avg) );
 
     while( 1 ) {
         canidate = (int)((double)database_info.song_count * rand() / (RAND_MAX + 1.0));
+        if( database_info.songs[canidate].stat.quarantine_size != -1 ) {
+            continue;
+        }
         canidate_rating = get_rating( database_info.songs[canidate].stat );
 
         if( !normal_test( canidate_rating, avg, std_dev ) ) {
@@ -165,6 +197,8 @@ unsigned int pick_song() {
  * When a song is skipped or played successfully, song feedback
  * should occur.  This routine alters these statistics and also
  * ensures that the global statistics are kept up to date.
+ * The caller must hold the database write lock, and the song is not
+ * saved; normally use queue_feedback() instead.
  */
 void feedback( song_info_t *song, short direction ) {
     double rating = get_rating( song->stat );
@@ -188,7 +222,172 @@ void feedback( song_info_t *song, short direction ) {
     rating = get_rating( song->stat );
     database_info.sum += rating;
     database_info.sqr_sum += rating * rating;
+}
+
+/*
+ * Returns TRUE if a quarantined song's file is no longer the one that
+ * failed to decode, judged by its size and modification time.
+ */
+bool quarantine_expired( song_info_t *song ) {
+    struct stat song_stat;
+    char *filename;
+    bool expired;
+
+    filename = build_fullfilename( song, BASENAME_SONG );
+    if( stat(filename, &song_stat) != 0 ) {
+        expired = FALSE;
+    } else {
+        expired = song_stat.st_size != song->stat.quarantine_size
+               || (long)song_stat.st_mtime != song->stat.quarantine_mtime;
+    }
+    squash_free( filename );
+
+    return expired;
+}
+
+/*
+ * When a song cannot be opened or dies while decoding it is put in
+ * quarantine, so pick_song() stops choosing it.  The file's size and
+ * modification time are remembered, and the song gets another chance
+ * from start_song_picker() once either one changes.
+ * The caller must hold the database write lock, and the song is not
+ * saved; normally use queue_feedback() with a direction of 0 instead.
+ */
+void quarantine_song( song_info_t *song ) {
+    struct stat song_stat;
+    char *filename;
+
+    if( song->stat.quarantine_size != -1 ) {
+        return;
+    }
+
+    filename = build_fullfilename( song, BASENAME_SONG );
+    if( stat(filename, &song_stat) == 0 ) {
+        song->stat.quarantine_size = song_stat.st_size;
+        song->stat.quarantine_mtime = (long)song_stat.st_mtime;
+    } else {
+        /* It's gone, keep it out until something shows up there */
+        song->stat.quarantine_size = 0;
+        song->stat.quarantine_mtime = 0;
+    }
+    squash_log( "Quarantined: %s", filename );
+    squash_free( filename );
+    song->stat.changed = TRUE;
+
+    squash_ensure_alloc( database_info.quarantine_count, database_info.quarantine_allocated,
+            database_info.quarantine, sizeof(int), 16, *=2 );
+    database_info.quarantine[ database_info.quarantine_count++ ] = song - database_info.songs;
+}
 
-    save_song( song );
+/*
+ * Hands feedback to the stats_saver() thread, so that the caller does not
+ * need the database write lock and never waits on the disk.
+ * A direction of 0 means the song failed to decode and is quarantined.
+ */
+void queue_feedback( song_info_t *song, short direction ) {
+    feedback_entry_t *new_entry;
+
+    if( song == NULL ) {
+        return;
+    }
+
+    squash_malloc( new_entry, sizeof(feedback_entry_t) );
+    new_entry->song = song;
+    new_entry->direction = direction;
+    new_entry->next = NULL;
+
+    squash_lock( feedback_queue.lock );
+    if( feedback_queue.tail == NULL ) {
+        feedback_queue.head = new_entry;
+    } else {
+        feedback_queue.tail->next = new_entry;
+    }
+    feedback_queue.tail = new_entry;
+    feedback_queue.size++;
+    squash_signal( feedback_queue.not_empty );
+    squash_unlock( feedback_queue.lock );
+}
+
+/*
+ * Applies a batch of queued feedback: the statistics are updated under a
+ * single write lock, then the changed songs are saved under a read lock,
+ * so the player can keep reading the database while the disk catches up.
+ * Frees the batch.
+ */
+void apply_feedback( feedback_entry_t *batch ) {
+    feedback_entry_t *entry;
+
+    /* Update the statistics */
+    squash_wlock( database_info.lock );
+    for( entry = batch; entry != NULL; entry = entry->next ) {
+        if( entry->direction == 0 ) {
+            quarantine_song( entry->song );
+        } else {
+            feedback( entry->song, entry->direction );
+        }
+    }
+    squash_wunlock( database_info.lock );
+
+    /* Then write them out; save_song() skips songs that were already saved */
+    squash_rlock( database_info.lock );
+    while( batch != NULL ) {
+        entry = batch;
+        batch = batch->next;
+        save_song( entry->song );
+        squash_free( entry );
+    }
+    squash_runlock( database_info.lock );
 }
 
+/*
+ * Applies whatever feedback is still queued right away, for when squash
+ * is about to exit.
+ */
+void flush_feedback( void ) {
+    feedback_entry_t *batch;
+
+    squash_lock( feedback_queue.lock );
+    batch = feedback_queue.head;
+    feedback_queue.head = NULL;
+    feedback_queue.tail = NULL;
+    feedback_queue.size = 0;
+    squash_unlock( feedback_queue.lock );
+
+    apply_feedback( batch );
+}
+
+/*
+ * Thread that applies queued feedback.  Whatever has arrived is taken at
+ * once and handed to apply_feedback().
+ */
+void *stats_saver( void *input_data ) {
+    struct timespec gather_time = { 1, 000000000 };
+    feedback_entry_t *batch;
+
+    while( 1 ) {
+        squash_lock( feedback_queue.lock );
+        while( feedback_queue.head == NULL && !squash_quitting() ) {
+            squash_wait( feedback_queue.not_empty, feedback_queue.lock );
+        }
+        squash_unlock( feedback_queue.lock );
+
+        /* main() flushes whatever is left */
+        if( squash_quitting() ) {
+            break;
+        }
+
+        /* Let a run of skips turn into one batch */
+        nanosleep( &gather_time, NULL );
+
+        squash_lock( feedback_queue.lock );
+        batch = feedback_queue.head;
+        feedback_queue.head = NULL;
+        feedback_queue.tail = NULL;
+        feedback_queue.size = 0;
+        squash_unlock( feedback_queue.lock );
+
+        apply_feedback( batch );
+    }
+
+    return (void *)NULL;
+}